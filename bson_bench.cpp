@@ -0,0 +1,296 @@
+/*
+ * This file is part of the libbson-mini distribution
+ * (https://gitlab.com/exceenis/lib/libbson-mini or https://github.com/franck-exceenis/libbson-mini).
+ * Copyright (c) 2020 Franck Duriez
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 3.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "./bson.hpp"
+
+// Every C++ allocation of the process is counted, C allocations are not
+static size_t allocations = 0;
+
+void*
+operator new(size_t size) {
+  ++allocations;
+  void* ptr = malloc(size ? size : 1);
+  if (!ptr) throw std::bad_alloc();
+  return ptr;
+}
+
+void
+operator delete(void* ptr) noexcept {
+  free(ptr);
+}
+
+void
+operator delete(void* ptr, size_t) noexcept {
+  free(ptr);
+}
+
+// Results are folded in here so that the measured work cannot be optimized out
+static volatile uint64_t sink = 0;
+
+struct Document {
+  char const* name;
+  std::vector<char> bson;
+  bson::Object object;
+  std::string key; // Looked up by the find benchmarks
+
+  // Same content, the sizes of every nested document being dropped before each measure
+  mutable bson::Object uncached;
+  std::vector<bson::Object*> objects;
+  std::vector<bson::Array*> arrays;
+};
+
+// Nested documents are allocated apart from their parent, they do not move with the Document
+static void
+collect_documents(Document& document, bson::Variant& value) {
+  if (value.getType() == BSON_OBJECT) {
+    document.objects.push_back(&value.asObject());
+    for (auto& element : value.asObject()) collect_documents(document, element.second);
+  } else if (value.getType() == BSON_ARRAY) {
+    document.arrays.push_back(&value.asArray());
+    for (auto& element : value.asArray()) collect_documents(document, element);
+  }
+}
+
+static Document
+make_document(char const* name, bson::Object object, std::string key) {
+  Document document;
+  document.name     = name;
+  document.bson     = bson::encode(object);
+  document.uncached = object;
+  document.object   = std::move(object);
+  document.key      = std::move(key);
+  for (auto& element : document.uncached) collect_documents(document, element.second);
+  return document;
+}
+
+// A typical event message
+static Document
+small_document(void) {
+  bson::Object obj;
+  obj["type"]      = "event";
+  obj["source"]    = "sensor-0042";
+  obj["timestamp"] = (int64_t) 1600000000000;
+  obj["sequence"]  = (int32_t) 1234;
+  obj["value"]     = 21.5;
+  obj["valid"]     = true;
+
+  bson::Array& tags = obj["tags"].setArray(bson::Array()).asArray();
+  for (char const* tag : {"indoor", "kitchen", "celsius"}) tags.append() = tag;
+
+  bson::Object& location = obj["location"].setObject(bson::Object()).asObject();
+  location["building"]   = "north";
+  location["floor"]      = (int32_t) 3;
+  return make_document("small", std::move(obj), "valid");
+}
+
+// A telemetry row with many top-level columns
+static Document
+wide_document(void) {
+  bson::Object obj;
+  for (int32_t i = 0; i < 1000; ++i) {
+    std::string key = "column" + std::to_string(i);
+    if (i % 2)
+      obj[key] = i;
+    else
+      obj[key] = "value" + std::to_string(i);
+  }
+  return make_document("wide", std::move(obj), "column777");
+}
+
+// Small documents nested in each other
+static Document
+deep_document(void) {
+  bson::Object obj;
+  bson::Object* level = &obj;
+  for (int32_t depth = 0; depth < 64; ++depth) {
+    (*level)["depth"] = depth;
+    (*level)["name"]  = "level";
+    level             = &(*level)["child"].setObject(bson::Object()).asObject();
+  }
+  (*level)["leaf"] = true;
+  return make_document("deep", std::move(obj), "child");
+}
+
+// A few large binary payloads
+static Document
+binary_document(void) {
+  bson::Object obj;
+  for (int i = 0; i < 4; ++i) {
+    bson::Binary binary(BSON_BINARY_BINARY);
+    std::vector<uint8_t> payload(64 * 1024, (uint8_t) i);
+    binary.set(payload.begin(), payload.end());
+    obj["payload" + std::to_string(i)] = std::move(binary);
+  }
+  obj["checksum"] = (int64_t) 0x1234567890;
+  return make_document("binary", std::move(obj), "checksum");
+}
+
+static void
+bench_decode(Document const& document) {
+  sink = sink + bson::decode(document.bson.data()).size();
+}
+
+static void
+bench_decode_arena(Document const& document) {
+  static bson::Arena arena;
+  arena.reset();
+  sink = sink + bson::decode(document.bson.data(), arena).size();
+}
+
+// The encoded size is cached by the object: this measures the cache hit
+static void
+bench_encode_len(Document const& document) {
+  sink = sink + bson::encode_len(document.object);
+}
+
+// Walks the whole tree, after dropping the size of every document, non-const begin() does
+static void
+bench_encode_len_uncached(Document const& document) {
+  document.uncached.begin();
+  for (bson::Object* obj : document.objects) obj->begin();
+  for (bson::Array* array : document.arrays) array->begin();
+  sink = sink + bson::encode_len(document.uncached);
+}
+
+static void
+bench_encode(Document const& document) {
+  sink = sink + bson::encode(document.object).size();
+}
+
+static void
+bench_encode_reuse(Document const& document) {
+  static std::vector<char> output;
+  output.clear();
+  bson::encode(document.object, output);
+  sink = sink + output.size();
+}
+
+static void
+bench_object_find(Document const& document) {
+  sink = sink + (document.object.find(document.key) != document.object.end());
+}
+
+static void
+bench_object_subscript(Document const& document) {
+  sink = sink + document.object[document.key].getType();
+}
+
+static void
+bench_element_count(Document const& document) {
+  sink = sink + bson_get_element_count(document.bson.data());
+}
+
+static void
+bench_next(Document const& document) {
+  char const* elem = document.bson.data() + sizeof(uint32_t);
+  while (*elem != BSON_END) bson_next(elem, &elem);
+  sink = sink + (uintptr_t) elem;
+}
+
+static void
+bench_snprint(Document const& document) {
+  static std::vector<char> output(4 * 1024 * 1024);
+  sink = sink + bson_snprint(output.data(), output.size(), document.bson.data(), 0, 2);
+}
+
+static void
+bench_cpp_print(Document const& document) {
+  std::ostringstream os;
+  bson::print(os, document.object, 0, 2);
+  sink = sink + os.str().size();
+}
+
+typedef struct {
+  char const* name;
+  void (*run)(Document const& document);
+} benchmark_t;
+
+static benchmark_t const benchmarks[] = {
+    {"decode", bench_decode},
+    {"decode_arena", bench_decode_arena},
+    {"encode_len", bench_encode_len},
+    {"encode_len_uncached", bench_encode_len_uncached},
+    {"encode", bench_encode},
+    {"encode_reuse", bench_encode_reuse},
+    {"object_find", bench_object_find},
+    {"object_[]", bench_object_subscript},
+    {"element_count", bench_element_count},
+    {"bson_next", bench_next},
+    {"bson_snprint", bench_snprint},
+    {"cpp_print", bench_cpp_print},
+};
+
+static void
+measure(Document const& document, benchmark_t const& benchmark, double seconds) {
+  typedef std::chrono::steady_clock clock;
+
+  // Warms up caches and lazily built state before counting
+  benchmark.run(document);
+
+  uint64_t iterations           = 0;
+  size_t allocated              = allocations;
+  clock::time_point const start = clock::now();
+  double elapsed                = 0;
+  do {
+    for (int i = 0; i < 16; ++i) benchmark.run(document);
+    iterations += 16;
+    elapsed = std::chrono::duration<double>(clock::now() - start).count();
+  } while (elapsed < seconds);
+  allocated = allocations - allocated;
+
+  double docs = iterations / elapsed;
+  printf(
+      "%-8s %-19s %10.1f MB/s %12.0f docs/s %10.2f allocs/op\n",
+      document.name,
+      benchmark.name,
+      docs * document.bson.size() / 1e6,
+      docs,
+      (double) allocated / iterations);
+}
+
+int
+main(int argc, char** argv) {
+  double seconds     = argc >= 2 ? atof(argv[1]) : 0.2;
+  char const* filter = argc >= 3 ? argv[2] : nullptr;
+  if (seconds <= 0) {
+    printf("usage: %s [seconds per benchmark] [benchmark name filter]\n", argv[0]);
+    return 1;
+  }
+
+  std::vector<Document> documents;
+  documents.push_back(small_document());
+  documents.push_back(wide_document());
+  documents.push_back(deep_document());
+  documents.push_back(binary_document());
+
+  for (benchmark_t const& benchmark : benchmarks) {
+    if (filter && !strstr(benchmark.name, filter)) continue;
+    for (Document const& document : documents) measure(document, benchmark, seconds);
+  }
+
+  return 0;
+}
@@ -0,0 +1,407 @@
+/*
+ * This file is part of the libbson-mini distribution
+ * (https://gitlab.com/exceenis/lib/libbson-mini or https://github.com/franck-exceenis/libbson-mini).
+ * Copyright (c) 2020 Franck Duriez
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 3.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "./bson.h"
+
+// Writes concatenated documents of random content. The same options and seed always give the
+// same bytes, whatever the platform.
+
+typedef enum {
+  GEN_INT32,
+  GEN_INT64,
+  GEN_DOUBLE,
+  GEN_STRING,
+  GEN_BINARY,
+  GEN_BOOL,
+  GEN_NULL,
+  GEN_DOCUMENT,
+  GEN_ARRAY,
+  GEN_TYPE_COUNT,
+} gen_type_t;
+
+static char const* const gen_type_names[GEN_TYPE_COUNT] = {
+    "int32", "int64", "double", "string", "binary", "bool", "null", "document", "array",
+};
+
+typedef struct {
+  uint32_t min;
+  uint32_t max;
+} gen_range_t;
+
+typedef struct {
+  uint64_t count;
+  uint64_t seed;
+  gen_range_t keys;        // Per top-level document
+  gen_range_t nested_keys; // Per subdocument
+  gen_range_t array;       // Array lengths
+  gen_range_t string;      // String sizes, in bytes
+  gen_range_t binary;      // Binary sizes, in bytes
+  uint32_t depth;          // Subdocuments and arrays nested deeper are not generated
+  uint32_t weights[GEN_TYPE_COUNT];
+} gen_options_t;
+
+typedef struct {
+  char const* name;
+  char const* description;
+  char const* arguments;
+} gen_preset_t;
+
+static gen_preset_t const gen_presets[] = {
+    {"event",
+     "~1 KB event messages",
+     "--keys 16:24 --nested-keys 4:8 --depth 2 --array 2:6 --string 8:48 --binary 16:64 "
+     "--types int32:4,int64:2,double:2,string:6,bool:1,null:1,document:1,array:1,binary:1"},
+    {"config",
+     "~5 MB configuration snapshots",
+     "--count 1 --keys 800:800 --nested-keys 20:30 --depth 3 --array 4:16 --string 4:64 "
+     "--types int32:3,double:1,string:4,bool:2,document:3,array:1"},
+    {"telemetry",
+     "wide rows of numeric columns",
+     "--keys 400:600 --depth 0 --string 4:12 --types int32:4,int64:4,double:8,string:1,bool:1"},
+};
+
+// xorshift64*: small, fast and identical everywhere
+static uint64_t
+gen_random(uint64_t* state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 0x2545f4914f6cdd1dULL;
+}
+
+static uint32_t
+gen_uniform(uint64_t* state, gen_range_t range) {
+  return range.min + (uint32_t) (gen_random(state) % ((uint64_t) range.max - range.min + 1));
+}
+
+static gen_type_t
+gen_pick_type(uint64_t* state, uint32_t const* weights, bool nested) {
+  uint32_t total = 0;
+  for (int type = 0; type < GEN_TYPE_COUNT; ++type) {
+    if (nested || (type != GEN_DOCUMENT && type != GEN_ARRAY)) total += weights[type];
+  }
+  if (!total) return GEN_NULL;
+
+  uint32_t pick = (uint32_t) (gen_random(state) % total);
+  for (int type = 0; type < GEN_TYPE_COUNT; ++type) {
+    if (!nested && (type == GEN_DOCUMENT || type == GEN_ARRAY)) continue;
+    if (pick < weights[type]) return (gen_type_t) type;
+    pick -= weights[type];
+  }
+  return GEN_NULL;
+}
+
+static char const* const gen_words[] = {
+    "id",     "name",    "type",   "value", "status",  "timestamp", "source", "target",
+    "count",  "enabled", "config", "level", "payload", "tags",      "region", "version",
+    "device", "user",    "limit",  "rate",  "host",    "port",      "path",   "metrics",
+};
+
+static void
+gen_text(uint64_t* state, char* text, uint32_t size) {
+  static char const alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 ";
+  for (uint32_t i = 0; i < size; ++i) {
+    text[i] = alphabet[gen_random(state) % (sizeof(alphabet) - 1)];
+  }
+}
+
+static void
+gen_elements(
+    bson_builder_t* builder,
+    gen_options_t const* options,
+    uint64_t* state,
+    char* scratch,
+    uint32_t count,
+    uint32_t depth);
+
+// Appends one value of a random type, name is ignored inside arrays
+static void
+gen_value(
+    bson_builder_t* builder,
+    gen_options_t const* options,
+    uint64_t* state,
+    char* scratch,
+    char const* name,
+    uint32_t depth) {
+  switch (gen_pick_type(state, options->weights, depth < options->depth)) {
+    case GEN_INT32: {
+      bson_builder_append_int32(builder, name, (int32_t) gen_random(state));
+      break;
+    }
+
+    case GEN_INT64: {
+      bson_builder_append_int64(builder, name, (int64_t) gen_random(state));
+      break;
+    }
+
+    case GEN_DOUBLE: {
+      double value = (double) (gen_random(state) >> 11) / (double) (1ULL << 53);
+      bson_builder_append_double(builder, name, value * 2000 - 1000);
+      break;
+    }
+
+    case GEN_STRING: {
+      uint32_t size = gen_uniform(state, options->string);
+      gen_text(state, scratch, size);
+      bson_builder_append_utf8(builder, name, scratch, size);
+      break;
+    }
+
+    case GEN_BINARY: {
+      uint32_t size = gen_uniform(state, options->binary);
+      for (uint32_t i = 0; i < size; ++i) scratch[i] = (char) gen_random(state);
+      bson_builder_append_binary(builder, name, scratch, size, BSON_BINARY_BINARY);
+      break;
+    }
+
+    case GEN_BOOL: bson_builder_append_bool(builder, name, gen_random(state) & 1); break;
+    case GEN_NULL: bson_builder_append_null(builder, name); break;
+
+    case GEN_DOCUMENT: {
+      bson_builder_begin_document(builder, name);
+      uint32_t count = gen_uniform(state, options->nested_keys);
+      gen_elements(builder, options, state, scratch, count, depth + 1);
+      bson_builder_end_document(builder);
+      break;
+    }
+
+    case GEN_ARRAY: {
+      bson_builder_begin_array(builder, name);
+      uint32_t count = gen_uniform(state, options->array);
+      for (uint32_t i = 0; i < count; ++i) {
+        gen_value(builder, options, state, scratch, NULL, depth + 1);
+      }
+      bson_builder_end_array(builder);
+      break;
+    }
+
+    case GEN_TYPE_COUNT: break;
+  }
+}
+
+static void
+gen_elements(
+    bson_builder_t* builder,
+    gen_options_t const* options,
+    uint64_t* state,
+    char* scratch,
+    uint32_t count,
+    uint32_t depth) {
+  size_t const word_count = sizeof(gen_words) / sizeof(gen_words[0]);
+  for (uint32_t i = 0; i < count; ++i) {
+    // Names are unique within a document, the word varies their length
+    char name[32];
+    snprintf(name, sizeof(name), "%s%u", gen_words[gen_random(state) % word_count], i);
+    gen_value(builder, options, state, scratch, name, depth);
+  }
+}
+
+static bool
+parse_range(char const* str, gen_range_t* range) {
+  char* end;
+  unsigned long min = strtoul(str, &end, 10);
+  unsigned long max = min;
+  if (*end == ':') max = strtoul(end + 1, &end, 10);
+  if (end == str || *end || min > max || max > INT32_MAX / 2) return false;
+
+  range->min = (uint32_t) min;
+  range->max = (uint32_t) max;
+  return true;
+}
+
+// Comma separated type names, each with an optional :weight (1 by default)
+static bool
+parse_types(char const* str, uint32_t* weights) {
+  memset(weights, 0, GEN_TYPE_COUNT * sizeof(uint32_t));
+  while (*str) {
+    size_t size = strcspn(str, ":,");
+    int type    = 0;
+    while (type < GEN_TYPE_COUNT &&
+           (strlen(gen_type_names[type]) != size || strncmp(str, gen_type_names[type], size)))
+      ++type;
+    if (type == GEN_TYPE_COUNT) return false;
+
+    str += size;
+    weights[type] = 1;
+    if (*str == ':') {
+      char* end;
+      weights[type] = (uint32_t) strtoul(str + 1, &end, 10);
+      if (end == str + 1 || weights[type] > 1000) return false;
+      str = end;
+    }
+
+    if (*str == ',')
+      ++str;
+    else if (*str)
+      return false;
+  }
+
+  return true;
+}
+
+static bool
+parse_option(gen_options_t* options, char const* name, char const* value) {
+  char* end;
+  if (strcmp(name, "--count") == 0) {
+    options->count = strtoull(value, &end, 10);
+    return end != value && !*end;
+  }
+  if (strcmp(name, "--seed") == 0) {
+    options->seed = strtoull(value, &end, 10);
+    return end != value && !*end;
+  }
+  if (strcmp(name, "--depth") == 0) {
+    unsigned long depth = strtoul(value, &end, 10);
+    options->depth      = (uint32_t) depth;
+    return end != value && !*end && depth < BSON_VALIDATE_MAX_DEPTH;
+  }
+  if (strcmp(name, "--keys") == 0) return parse_range(value, &options->keys);
+  if (strcmp(name, "--nested-keys") == 0) return parse_range(value, &options->nested_keys);
+  if (strcmp(name, "--array") == 0) return parse_range(value, &options->array);
+  if (strcmp(name, "--string") == 0) return parse_range(value, &options->string);
+  if (strcmp(name, "--binary") == 0) return parse_range(value, &options->binary);
+  if (strcmp(name, "--types") == 0) return parse_types(value, options->weights);
+  return false;
+}
+
+// Applies the space separated "--name value" pairs of a preset
+static bool
+parse_preset(gen_options_t* options, char const* name) {
+  for (size_t i = 0; i < sizeof(gen_presets) / sizeof(gen_presets[0]); ++i) {
+    if (strcmp(gen_presets[i].name, name) != 0) continue;
+
+    char arguments[512];
+    snprintf(arguments, sizeof(arguments), "%s", gen_presets[i].arguments);
+    char* save;
+    for (char* option = strtok_r(arguments, " ", &save); option;
+         option       = strtok_r(NULL, " ", &save)) {
+      char* value = strtok_r(NULL, " ", &save);
+      if (!value || !parse_option(options, option, value)) return false;
+    }
+    return true;
+  }
+
+  return false;
+}
+
+static void
+usage(char const* program) {
+  fprintf(
+      stderr,
+      "usage: %s [options] [-o output.bson]\n"
+      "  --preset NAME         start from a preset, later options override it\n"
+      "  --count N             documents to write (1000)\n"
+      "  --seed N              random seed (1)\n"
+      "  --keys MIN:MAX        elements per document (16)\n"
+      "  --nested-keys MIN:MAX elements per subdocument (4:8)\n"
+      "  --depth N             maximum nesting of subdocuments and arrays (2)\n"
+      "  --array MIN:MAX       array lengths (2:8)\n"
+      "  --string MIN:MAX      string sizes in bytes (4:32)\n"
+      "  --binary MIN:MAX      binary sizes in bytes (16:256)\n"
+      "  --types LIST          weighted types, as int32:4,string:2,document...\n"
+      "presets:\n",
+      program);
+  for (size_t i = 0; i < sizeof(gen_presets) / sizeof(gen_presets[0]); ++i) {
+    fprintf(stderr, "  %-22s%s\n", gen_presets[i].name, gen_presets[i].description);
+  }
+}
+
+int
+main(int argc, char** argv) {
+  gen_options_t options = {
+      .count       = 1000,
+      .seed        = 1,
+      .keys        = {16, 16},
+      .nested_keys = {4, 8},
+      .array       = {2, 8},
+      .string      = {4, 32},
+      .binary      = {16, 256},
+      .depth       = 2,
+      .weights     = {1, 1, 1, 1, 1, 1, 1, 1, 1},
+  };
+  char const* output_path = NULL;
+
+  for (int i = 1; i < argc; i += 2) {
+    if (strcmp(argv[i], "--help") == 0) {
+      usage(argv[0]);
+      return 0;
+    }
+
+    bool valid = i + 1 < argc;
+    if (valid && strcmp(argv[i], "-o") == 0)
+      output_path = argv[i + 1];
+    else if (valid && strcmp(argv[i], "--preset") == 0)
+      valid = parse_preset(&options, argv[i + 1]);
+    else if (valid)
+      valid = parse_option(&options, argv[i], argv[i + 1]);
+
+    if (!valid) {
+      fprintf(stderr, "Invalid option %s\n", argv[i]);
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  FILE* output = output_path ? fopen(output_path, "wb") : stdout;
+  if (!output) {
+    fprintf(stderr, "Unable to open %s\n", output_path);
+    return 1;
+  }
+
+  // Holds the largest string or binary value
+  uint32_t scratch_size = options.string.max > options.binary.max ? options.string.max
+                                                                    : options.binary.max;
+  char* scratch         = malloc(scratch_size + 1);
+
+  // xorshift never leaves 0
+  uint64_t state = options.seed * 0x9e3779b97f4a7c15ULL;
+  if (!state) state = 1;
+
+  bson_builder_t builder;
+  bson_builder_init(&builder, NULL, 0);
+
+  int ret = 0;
+  for (uint64_t i = 0; i < options.count && scratch; ++i) {
+    bson_builder_reset(&builder);
+    gen_elements(&builder, &options, &state, scratch, gen_uniform(&state, options.keys), 0);
+
+    size_t size;
+    char const* doc = bson_builder_finish(&builder, &size);
+    if (!doc) {
+      fprintf(stderr, "Unable to build document %llu\n", (unsigned long long) i);
+      ret = 2;
+      break;
+    }
+    if (fwrite(doc, 1, size, output) != size) {
+      fprintf(stderr, "Unable to write document %llu\n", (unsigned long long) i);
+      ret = 2;
+      break;
+    }
+  }
+  if (!scratch) ret = 2;
+
+  bson_builder_destroy(&builder);
+  free(scratch);
+  if (output != stdout && fclose(output) != 0) ret = 2;
+  return ret;
+}
@@ -0,0 +1,131 @@
+/*
+ * This file is part of the libbson-mini distribution
+ * (https://gitlab.com/exceenis/lib/libbson-mini or https://github.com/franck-exceenis/libbson-mini).
+ * Copyright (c) 2020 Franck Duriez
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, version 3.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "./bson.h"
+
+static char const*
+archive_error(bson_archive_status_t status) {
+  switch (status) {
+    case BSON_ARCHIVE_OK: return "no error";
+    case BSON_ARCHIVE_ERROR_READ: return "read error";
+    case BSON_ARCHIVE_ERROR_WRITE: return "write error";
+    case BSON_ARCHIVE_ERROR_INVALID: return "invalid or truncated document";
+    case BSON_ARCHIVE_ERROR_INDEX: return "invalid index";
+    case BSON_ARCHIVE_ERROR_STALE: return "index older than the archive, build it again";
+    case BSON_ARCHIVE_ERROR_KEY: return "invalid key path or too many keys";
+    case BSON_ARCHIVE_ERROR_MEMORY: return "out of memory";
+  }
+
+  return "unknown error";
+}
+
+static int
+usage(char const* program) {
+  fprintf(
+      stderr,
+      "usage: %s build <archive.bson> [key path]...\n"
+      "       %s info <archive.bson>\n"
+      "       %s get <archive.bson> <position>\n"
+      "       %s seek <archive.bson> <key path> <integer>\n"
+      "       %s find <archive.bson> <key path> <string>\n"
+      "The index is stored next to the archive, as <archive.bson>" BSON_ARCHIVE_INDEX_SUFFIX "\n",
+      program,
+      program,
+      program,
+      program,
+      program);
+  return 1;
+}
+
+static int
+print_document(bson_archive_t const* archive, uint64_t position) {
+  char const* doc = bson_archive_get(archive, position);
+  if (!doc) {
+    fprintf(stderr, "No such document\n");
+    return 3;
+  }
+
+  bson_sink_t sink;
+  bson_sink_init_stdout(&sink);
+  bson_sink_callback(&sink, "%llu: ", (unsigned long long) position);
+  bson_fnprint(bson_sink_callback, &sink, doc, 0, 2);
+  bson_sink_callback(&sink, "\n");
+  bson_sink_flush(&sink);
+  return 0;
+}
+
+static int
+query(char const* command, char const* archive_path, int argc, char** argv) {
+  bson_archive_t archive;
+  bson_archive_status_t status = bson_archive_open(&archive, archive_path, NULL);
+  if (status != BSON_ARCHIVE_OK) {
+    fprintf(stderr, "Unable to open %s: %s\n", archive_path, archive_error(status));
+    return 2;
+  }
+
+  int ret = 0;
+  if (strcmp(command, "info") == 0 && argc == 0) {
+    printf("%llu documents, %zu bytes\n", (unsigned long long) archive.count, archive.size);
+    for (uint32_t i = 0; i < archive.key_count; ++i) {
+      bson_archive_key_t const* key = &archive.keys[i];
+      printf(
+          "%.*s: %llu integers, %llu strings\n",
+          (int) key->size,
+          key->name,
+          (unsigned long long) key->integer_count,
+          (unsigned long long) key->string_count);
+    }
+  } else if (strcmp(command, "get") == 0 && argc == 1) {
+    ret = print_document(&archive, strtoull(argv[0], NULL, 10));
+  } else if (strcmp(command, "seek") == 0 && argc == 2) {
+    ret = print_document(&archive, bson_archive_seek_int64(&archive, argv[0], atoll(argv[1])));
+  } else if (strcmp(command, "find") == 0 && argc == 2) {
+    uint64_t position = bson_archive_find_utf8(&archive, argv[0], argv[1], strlen(argv[1]));
+    ret               = print_document(&archive, position);
+  } else {
+    ret = -1;
+  }
+
+  bson_archive_close(&archive);
+  return ret;
+}
+
+int
+main(int argc, char** argv) {
+  if (argc < 3) return usage(argv[0]);
+
+  char const* command      = argv[1];
+  char const* archive_path = argv[2];
+  if (strcmp(command, "build") == 0) {
+    char const* const* keys      = (char const* const*) argv + 3;
+    bson_archive_status_t status = bson_archive_index(archive_path, NULL, keys, argc - 3);
+    if (status != BSON_ARCHIVE_OK) {
+      fprintf(stderr, "Unable to index %s: %s\n", archive_path, archive_error(status));
+      return 2;
+    }
+    return 0;
+  }
+
+  int ret = query(command, archive_path, argc - 3, argv + 3);
+  return ret < 0 ? usage(argv[0]) : ret;
+}
@@ -16,6 +16,7 @@
  *   along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <fcntl.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -24,75 +25,75 @@
 
 #include "./bson.h"
 
-int
-parse_file(char const* filepath) {
-  FILE* f = fopen(filepath, "rb");
+static char const*
+reader_error(bson_reader_status_t status) {
+  switch (status) {
+    case BSON_READER_OK:
+    case BSON_READER_EOF: return "no error";
+    case BSON_READER_ERROR_READ: return "read error";
+    case BSON_READER_ERROR_TRUNCATED: return "truncated document";
+    case BSON_READER_ERROR_SIZE: return "invalid document size";
+    case BSON_READER_ERROR_MEMORY: return "out of memory";
+  }
+
+  return "unknown error";
+}
+
+static int
+print_documents(bson_reader_t* reader) {
+  bson_sink_t sink;
+  bson_sink_init_stdout(&sink);
 
-  fseek(f, 0L, SEEK_END);
-  size_t file_size = ftell(f);
-  fseek(f, 0L, SEEK_SET);
+  bson_reader_status_t status;
+  char const* doc;
+  while ((doc = bson_reader_next(reader, &status))) {
+    bson_fnprint(bson_sink_callback, &sink, doc, 0, 2);
+    bson_sink_callback(&sink, "\n");
+  }
 
-  size_t buffer_size = file_size + 1;
-  char* buffer       = (char*) malloc(buffer_size);
-  fread(buffer, 1, buffer_size, f);
-  fclose(f);
+  bson_sink_flush(&sink);
+  bson_reader_destroy(reader);
 
-  bson_print(buffer, 0, 2);
+  if (status != BSON_READER_EOF) {
+    fprintf(stderr, "Unable to read bson: %s\n", reader_error(status));
+    return 2;
+  }
 
-  free(buffer);
   return 0;
 }
 
 int
-parse_stdin(void) {
-  uint32_t size         = 0;
-  char header_buffer[4] = {0};
-  {
-    ssize_t readBytes = read(STDIN_FILENO, header_buffer, sizeof(header_buffer));
-    if (readBytes != sizeof(header_buffer)) {
-      fprintf(stderr, "Unable to read bson size");
-      return 1;
-    }
-
-    size = bson_get_size(header_buffer, NULL);
-
-    if (size < 5) {
-      fprintf(stderr, "Invalid bson size: %lu", (long unsigned) size);
-      return 2;
-    }
-  }
+parse_fd(int fd) {
+  bson_reader_t reader;
+  bson_reader_init_fd(&reader, fd, NULL, 0);
+  return print_documents(&reader);
+}
 
-  char* buffer = (char*) malloc(size);
-  memcpy(buffer, header_buffer, sizeof(header_buffer));
-  {
-    ssize_t readBytes =
-        read(STDIN_FILENO, buffer + sizeof(header_buffer), size - sizeof(header_buffer));
-    if (readBytes != (ssize_t)(size - sizeof(header_buffer))) {
-      fprintf(
-          stderr,
-          "Unable to read bson body expect %lu bytes but got only %lu",
-          (long unsigned) size,
-          (long unsigned) (readBytes + sizeof(header_buffer)));
-      free(buffer);
-      return 3;
-    }
-
-    bson_print(buffer, 0, 2);
+int
+parse_file(char const* filepath) {
+  bson_reader_t reader;
+  if (bson_reader_init_mmap(&reader, filepath) == BSON_READER_OK) return print_documents(&reader);
+
+  // Not mappable (pipe, special file...): stream it instead
+  int fd = open(filepath, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Unable to open %s\n", filepath);
+    return 1;
   }
 
-  free(buffer);
-  return 0;
+  int ret = parse_fd(fd);
+  close(fd);
+  return ret;
 }
 
 int
 main(int argc, char** argv) {
+  if (argc >= 2) return parse_file(argv[1]);
+
   if (isatty(fileno(stdin))) {
-    if (argc < 2) {
-      printf("usage: %s <file.bson>\n", argv[0]);
-      return 1;
-    }
-    return parse_file(argv[1]);
+    printf("usage: %s <file.bson>\n", argv[0]);
+    return 1;
   }
 
-  return parse_stdin();
+  return parse_fd(STDIN_FILENO);
 }
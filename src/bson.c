@@ -18,10 +18,16 @@
 
 #include "./bson.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 uint32_t
@@ -95,30 +101,31 @@ int32_t
 bson_get_element_value_int32(char const* elem, char const** next) {
   uint8_t const* uelem = (uint8_t const*) elem;
 
-  int32_t result = uelem[0];
-  result |= uelem[1] << 8;
-  result |= uelem[2] << 16;
-  result |= uelem[3] << 24;
+  uint32_t result = uelem[0];
+  result |= (uint32_t) uelem[1] << 8;
+  result |= (uint32_t) uelem[2] << 16;
+  result |= (uint32_t) uelem[3] << 24;
   if (next) *next = elem + sizeof(result);
-  return result;
+  return (int32_t) result;
 }
 
 int64_t
 bson_get_element_value_int64(char const* elem, char const** next) {
   uint8_t const* uelem = (uint8_t const*) elem;
 
-  int64_t result = uelem[4];
-  result |= uelem[5] << 8;
-  result |= uelem[6] << 16;
-  result |= uelem[7] << 24;
+  // Unsigned arithmetic, a sign extended low half would overwrite the high one
+  uint64_t result = uelem[4];
+  result |= (uint64_t) uelem[5] << 8;
+  result |= (uint64_t) uelem[6] << 16;
+  result |= (uint64_t) uelem[7] << 24;
   result <<= 32;
-  result |= uelem[0] << 0;
-  result |= uelem[1] << 8;
-  result |= uelem[2] << 16;
-  result |= uelem[3] << 24;
+  result |= (uint64_t) uelem[0] << 0;
+  result |= (uint64_t) uelem[1] << 8;
+  result |= (uint64_t) uelem[2] << 16;
+  result |= (uint64_t) uelem[3] << 24;
 
   if (next) *next = elem + sizeof(result);
-  return result;
+  return (int64_t) result;
 }
 
 bool
@@ -135,26 +142,503 @@ bson_get_element_value_double(char const* elem, char const** next) {
   return result;
 }
 
+// How to find the end of a value from its element type. Fixed-width values are width bytes
+// long, sized ones are width bytes plus the size read at their start.
+
+enum {
+  SKIP_INVALID = 0,
+  SKIP_FIXED,
+  SKIP_SIZED,
+  SKIP_REGEX, // Two C strings
+};
+
+typedef struct {
+  uint8_t kind;
+  uint8_t width;
+} skip_entry_t;
+
+static skip_entry_t const skip_table[256] = {
+    [BSON_DOUBLE]            = {SKIP_FIXED, 8},
+    [BSON_STRING]            = {SKIP_SIZED, 4},
+    [BSON_OBJECT]            = {SKIP_SIZED, 0},
+    [BSON_ARRAY]             = {SKIP_SIZED, 0},
+    [BSON_BINARY]            = {SKIP_SIZED, 5},
+    [BSON_UNDEFINED]         = {SKIP_FIXED, 0},
+    [BSON_OBJECTID]          = {SKIP_FIXED, 12},
+    [BSON_BOOLEAN]           = {SKIP_FIXED, 1},
+    [BSON_DATE]              = {SKIP_FIXED, 8},
+    [BSON_NULL]              = {SKIP_FIXED, 0},
+    [BSON_REGEX]             = {SKIP_REGEX, 0},
+    [BSON_DBPOINTER]         = {SKIP_SIZED, 16},
+    [BSON_JAVASCRIPT]        = {SKIP_SIZED, 4},
+    [BSON_SYMBOL]            = {SKIP_SIZED, 4},
+    [BSON_SCOPED_JAVASCRIPT] = {SKIP_SIZED, 0},
+    [BSON_INT32]             = {SKIP_FIXED, 4},
+    [BSON_TIMESTAMP]         = {SKIP_FIXED, 8},
+    [BSON_INT64]             = {SKIP_FIXED, 8},
+    [BSON_DECI128]           = {SKIP_FIXED, 16},
+    [BSON_MAXKEY]            = {SKIP_FIXED, 0},
+    [BSON_MINKEY]            = {SKIP_FIXED, 0},
+};
+
+// End of the value of an element of the given type, NULL for unknown types
+static inline char const*
+skip_value(uint8_t type, char const* value) {
+  skip_entry_t entry = skip_table[type];
+  if (entry.kind == SKIP_FIXED) return value + entry.width;
+  if (entry.kind == SKIP_SIZED) return value + entry.width + bson_get_size(value, NULL);
+  if (entry.kind == SKIP_REGEX) {
+    value += strlen(value) + 1;
+    return value + strlen(value) + 1;
+  }
+
+  return NULL;
+}
+
 uint32_t
 bson_get_element_count(char const* object) {
   // Skip object size
   object += sizeof(uint32_t);
 
   uint32_t count = 0;
-  while (1) {
-    bson_element_t type = bson_get_element_type(object, NULL);
-    if (type == BSON_END) break;
-
+  while (object && *object != BSON_END) {
     ++count;
-    bson_next(object, &object);
+    object = skip_value((uint8_t) *object, object + strlen(object + 1) + 2);
   }
 
   return count;
 }
 
+// FNV-1a of the name, computed in the same loop as its size
+static uint32_t
+name_hash(char const* name, size_t* size, uint32_t seed) {
+  uint32_t hash  = 2166136261u ^ seed;
+  char const* it = name;
+  for (; *it; ++it) hash = (hash ^ (uint8_t) *it) * 16777619u;
+  *size = it - name;
+  return hash ^ (hash >> 15);
+}
+
+bool
+bson_projection_compile(bson_projection_t* projection, char const* const* names, uint32_t count) {
+  projection->count = 0;
+  if (count > BSON_PROJECTION_MAX_FIELDS) return false;
+
+  for (uint32_t i = 0; i < count; ++i) {
+    projection->names[i] = names[i];
+    projection->sizes[i] = (uint32_t) strlen(names[i]);
+    for (uint32_t j = 0; j < i; ++j) {
+      if (strcmp(names[i], names[j]) == 0) return false;
+    }
+  }
+
+  // Smallest table, at least twice the field count, where a seed gives each name its own bucket
+  uint32_t table_size = 2;
+  while (table_size < 2 * count) table_size *= 2;
+  for (; table_size <= BSON_PROJECTION_MAX_TABLE; table_size *= 2) {
+    for (uint32_t seed = 0; seed < 1024; ++seed) {
+      memset(projection->table, 0, table_size);
+
+      uint32_t i = 0;
+      for (; i < count; ++i) {
+        size_t size;
+        uint32_t bucket = name_hash(names[i], &size, seed) & (table_size - 1);
+        if (projection->table[bucket]) break;
+        projection->table[bucket] = (uint8_t) (i + 1);
+      }
+
+      if (i == count) {
+        projection->count = count;
+        projection->seed  = seed;
+        projection->mask  = table_size - 1;
+        return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+uint32_t
+bson_projection_extract(
+    bson_projection_t const* projection,
+    char const* obj,
+    bson_projection_slot_t* slots) {
+  for (uint32_t i = 0; i < projection->count; ++i) {
+    slots[i].elem  = NULL;
+    slots[i].value = NULL;
+    slots[i].type  = BSON_END;
+  }
+
+  uint32_t found = 0;
+  char const* it = obj + sizeof(uint32_t);
+  while (found < projection->count && *it != BSON_END) {
+    uint8_t type = (uint8_t) *it;
+    size_t name_size;
+    uint32_t hash     = name_hash(it + 1, &name_size, projection->seed);
+    char const* value = it + 2 + name_size;
+
+    // The first occurrence of a field wins
+    uint32_t field = projection->table[hash & projection->mask];
+    if (field && projection->sizes[field - 1] == name_size &&
+        memcmp(projection->names[field - 1], it + 1, name_size) == 0 && !slots[field - 1].elem) {
+      bson_projection_slot_t* slot = &slots[field - 1];
+      slot->elem                   = it;
+      slot->value                  = value;
+      slot->type                   = (bson_element_t) type;
+      ++found;
+    }
+
+    it = skip_value(type, value);
+    if (!it) break;
+  }
+
+  return found;
+}
+
+static uint32_t
+index_table_size(uint32_t count) {
+  uint32_t table_size = 2;
+  while (table_size < 2 * count) table_size *= 2;
+  return table_size;
+}
+
+size_t
+bson_index_storage_size(char const* obj, uint32_t flags) {
+  size_t count   = 0;
+  char const* it = obj + sizeof(uint32_t);
+  while (it && *it != BSON_END) {
+    ++count;
+    it = skip_value((uint8_t) *it, it + strlen(it + 1) + 2);
+  }
+
+  if (flags & BSON_INDEX_KEYS) count += index_table_size((uint32_t) count);
+  return count * sizeof(uint32_t);
+}
+
+bool
+bson_index_build(
+    bson_index_t* index,
+    char const* obj,
+    uint32_t flags,
+    void* storage,
+    size_t storage_size) {
+  uint32_t* offsets = (uint32_t*) storage;
+  size_t capacity   = storage_size / sizeof(uint32_t);
+  uint32_t count    = 0;
+
+  char const* it = obj + sizeof(uint32_t);
+  while (*it != BSON_END) {
+    if (count == capacity) return false;
+    offsets[count++] = (uint32_t) (it - obj);
+
+    it = skip_value((uint8_t) *it, it + strlen(it + 1) + 2);
+    if (!it) return false;
+  }
+
+  index->obj     = obj;
+  index->offsets = offsets;
+  index->count   = count;
+  index->buckets = NULL;
+  index->mask    = 0;
+  if (!(flags & BSON_INDEX_KEYS)) return true;
+
+  // Open addressing with linear probing after the offsets, duplicate names keep document order
+  uint32_t table_size = index_table_size(count);
+  if (capacity - count < table_size) return false;
+
+  uint32_t* buckets = offsets + count;
+  memset(buckets, 0, table_size * sizeof(uint32_t));
+  for (uint32_t i = 0; i < count; ++i) {
+    size_t size;
+    uint32_t bucket = name_hash(obj + offsets[i] + 1, &size, 0) & (table_size - 1);
+    while (buckets[bucket]) bucket = (bucket + 1) & (table_size - 1);
+    buckets[bucket] = i + 1;
+  }
+
+  index->buckets = buckets;
+  index->mask    = table_size - 1;
+  return true;
+}
+
+char const*
+bson_index_at(bson_index_t const* index, uint32_t position) {
+  return position < index->count ? index->obj + index->offsets[position] : NULL;
+}
+
+char const*
+bson_index_find(bson_index_t const* index, char const* key) {
+  if (!index->buckets) {
+    for (uint32_t i = 0; i < index->count; ++i) {
+      char const* elem = index->obj + index->offsets[i];
+      if (strcmp(elem + 1, key) == 0) return elem;
+    }
+    return NULL;
+  }
+
+  size_t size;
+  uint32_t bucket = name_hash(key, &size, 0) & index->mask;
+  for (; index->buckets[bucket]; bucket = (bucket + 1) & index->mask) {
+    char const* elem = index->obj + index->offsets[index->buckets[bucket] - 1];
+    if (strcmp(elem + 1, key) == 0) return elem;
+  }
+  return NULL;
+}
+
+// Size of the valid multibyte UTF-8 sequence starting str, 0 when it is invalid
+static size_t
+utf8_sequence_size(uint8_t const* str, size_t size) {
+  uint32_t codepoint;
+  size_t length;
+  if ((*str & 0xe0) == 0xc0) {
+    codepoint = *str & 0x1f;
+    length    = 2;
+  } else if ((*str & 0xf0) == 0xe0) {
+    codepoint = *str & 0x0f;
+    length    = 3;
+  } else if ((*str & 0xf8) == 0xf0) {
+    codepoint = *str & 0x07;
+    length    = 4;
+  } else {
+    return 0;
+  }
+
+  if (size < length) return 0;
+  for (size_t i = 1; i < length; ++i) {
+    if ((str[i] & 0xc0) != 0x80) return 0;
+    codepoint = (codepoint << 6) | (str[i] & 0x3f);
+  }
+
+  // Overlong encodings, surrogates and out of range code points
+  static uint32_t const min_codepoint[] = {0, 0, 0x80, 0x800, 0x10000};
+  if (codepoint < min_codepoint[length]) return 0;
+  if (codepoint >= 0xd800 && codepoint <= 0xdfff) return 0;
+  if (codepoint > 0x10ffff) return 0;
+  return length;
+}
+
+static bool
+validate_utf8(uint8_t const* str, size_t size) {
+  uint8_t const* end = str + size;
+  while (str < end) {
+    // ASCII fast path, 8 bytes at a time
+    while (end - str >= 8) {
+      uint64_t word;
+      memcpy(&word, str, sizeof(word));
+      if (word & 0x8080808080808080ull) break;
+      str += 8;
+    }
+
+    if (str == end) break;
+    if (*str < 0x80) {
+      ++str;
+      continue;
+    }
+
+    size_t length = utf8_sequence_size(str, end - str);
+    if (!length) return false;
+    str += length;
+  }
+
+  return true;
+}
+
+static bool
+validate_cstring(char const* it, char const* end, uint32_t flags, char const** next) {
+  char const* nul = memchr(it, 0, end - it);
+  if (!nul) return false;
+  if ((flags & BSON_VALIDATE_UTF8) && !validate_utf8((uint8_t const*) it, nul - it)) return false;
+  *next = nul + 1;
+  return true;
+}
+
+static bool
+validate_string(char const* it, char const* end, uint32_t flags, char const** next) {
+  if (end - it < (ptrdiff_t) sizeof(uint32_t)) return false;
+
+  uint32_t size = bson_get_size(it, &it);
+  if (size < 1 || size > (size_t)(end - it) || it[size - 1] != 0) return false;
+  if ((flags & BSON_VALIDATE_UTF8) && !validate_utf8((uint8_t const*) it, size - 1)) return false;
+
+  *next = it + size;
+  return true;
+}
+
+static bool
+validate_object(char const* obj, char const* end, uint32_t flags, int depth, char const** error);
+
+// MinKey and MaxKey have no value
+static bool
+validate_element_type(uint8_t type) {
+  return (type >= BSON_DOUBLE && type <= BSON_DECI128) || type == BSON_MAXKEY ||
+         type == BSON_MINKEY;
+}
+
+// On failure, *next points to the offending byte
+static bool
+validate_element_value(
+    uint8_t type,
+    char const* it,
+    char const* end,
+    uint32_t flags,
+    int depth,
+    char const** next) {
+  size_t fixed_size = 0;
+  switch (type) {
+    case BSON_UNDEFINED:
+    case BSON_NULL:
+    case BSON_MAXKEY:
+    case BSON_MINKEY: fixed_size = 0; break;
+    case BSON_BOOLEAN: {
+      if (it < end && (uint8_t) *it > 1) {
+        *next = it;
+        return false;
+      }
+      fixed_size = 1;
+      break;
+    }
+    case BSON_INT32: fixed_size = 4; break;
+    case BSON_DOUBLE:
+    case BSON_DATE:
+    case BSON_TIMESTAMP:
+    case BSON_INT64: fixed_size = 8; break;
+    case BSON_OBJECTID: fixed_size = 12; break;
+    case BSON_DECI128: fixed_size = 16; break;
+
+    case BSON_STRING:
+    case BSON_JAVASCRIPT:
+    case BSON_SYMBOL: {
+      char const* value = it;
+      if (!validate_string(it, end, flags, next)) {
+        *next = value;
+        return false;
+      }
+      return true;
+    }
+
+    case BSON_OBJECT:
+    case BSON_ARRAY: {
+      if (!validate_object(it, end, flags, depth + 1, next)) return false;
+      *next = it + bson_get_size(it, NULL);
+      return true;
+    }
+
+    case BSON_BINARY: {
+      *next = it;
+      if (end - it < 5) return false;
+
+      uint32_t size         = bson_get_size(it, NULL);
+      bson_binary_t subtype = (uint8_t) it[4];
+      if (size > (size_t)(end - it - 5)) return false;
+      if (subtype == BSON_BINARY_OLD_BINARY &&
+          (size < 4 || bson_get_size(it + 5, NULL) != size - 4))
+        return false;
+
+      *next = it + 5 + size;
+      return true;
+    }
+
+    case BSON_REGEX: {
+      char const* pattern = it;
+      if (!validate_cstring(it, end, flags, &it) || !validate_cstring(it, end, flags, next)) {
+        *next = pattern;
+        return false;
+      }
+      return true;
+    }
+
+    case BSON_DBPOINTER: {
+      char const* value = it;
+      if (!validate_string(it, end, flags, &it) || end - it < 12) {
+        *next = value;
+        return false;
+      }
+      *next = it + 12;
+      return true;
+    }
+
+    case BSON_SCOPED_JAVASCRIPT: {
+      *next = it;
+      if (end - it < (ptrdiff_t) sizeof(uint32_t)) return false;
+
+      uint32_t size = bson_get_size(it, NULL);
+      if (size < 14 || size > (size_t)(end - it)) return false;
+
+      char const* scope_end = it + size;
+      char const* code      = it + sizeof(uint32_t);
+      char const* scope;
+      if (!validate_string(code, scope_end, flags, &scope)) {
+        *next = code;
+        return false;
+      }
+      if (!validate_object(scope, scope_end, flags, depth + 1, next)) return false;
+      if (scope + bson_get_size(scope, NULL) != scope_end) {
+        *next = it;
+        return false;
+      }
+
+      *next = scope_end;
+      return true;
+    }
+
+    default: *next = it; return false;
+  }
+
+  if (fixed_size > (size_t)(end - it)) {
+    *next = it;
+    return false;
+  }
+
+  *next = it + fixed_size;
+  return true;
+}
+
+// On failure, *error points to the offending byte
+static bool
+validate_object(char const* obj, char const* end, uint32_t flags, int depth, char const** error) {
+  *error = obj;
+  if (depth > BSON_VALIDATE_MAX_DEPTH) return false;
+  if (end - obj < 5) return false;
+
+  uint32_t size = bson_get_size(obj, NULL);
+  if (size < 5 || size > (size_t)(end - obj) || obj[size - 1] != 0) return false;
+
+  char const* it      = obj + sizeof(uint32_t);
+  char const* obj_end = obj + size - 1;
+  while (it < obj_end) {
+    uint8_t type = (uint8_t) *it;
+    if (!validate_element_type(type)) {
+      *error = it;
+      return false;
+    }
+
+    if (!validate_cstring(it + 1, obj_end, flags, &it)) {
+      *error = it + 1;
+      return false;
+    }
+
+    char const* next;
+    if (!validate_element_value(type, it, obj_end, flags, depth, &next)) {
+      *error = next;
+      return false;
+    }
+    it = next;
+  }
+
+  return true;
+}
+
+bool
+bson_validate(char const* obj, size_t size, uint32_t flags, size_t* error_offset) {
+  char const* error = obj;
+  bool result       = validate_object(obj, obj + size, flags, 0, &error);
+  if (error_offset) *error_offset = result ? 0 : (size_t)(error - obj);
+  return result;
+}
+
 static void
 print_indent(bson_fnprint_callback_t callback, void* callback_data, size_t indent) {
-  for (size_t i = 0; i < indent; ++i) callback(callback_data, " ");
+  if (indent) callback(callback_data, "%*s", (int) indent, "");
 }
 
 static void
@@ -228,12 +712,19 @@ bson_print_object_or_array(
         uint8_t const* ubinary = (uint8_t const*) binary;
         callback(callback_data, "binary(size=%u,subtype=%d) <", bin_size, (int) subtype);
         static const uint32_t line_size = 32;
+        static char const hex[]         = "0123456789abcdef";
         for (uint32_t i = 0; i < bin_size;) {
+          char line[2 * line_size + 1];
+          uint32_t len = 0;
+          for (; i < bin_size && len < 2 * line_size; len += 2, ++i) {
+            line[len]     = hex[ubinary[i] >> 4];
+            line[len + 1] = hex[ubinary[i] & 0xf];
+          }
+          line[len] = 0;
+
           callback(callback_data, "\n");
           print_indent(callback, callback_data, indent + 2 * indent_step);
-          for (uint32_t len = 0; i < bin_size && len < line_size; ++len, ++i) {
-            callback(callback_data, "%02x", ubinary[i]);
-          }
+          callback(callback_data, "%s", line);
         }
         callback(callback_data, "\n");
         print_indent(callback, callback_data, indent + indent_step);
@@ -257,7 +748,18 @@ bson_print_object_or_array(
         break;
       }
 
-      default: callback(callback_data, "Not handled: %d\n", (int) type); return;
+      default: {
+        // Other types are only shown by their code
+        char const* end = skip_value((uint8_t) type, obj);
+        if (!end) {
+          callback(callback_data, "Not handled: %d\n", (int) type);
+          return;
+        }
+
+        callback(callback_data, "type(0x%02x,size=%u)", (unsigned) type, (unsigned) (end - obj));
+        obj = end;
+        break;
+      }
     }
 
     type = bson_get_element_type(obj, &obj);
@@ -283,24 +785,112 @@ bson_print_object_or_array(
   }
 }
 
-static int
-dprint_callback(void* data, char const* format, ...) {
+void
+bson_sink_init(
+    bson_sink_t* sink,
+    bson_sink_write_callback_t write,
+    void* write_data,
+    char* buffer,
+    size_t buffer_size) {
+  sink->write      = write;
+  sink->write_data = write_data;
+  sink->fd         = -1;
+  sink->buffer     = buffer;
+  sink->size       = buffer_size;
+  sink->used       = 0;
+  sink->error      = false;
+}
+
+static ptrdiff_t
+sink_fd_callback(void* data, void const* buffer, size_t size) {
+  bson_sink_t* sink  = (bson_sink_t*) data;
+  char const* it     = (char const*) buffer;
+  char const* it_end = it + size;
+  while (it < it_end) {
+    ssize_t ret = write(sink->fd, it, it_end - it);
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret <= 0) return -1;
+    it += ret;
+  }
+
+  return size;
+}
+
+void
+bson_sink_init_fd(bson_sink_t* sink, int fd, char* buffer, size_t buffer_size) {
+  bson_sink_init(sink, sink_fd_callback, sink, buffer, buffer_size);
+  sink->fd = fd;
+}
+
+void
+bson_sink_init_stdout(bson_sink_t* sink) {
+  static char buffer[BSON_SINK_STDOUT_BUFFER_SIZE];
+  bson_sink_init_fd(sink, STDOUT_FILENO, buffer, sizeof(buffer));
+}
+
+static void
+sink_write(bson_sink_t* sink, char const* data, size_t size) {
+  if (size && sink->write(sink->write_data, data, size) < 0) sink->error = true;
+}
+
+bool
+bson_sink_flush(bson_sink_t* sink) {
+  sink_write(sink, sink->buffer, sink->used);
+  sink->used = 0;
+  return !sink->error;
+}
+
+int
+bson_sink_callback(void* data, char const* format, ...) {
+  bson_sink_t* sink = (bson_sink_t*) data;
+  size_t available  = sink->size - sink->used;
+
   va_list list;
   va_start(list, format);
-  int ret = vdprintf(*(int*) data, format, list);
+
+  va_list copy;
+  va_copy(copy, list);
+  int ret = vsnprintf(sink->buffer + sink->used, available, format, copy);
+  va_end(copy);
+
+  if (ret >= 0 && (size_t) ret >= available) {
+    bson_sink_flush(sink);
+
+    if ((size_t) ret < sink->size) {
+      vsnprintf(sink->buffer, sink->size, format, list);
+      sink->used = ret;
+    } else {
+      // Larger than the whole buffer: format it aside and write it directly
+      char* tmp = malloc(ret + 1);
+      if (tmp) {
+        vsnprintf(tmp, ret + 1, format, list);
+        sink_write(sink, tmp, ret);
+        free(tmp);
+      } else {
+        sink->error = true;
+      }
+    }
+  } else if (ret > 0) {
+    sink->used += ret;
+  }
+
   va_end(list);
   return ret;
 }
 
 void
 bson_print(char const* obj, size_t indent, size_t indent_step) {
-  int fd = STDOUT_FILENO;
-  bson_print_object_or_array(dprint_callback, &fd, obj, indent, indent_step, BSON_OBJECT, true);
+  bson_dprint(STDOUT_FILENO, obj, indent, indent_step);
 }
 
 void
 bson_dprint(int fd, char const* obj, size_t indent, size_t indent_step) {
-  bson_print_object_or_array(dprint_callback, &fd, obj, indent, indent_step, BSON_OBJECT, true);
+  char buffer[BSON_PRINT_BUFFER_SIZE];
+  bson_sink_t sink;
+  bson_sink_init_fd(&sink, fd, buffer, sizeof(buffer));
+  bson_print_object_or_array(
+      bson_sink_callback, &sink, obj, indent, indent_step, BSON_OBJECT, true);
+  bson_sink_flush(&sink);
 }
 
 typedef struct {
@@ -345,162 +935,2870 @@ bson_fnprint(
   bson_print_object_or_array(callback, callback_data, obj, indent, indent_step, BSON_OBJECT, true);
 }
 
+// Always NUL terminated target of buffers without storage, never written to
+static char buffer_empty[1];
+
 void
-bson_set_size(char* obj, uint32_t size, char** next) {
-  uint8_t* uobj = (uint8_t*) obj;
+bson_buffer_init(bson_buffer_t* buffer, char* data, size_t capacity) {
+  if (!data || !capacity) {
+    data     = buffer_empty;
+    capacity = 0;
+  }
 
-  uobj[0] = size >> 0;
-  uobj[1] = size >> 8;
-  uobj[2] = size >> 16;
-  uobj[3] = size >> 24;
+  buffer->data      = data;
+  buffer->size      = 0;
+  buffer->capacity  = capacity;
+  buffer->owns_data = false;
+  if (capacity) data[0] = 0;
+}
 
-  if (next) *next = obj + sizeof(uint32_t);
+bool
+bson_buffer_reserve(bson_buffer_t* buffer, size_t size) {
+  // One byte is always kept for the NUL terminator
+  if (size < buffer->capacity - buffer->size) return true;
+  if (size >= SIZE_MAX / 2 - buffer->size) return false;
+
+  size_t needed   = buffer->size + size + 1;
+  size_t capacity = buffer->capacity < 256 ? 256 : buffer->capacity;
+  while (capacity < needed) capacity *= 2;
+
+  char* data;
+  if (buffer->owns_data) {
+    data = realloc(buffer->data, capacity);
+    if (!data) return false;
+  } else {
+    data = malloc(capacity);
+    if (!data) return false;
+    memcpy(data, buffer->data, buffer->size + 1);
+  }
+
+  buffer->data      = data;
+  buffer->capacity  = capacity;
+  buffer->owns_data = true;
+  return true;
 }
 
-void
-bson_set_element_type(char* elem, bson_element_t type, char** next) {
-  *elem = type;
-  if (next) *next = elem + 1;
+bool
+bson_buffer_append(bson_buffer_t* buffer, void const* data, size_t size) {
+  if (!bson_buffer_reserve(buffer, size)) return false;
+  memcpy(buffer->data + buffer->size, data, size);
+  buffer->size += size;
+  buffer->data[buffer->size] = 0;
+  return true;
 }
 
 void
-bson_set_element_name(char* elem, char const* name, uint32_t name_size, char** next) {
-  memcpy(elem, name, name_size);
-  elem[name_size] = 0;
-  if (next) *next = elem + name_size + 1;
+bson_buffer_clear(bson_buffer_t* buffer) {
+  buffer->size = 0;
+  if (buffer->capacity) buffer->data[0] = 0;
 }
 
 void
-bson_set_element_value_string(char* elem, char const* str, uint32_t str_size, char** next) {
-  memcpy(elem + sizeof(uint32_t), str, str_size + 1);
-
-  uint8_t* uelem = (uint8_t*) elem;
-  uint32_t size  = str_size + 1;
+bson_buffer_destroy(bson_buffer_t* buffer) {
+  if (buffer->owns_data) free(buffer->data);
+  bson_buffer_init(buffer, NULL, 0);
+}
 
-  uelem[0] = size >> 0;
-  uelem[1] = size >> 8;
-  uelem[2] = size >> 16;
-  uelem[3] = size >> 24;
+// Extended JSON writer. Output is reserved in bulk and formatted in place, without printf
+// except for doubles.
 
-  if (next) *next = elem + size + sizeof(str_size);
+typedef struct {
+  bson_buffer_t* output;
+  bson_json_mode_t mode;
+  bool error;
+} json_writer_t;
+
+static char const json_hex[] = "0123456789abcdef";
+
+static char const json_digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324"
+    "25262728293031323334353637383940414243444546474849"
+    "50515253545556575859606162636465666768697071727374"
+    "75767778798081828384858687888990919293949596979899";
+
+// Escape letters of control characters, 'u' when only \u00XX can be used
+static char const json_control_escapes[33] = "uuuuuuuubtnufruuuuuuuuuuuuuuuuuu";
+
+// Returns room for size bytes at the end of the output, NULL once memory is exhausted
+static char*
+json_reserve(json_writer_t* writer, size_t size) {
+  if (writer->error) return NULL;
+  if (!bson_buffer_reserve(writer->output, size)) {
+    writer->error = true;
+    return NULL;
+  }
+  return writer->output->data + writer->output->size;
 }
 
-void
-bson_set_element_value_int32(char* elem, int32_t value, char** next) {
-  elem[0] = value >> 0;
-  elem[1] = value >> 8;
-  elem[2] = value >> 16;
-  elem[3] = value >> 24;
+static void
+json_commit(json_writer_t* writer, char const* end) {
+  writer->output->size = end - writer->output->data;
+}
 
-  if (next) *next = elem + sizeof(value);
+static void
+json_write(json_writer_t* writer, void const* data, size_t size) {
+  char* it = json_reserve(writer, size);
+  if (!it) return;
+  memcpy(it, data, size);
+  writer->output->size += size;
 }
 
-void
-bson_set_element_value_int64(char* elem, int64_t value, char** next) {
-  elem[0] = value >> 0;
-  elem[1] = value >> 8;
-  elem[2] = value >> 16;
-  elem[3] = value >> 24;
-  elem[4] = value >> 32;
-  elem[5] = value >> 40;
-  elem[6] = value >> 48;
-  elem[7] = value >> 56;
+#define json_literal(writer, str) json_write(writer, str, sizeof(str) - 1)
+
+static char*
+json_format_uint64(char* it, uint64_t value) {
+  char digits[20];
+  char* first = digits + sizeof(digits);
+  while (value >= 100) {
+    char const* pair = json_digit_pairs + (value % 100) * 2;
+    value /= 100;
+    *--first = pair[1];
+    *--first = pair[0];
+  }
+  if (value >= 10) {
+    char const* pair = json_digit_pairs + value * 2;
+    *--first         = pair[1];
+    *--first         = pair[0];
+  } else {
+    *--first = (char) ('0' + value);
+  }
 
-  if (next) *next = elem + sizeof(value);
+  size_t size = digits + sizeof(digits) - first;
+  memcpy(it, first, size);
+  return it + size;
 }
 
-void
-bson_set_element_value_double(char* elem, double value, char** next) {
-  memcpy(elem, &value, sizeof(value));
-  if (next) *next = elem + sizeof(value);
+static char*
+json_format_int64(char* it, int64_t value) {
+  uint64_t magnitude = (uint64_t) value;
+  if (value < 0) {
+    *it++     = '-';
+    magnitude = 0 - magnitude;
+  }
+  return json_format_uint64(it, magnitude);
 }
 
-void
-bson_set_element_value_binary(
-    char* elem,
-    void const* binary,
-    uint32_t size,
-    bson_binary_t subtype,
-    char** next) {
-
-  uint8_t* uelem = (uint8_t*) elem;
+// Writes value zero padded to exactly width digits
+static char*
+json_format_fixed(char* it, uint32_t value, int width) {
+  for (int i = width - 1; i >= 0; --i) {
+    it[i] = (char) ('0' + value % 10);
+    value /= 10;
+  }
+  return it + width;
+}
 
-  uelem[0] = size >> 0;
-  uelem[1] = size >> 8;
-  uelem[2] = size >> 16;
-  uelem[3] = size >> 24;
+// Shortest of %.15g, %.16g and %.17g that reads back as the same value, needs 32 bytes
+static char*
+json_format_double(char* it, double value) {
+  int size = 0;
+  for (int precision = 15; precision <= 17; ++precision) {
+    size = snprintf(it, 32, "%.*g", precision, value);
+    if (strtod(it, NULL) == value) break;
+  }
 
-  uelem[4] = subtype;
-  memcpy(elem + sizeof(uelem[4]) + sizeof(size), binary, size);
+  // Keep integral values distinguishable from integers
+  if (!memchr(it, '.', size) && !memchr(it, 'e', size)) {
+    it[size++] = '.';
+    it[size++] = '0';
+  }
+  return it + size;
+}
 
-  if (next) *next = elem + size + sizeof(size) + sizeof(uelem[4]);
+// Needs 24 bytes, ms must be within years 1970 to 9999
+static char*
+json_format_iso_date(char* it, int64_t ms) {
+  uint32_t millis = (uint32_t) (ms % 1000);
+  int64_t seconds = ms / 1000;
+  uint32_t time   = (uint32_t) (seconds % 86400);
+  uint32_t days   = (uint32_t) (seconds / 86400);
+
+  // Days since 1970-01-01 to civil date, in 400 years eras starting on March 1st
+  uint32_t shifted = days + 719468;
+  uint32_t era     = shifted / 146097;
+  uint32_t doe     = shifted - era * 146097;
+  uint32_t yoe     = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  uint32_t doy     = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  uint32_t mp      = (5 * doy + 2) / 153;
+  uint32_t day     = doy - (153 * mp + 2) / 5 + 1;
+  uint32_t month   = mp < 10 ? mp + 3 : mp - 9;
+  uint32_t year    = yoe + era * 400 + (month <= 2);
+
+  it    = json_format_fixed(it, year, 4);
+  *it++ = '-';
+  it    = json_format_fixed(it, month, 2);
+  *it++ = '-';
+  it    = json_format_fixed(it, day, 2);
+  *it++ = 'T';
+  it    = json_format_fixed(it, time / 3600, 2);
+  *it++ = ':';
+  it    = json_format_fixed(it, time / 60 % 60, 2);
+  *it++ = ':';
+  it    = json_format_fixed(it, time % 60, 2);
+  *it++ = '.';
+  it    = json_format_fixed(it, millis, 3);
+  *it++ = 'Z';
+  return it;
 }
 
-void
-bson_set_element_value_bool(char* elem, bool value, char** next) {
-  *elem = value;
-  if (next) *next = elem + sizeof(value);
+// Needs 48 bytes, follows the decimal128 to string algorithm of the BSON decimal128 spec
+static char*
+json_format_decimal128(char* it, uint8_t const* value) {
+  uint64_t low  = (uint64_t) bson_get_element_value_int64((char const*) value, NULL);
+  uint64_t high = (uint64_t) bson_get_element_value_int64((char const*) value + 8, NULL);
+
+  bool negative        = high >> 63;
+  uint32_t combination = (high >> 58) & 0x1f;
+  uint32_t biased_exponent;
+  uint64_t coefficient_high;
+
+  if ((combination >> 3) == 3) {
+    if (combination == 0x1e) {
+      if (negative) *it++ = '-';
+      memcpy(it, "Infinity", 8);
+      return it + 8;
+    }
+    if (combination == 0x1f) {
+      memcpy(it, "NaN", 3);
+      return it + 3;
+    }
+
+    // The implicit coefficient is over the maximum, it reads as zero
+    biased_exponent  = (high >> 47) & 0x3fff;
+    coefficient_high = 0;
+    low              = 0;
+  } else {
+    biased_exponent  = (high >> 49) & 0x3fff;
+    coefficient_high = high & 0x1ffffffffffffull;
+  }
+
+  // Coefficients over 10^34 - 1 are non canonical and read as zero
+  if (coefficient_high > 0x1ed09bead87c0ull ||
+      (coefficient_high == 0x1ed09bead87c0ull && low > 0x378d8e63ffffffffull)) {
+    coefficient_high = 0;
+    low              = 0;
+  }
+
+  // Splits the 113 bits coefficient in chunks of 9 decimal digits
+  uint32_t parts[4] = {
+      (uint32_t) (coefficient_high >> 32),
+      (uint32_t) coefficient_high,
+      (uint32_t) (low >> 32),
+      (uint32_t) low,
+  };
+  char digits[36];
+  char* first = digits + sizeof(digits);
+  while (parts[0] | parts[1] | parts[2] | parts[3]) {
+    uint64_t remainder = 0;
+    for (int i = 0; i < 4; ++i) {
+      uint64_t current = (remainder << 32) | parts[i];
+      parts[i]         = (uint32_t) (current / 1000000000);
+      remainder        = current % 1000000000;
+    }
+    first -= 9;
+    json_format_fixed(first, (uint32_t) remainder, 9);
+  }
+  while (first < digits + sizeof(digits) - 1 && *first == '0') ++first;
+  if (first == digits + sizeof(digits)) *--first = '0';
+
+  int32_t digit_count = (int32_t) (digits + sizeof(digits) - first);
+  int32_t exponent    = (int32_t) biased_exponent - 6176;
+  int32_t adjusted    = exponent + digit_count - 1;
+
+  if (negative) *it++ = '-';
+
+  if (exponent > 0 || adjusted < -6) {
+    *it++ = *first;
+    if (digit_count > 1) {
+      *it++ = '.';
+      memcpy(it, first + 1, digit_count - 1);
+      it += digit_count - 1;
+    }
+    *it++ = 'E';
+    *it++ = adjusted < 0 ? '-' : '+';
+    return json_format_uint64(it, adjusted < 0 ? -adjusted : adjusted);
+  }
+
+  int32_t point = digit_count + exponent;
+  if (exponent == 0) {
+    memcpy(it, first, digit_count);
+    return it + digit_count;
+  }
+
+  if (point > 0) {
+    memcpy(it, first, point);
+    it += point;
+    *it++ = '.';
+    memcpy(it, first + point, digit_count - point);
+    return it + digit_count - point;
+  }
+
+  *it++ = '0';
+  *it++ = '.';
+  memset(it, '0', -point);
+  it += -point;
+  memcpy(it, first, digit_count);
+  return it + digit_count;
 }
 
-void
-bson_next(char const* elem, char const** next) {
-  bson_element_t type = bson_get_element_type(elem, &elem);
-  bson_get_element_name(elem, NULL, &elem);
+// Non zero if any of the 8 bytes is a quote, a backslash or a control character
+static uint64_t
+json_escape_mask(uint64_t word) {
+  uint64_t const ones  = 0x0101010101010101ull;
+  uint64_t const highs = 0x8080808080808080ull;
+  uint64_t quote       = word ^ (ones * '"');
+  uint64_t backslash   = word ^ (ones * '\\');
+
+  uint64_t control = (word - ones * 0x20) & ~word;
+  uint64_t quotes  = (quote - ones) & ~quote;
+  uint64_t slashes = (backslash - ones) & ~backslash;
+  return (control | quotes | slashes) & highs;
+}
+
+static void
+json_write_string(json_writer_t* writer, char const* str, size_t size) {
+  uint8_t const* it  = (uint8_t const*) str;
+  uint8_t const* end = it + size;
+
+  json_literal(writer, "\"");
+  while (it < end) {
+    // Longest run needing no escape, 8 bytes at a time
+    uint8_t const* run = it;
+    while (end - it >= 8) {
+      uint64_t word;
+      memcpy(&word, it, sizeof(word));
+      if (json_escape_mask(word)) break;
+      it += 8;
+    }
+    while (it < end && *it >= 0x20 && *it != '"' && *it != '\\') ++it;
+    json_write(writer, run, it - run);
+    if (it == end) break;
+
+    char* out = json_reserve(writer, 6);
+    if (!out) return;
+
+    out[0] = '\\';
+    if (*it >= 0x20) {
+      out[1] = (char) *it;
+      out += 2;
+    } else if (json_control_escapes[*it] != 'u') {
+      out[1] = json_control_escapes[*it];
+      out += 2;
+    } else {
+      memcpy(out + 1, "u00", 3);
+      out[4] = json_hex[*it >> 4];
+      out[5] = json_hex[*it & 0xf];
+      out += 6;
+    }
+    json_commit(writer, out);
+    ++it;
+  }
+  json_literal(writer, "\"");
+}
+
+static void
+json_write_int64(json_writer_t* writer, int64_t value) {
+  char* it = json_reserve(writer, 20);
+  if (it) json_commit(writer, json_format_int64(it, value));
+}
+
+static void
+json_write_hex(json_writer_t* writer, uint8_t const* data, size_t size) {
+  char* it = json_reserve(writer, 2 * size);
+  if (!it) return;
+  for (size_t i = 0; i < size; ++i) {
+    *it++ = json_hex[data[i] >> 4];
+    *it++ = json_hex[data[i] & 0xf];
+  }
+  json_commit(writer, it);
+}
+
+static void
+json_write_base64(json_writer_t* writer, uint8_t const* data, size_t size) {
+  static char const alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+  char* it = json_reserve(writer, (size + 2) / 3 * 4);
+  if (!it) return;
+
+  size_t i = 0;
+  for (; i + 3 <= size; i += 3) {
+    uint32_t bits = (uint32_t) data[i] << 16 | (uint32_t) data[i + 1] << 8 | data[i + 2];
+    it[0]         = alphabet[bits >> 18];
+    it[1]         = alphabet[(bits >> 12) & 0x3f];
+    it[2]         = alphabet[(bits >> 6) & 0x3f];
+    it[3]         = alphabet[bits & 0x3f];
+    it += 4;
+  }
+
+  if (i < size) {
+    uint32_t bits = (uint32_t) data[i] << 16;
+    if (i + 1 < size) bits |= (uint32_t) data[i + 1] << 8;
+    it[0] = alphabet[bits >> 18];
+    it[1] = alphabet[(bits >> 12) & 0x3f];
+    it[2] = i + 1 < size ? alphabet[(bits >> 6) & 0x3f] : '=';
+    it[3] = '=';
+    it += 4;
+  }
+  json_commit(writer, it);
+}
+
+static void
+json_write_oid(json_writer_t* writer, char const* oid) {
+  json_literal(writer, "{\"$oid\":\"");
+  json_write_hex(writer, (uint8_t const*) oid, 12);
+  json_literal(writer, "\"}");
+}
+
+static void
+json_write_double(json_writer_t* writer, double value) {
+  if (value != value || value - value != 0) {
+    json_literal(writer, "{\"$numberDouble\":\"");
+    if (value != value)
+      json_literal(writer, "NaN");
+    else if (value < 0)
+      json_literal(writer, "-Infinity");
+    else
+      json_literal(writer, "Infinity");
+    json_literal(writer, "\"}");
+    return;
+  }
+  // Extended JSON keeps the sign of zero out of plain numbers, which many parsers drop
+  if (value == 0 && signbit(value)) {
+    json_literal(writer, "{\"$numberDouble\":\"-0.0\"}");
+    return;
+  }
+
+  bool canonical = writer->mode == BSON_JSON_CANONICAL;
+  if (canonical) json_literal(writer, "{\"$numberDouble\":\"");
+  char* it = json_reserve(writer, 32);
+  if (it) json_commit(writer, json_format_double(it, value));
+  if (canonical) json_literal(writer, "\"}");
+}
+
+static void
+json_write_object(json_writer_t* writer, char const* obj, bool is_array);
+
+// Writes the value at elem and returns the element following it
+static char const*
+json_write_value(json_writer_t* writer, uint8_t type, char const* elem) {
+  bool canonical = writer->mode == BSON_JSON_CANONICAL;
+
   switch (type) {
-    case BSON_END: break;
+    case BSON_DOUBLE: {
+      json_write_double(writer, bson_get_element_value_double(elem, &elem));
+      break;
+    }
+
+    case BSON_STRING: {
+      uint32_t size;
+      char const* str = bson_get_element_value_string(elem, &size, &elem);
+      json_write_string(writer, str, size);
+      break;
+    }
 
     case BSON_OBJECT:
     case BSON_ARRAY: {
-      uint32_t size = bson_get_size(elem, NULL);
-      elem += size;
+      json_write_object(writer, elem, type == BSON_ARRAY);
+      elem += bson_get_size(elem, NULL);
       break;
     }
 
-    case BSON_STRING: {
-      bson_get_element_value_string(elem, NULL, &elem);
+    case BSON_BINARY: {
+      uint32_t size;
+      bson_binary_t subtype;
+      void const* data = bson_get_element_value_binary(elem, &size, &subtype, &elem);
+      uint8_t usubtype = (uint8_t) subtype;
+      json_literal(writer, "{\"$binary\":{\"base64\":\"");
+      json_write_base64(writer, data, size);
+      json_literal(writer, "\",\"subType\":\"");
+      json_write_hex(writer, &usubtype, 1);
+      json_literal(writer, "\"}}");
       break;
     }
 
-    case BSON_DOUBLE: {
-      bson_get_element_value_double(elem, &elem);
+    case BSON_UNDEFINED: {
+      json_literal(writer, "{\"$undefined\":true}");
+      break;
+    }
+
+    case BSON_OBJECTID: {
+      json_write_oid(writer, elem);
+      elem += 12;
       break;
     }
 
     case BSON_BOOLEAN: {
-      bson_get_element_value_bool(elem, &elem);
+      if (bson_get_element_value_bool(elem, &elem))
+        json_literal(writer, "true");
+      else
+        json_literal(writer, "false");
       break;
     }
 
-    case BSON_INT64: {
-      bson_get_element_value_int64(elem, &elem);
+    case BSON_DATE: {
+      int64_t ms = bson_get_element_value_int64(elem, &elem);
+      json_literal(writer, "{\"$date\":");
+      if (!canonical && ms >= 0 && ms < 253402300800000ll) {
+        char* it = json_reserve(writer, 26);
+        if (!it) break;
+        *it++ = '"';
+        it    = json_format_iso_date(it, ms);
+        *it++ = '"';
+        json_commit(writer, it);
+      } else {
+        json_literal(writer, "{\"$numberLong\":\"");
+        json_write_int64(writer, ms);
+        json_literal(writer, "\"}");
+      }
+      json_literal(writer, "}");
       break;
     }
 
-    case BSON_INT32: {
-      bson_get_element_value_int32(elem, &elem);
+    case BSON_NULL: {
+      json_literal(writer, "null");
       break;
     }
 
-    case BSON_BINARY: {
-      bson_get_element_value_binary(elem, NULL, NULL, &elem);
+    case BSON_REGEX: {
+      size_t pattern_size = strlen(elem);
+      size_t options_size = strlen(elem + pattern_size + 1);
+      json_literal(writer, "{\"$regularExpression\":{\"pattern\":");
+      json_write_string(writer, elem, pattern_size);
+      json_literal(writer, ",\"options\":");
+      json_write_string(writer, elem + pattern_size + 1, options_size);
+      json_literal(writer, "}}");
+      elem += pattern_size + options_size + 2;
+      break;
+    }
+
+    case BSON_DBPOINTER: {
+      uint32_t size;
+      char const* ref = bson_get_element_value_string(elem, &size, &elem);
+      json_literal(writer, "{\"$dbPointer\":{\"$ref\":");
+      json_write_string(writer, ref, size);
+      json_literal(writer, ",\"$id\":");
+      json_write_oid(writer, elem);
+      json_literal(writer, "}}");
+      elem += 12;
       break;
     }
 
-    case BSON_UNDEFINED:
-    case BSON_OBJECTID:
-    case BSON_DATE:
-    case BSON_NULL:
-    case BSON_REGEX:
-    case BSON_DBPOINTER:
     case BSON_JAVASCRIPT:
-    case BSON_SYMBOL:
-    case BSON_SCOPED_JAVASCRIPT:
-    case BSON_TIMESTAMP:
+    case BSON_SYMBOL: {
+      uint32_t size;
+      char const* str = bson_get_element_value_string(elem, &size, &elem);
+      if (type == BSON_JAVASCRIPT)
+        json_literal(writer, "{\"$code\":");
+      else
+        json_literal(writer, "{\"$symbol\":");
+      json_write_string(writer, str, size);
+      json_literal(writer, "}");
+      break;
+    }
+
+    case BSON_SCOPED_JAVASCRIPT: {
+      char const* next = elem + bson_get_size(elem, NULL);
+      elem += sizeof(uint32_t);
+      uint32_t size;
+      char const* code = bson_get_element_value_string(elem, &size, &elem);
+      json_literal(writer, "{\"$code\":");
+      json_write_string(writer, code, size);
+      json_literal(writer, ",\"$scope\":");
+      json_write_object(writer, elem, false);
+      json_literal(writer, "}");
+      elem = next;
+      break;
+    }
+
+    case BSON_INT32: {
+      int32_t value = bson_get_element_value_int32(elem, &elem);
+      if (canonical) json_literal(writer, "{\"$numberInt\":\"");
+      json_write_int64(writer, value);
+      if (canonical) json_literal(writer, "\"}");
+      break;
+    }
+
+    case BSON_TIMESTAMP: {
+      uint64_t value = (uint64_t) bson_get_element_value_int64(elem, &elem);
+      char* it       = json_reserve(writer, 64);
+      if (!it) break;
+      memcpy(it, "{\"$timestamp\":{\"t\":", 19);
+      it = json_format_uint64(it + 19, value >> 32);
+      memcpy(it, ",\"i\":", 5);
+      it = json_format_uint64(it + 5, value & 0xffffffff);
+      memcpy(it, "}}", 2);
+      json_commit(writer, it + 2);
+      break;
+    }
+
+    case BSON_INT64: {
+      int64_t value = bson_get_element_value_int64(elem, &elem);
+      if (canonical) json_literal(writer, "{\"$numberLong\":\"");
+      json_write_int64(writer, value);
+      if (canonical) json_literal(writer, "\"}");
+      break;
+    }
+
     case BSON_DECI128: {
-      // TODO
+      char* it = json_reserve(writer, 72);
+      if (!it) break;
+      memcpy(it, "{\"$numberDecimal\":\"", 19);
+      it = json_format_decimal128(it + 19, (uint8_t const*) elem);
+      memcpy(it, "\"}", 2);
+      json_commit(writer, it + 2);
+      elem += 16;
+      break;
+    }
+
+    case BSON_MAXKEY: {
+      json_literal(writer, "{\"$maxKey\":1}");
+      break;
+    }
+
+    case BSON_MINKEY: {
+      json_literal(writer, "{\"$minKey\":1}");
       break;
     }
+
+    default: writer->error = true; return NULL;
   }
 
-  if (next) *next = elem;
+  return elem;
+}
+
+static void
+json_write_object(json_writer_t* writer, char const* obj, bool is_array) {
+  bson_get_size(obj, &obj);
+
+  json_write(writer, is_array ? "[" : "{", 1);
+  bool first = true;
+  while (!writer->error && *obj) {
+    uint8_t type = (uint8_t) *obj;
+    uint32_t name_size;
+    char const* name = bson_get_element_name(obj + 1, &name_size, &obj);
+
+    if (!first) json_literal(writer, ",");
+    first = false;
+    if (!is_array) {
+      json_write_string(writer, name, name_size);
+      json_literal(writer, ":");
+    }
+
+    obj = json_write_value(writer, type, obj);
+  }
+  json_write(writer, is_array ? "]" : "}", 1);
+}
+
+bool
+bson_to_json(bson_buffer_t* output, char const* obj, bson_json_mode_t mode) {
+  json_writer_t writer = {output, mode, false};
+  size_t size          = output->size;
+
+  json_write_object(&writer, obj, false);
+
+  // Leave the output as it was on failure
+  if (writer.error) output->size = size;
+  if (output->capacity) output->data[output->size] = 0;
+  return !writer.error;
+}
+
+// JSON parser. Stage 1 indexes the offset of every token: structural characters, strings and
+// scalars. Stage 2 walks that index and writes BSON straight to the output with the
+// bson_set_* primitives, back-patching document sizes, so there is no DOM and no second pass.
+
+void
+bson_json_parser_init(bson_json_parser_t* parser) {
+  parser->index    = NULL;
+  parser->capacity = 0;
+}
+
+void
+bson_json_parser_destroy(bson_json_parser_t* parser) {
+  free(parser->index);
+  bson_json_parser_init(parser);
+}
+
+static bool
+json_is_delimiter(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '{' || c == '}' || c == '[' ||
+         c == ']' || c == ':' || c == ',' || c == '"';
+}
+
+static bool
+json_index_reserve(bson_json_parser_t* parser, size_t count) {
+  if (count < parser->capacity) return true;
+
+  size_t capacity = parser->capacity ? 2 * parser->capacity : 256;
+  uint32_t* index = realloc(parser->index, capacity * sizeof(uint32_t));
+  if (!index) return false;
+
+  parser->index    = index;
+  parser->capacity = capacity;
+  return true;
+}
+
+// Stage 1: token offsets, followed by the input size
+static bson_json_status_t
+json_index(
+    bson_json_parser_t* parser,
+    char const* json,
+    size_t size,
+    size_t* count,
+    size_t* error_offset) {
+  size_t n = 0;
+  size_t i = 0;
+  while (i < size) {
+    if (!json_index_reserve(parser, n + 1)) return BSON_JSON_ERROR_MEMORY;
+
+    switch (json[i]) {
+      case ' ':
+      case '\t':
+      case '\n':
+      case '\r': ++i; break;
+
+      case '{':
+      case '}':
+      case '[':
+      case ']':
+      case ':':
+      case ',': parser->index[n++] = (uint32_t) i++; break;
+
+      case '"': {
+        parser->index[n++] = (uint32_t) i++;
+
+        // Skips to the closing quote, 8 bytes at a time outside of escapes
+        while (true) {
+          while (i + 8 <= size) {
+            uint64_t word;
+            memcpy(&word, json + i, sizeof(word));
+            if (json_escape_mask(word)) break;
+            i += 8;
+          }
+          while (i < size && json[i] != '"' && json[i] != '\\') ++i;
+
+          if (i >= size) {
+            *error_offset = parser->index[n - 1];
+            return BSON_JSON_ERROR_SYNTAX;
+          }
+          if (json[i] == '"') break;
+          i += 2;
+        }
+        ++i;
+        break;
+      }
+
+      default: {
+        parser->index[n++] = (uint32_t) i++;
+        while (i < size && !json_is_delimiter(json[i])) ++i;
+        break;
+      }
+    }
+  }
+
+  if (!json_index_reserve(parser, n + 1)) return BSON_JSON_ERROR_MEMORY;
+  parser->index[n] = (uint32_t) size;
+  *count           = n;
+  return BSON_JSON_OK;
+}
+
+typedef struct {
+  char const* json;
+  size_t size;
+  uint32_t const* index;
+  size_t count;
+  size_t token;
+  bson_buffer_t* output;
+  bson_json_status_t status;
+  size_t error_offset;
+  int depth;
+} json_parse_state_t;
+
+typedef struct {
+  char const* key;
+  size_t key_size;
+  size_t value;
+} json_member_t;
+
+static char const*
+parse_at(json_parse_state_t* state, size_t token) {
+  return state->json + state->index[token < state->count ? token : state->count];
+}
+
+static char
+parse_char(json_parse_state_t* state, size_t token) {
+  return token < state->count ? *parse_at(state, token) : 0;
+}
+
+// Keeps the first error only, always returns false
+static bool
+parse_fail(json_parse_state_t* state, char const* at, bson_json_status_t status) {
+  if (state->status == BSON_JSON_OK) {
+    state->status       = status;
+    state->error_offset = at - state->json;
+  }
+  return false;
+}
+
+static char*
+parse_reserve(json_parse_state_t* state, size_t size) {
+  if (bson_buffer_reserve(state->output, size)) return state->output->data + state->output->size;
+  parse_fail(state, parse_at(state, state->token), BSON_JSON_ERROR_MEMORY);
+  return NULL;
+}
+
+static void
+parse_commit(json_parse_state_t* state, char const* end) {
+  state->output->size = end - state->output->data;
+}
+
+static char const*
+parse_scalar_end(json_parse_state_t* state, size_t token) {
+  char const* it  = parse_at(state, token);
+  char const* end = state->json + state->size;
+  while (it < end && !json_is_delimiter(*it)) ++it;
+  return it;
+}
+
+static bool
+parse_hex(char const* it, size_t size, uint32_t* value) {
+  *value = 0;
+  for (size_t i = 0; i < size; ++i) {
+    char c = it[i];
+    uint32_t digit;
+    if (c >= '0' && c <= '9')
+      digit = c - '0';
+    else if (c >= 'a' && c <= 'f')
+      digit = c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F')
+      digit = c - 'A' + 10;
+    else
+      return false;
+    *value = (*value << 4) | digit;
+  }
+  return true;
+}
+
+static char*
+parse_utf8(char* out, uint32_t codepoint) {
+  if (codepoint < 0x80) {
+    *out++ = (char) codepoint;
+  } else if (codepoint < 0x800) {
+    *out++ = (char) (0xc0 | (codepoint >> 6));
+    *out++ = (char) (0x80 | (codepoint & 0x3f));
+  } else if (codepoint < 0x10000) {
+    *out++ = (char) (0xe0 | (codepoint >> 12));
+    *out++ = (char) (0x80 | ((codepoint >> 6) & 0x3f));
+    *out++ = (char) (0x80 | (codepoint & 0x3f));
+  } else {
+    *out++ = (char) (0xf0 | (codepoint >> 18));
+    *out++ = (char) (0x80 | ((codepoint >> 12) & 0x3f));
+    *out++ = (char) (0x80 | ((codepoint >> 6) & 0x3f));
+    *out++ = (char) (0x80 | (codepoint & 0x3f));
+  }
+  return out;
+}
+
+// Unescapes the string token as a C string for keys, or with its size prefix for values.
+// Invalid UTF-8 is a syntax error at its first byte.
+static bool
+parse_string(json_parse_state_t* state, bool is_key) {
+  if (parse_char(state, state->token) != '"') {
+    return parse_fail(state, parse_at(state, state->token), BSON_JSON_ERROR_SYNTAX);
+  }
+
+  size_t token    = state->token++;
+  char const* it  = parse_at(state, token) + 1;
+  char const* end = parse_at(state, token + 1);
+
+  // Escapes never make a string longer, the raw size with its closing quote bounds the output
+  char* out = parse_reserve(state, sizeof(uint32_t) + (end - it));
+  if (!out) return false;
+
+  char* first = is_key ? out : out + sizeof(uint32_t);
+  char* it_out = first;
+  while (true) {
+    while (end - it >= 8) {
+      uint64_t word;
+      memcpy(&word, it, sizeof(word));
+      // Bytes past ASCII are checked one sequence at a time
+      if (json_escape_mask(word) || (word & 0x8080808080808080ull)) break;
+      memcpy(it_out, it, sizeof(word));
+      it += 8;
+      it_out += 8;
+    }
+
+    uint8_t c = (uint8_t) *it;
+    if (c == '"') break;
+    if (c < 0x20) return parse_fail(state, it, BSON_JSON_ERROR_SYNTAX);
+    if (c >= 0x80) {
+      size_t length = utf8_sequence_size((uint8_t const*) it, end - it);
+      if (!length) return parse_fail(state, it, BSON_JSON_ERROR_SYNTAX);
+      memcpy(it_out, it, length);
+      it += length;
+      it_out += length;
+      continue;
+    }
+    if (c != '\\') {
+      *it_out++ = (char) c;
+      ++it;
+      continue;
+    }
+
+    switch (it[1]) {
+      case '"': *it_out++ = '"'; break;
+      case '\\': *it_out++ = '\\'; break;
+      case '/': *it_out++ = '/'; break;
+      case 'b': *it_out++ = '\b'; break;
+      case 'f': *it_out++ = '\f'; break;
+      case 'n': *it_out++ = '\n'; break;
+      case 'r': *it_out++ = '\r'; break;
+      case 't': *it_out++ = '\t'; break;
+
+      case 'u': {
+        uint32_t codepoint;
+        if (end - it < 6 || !parse_hex(it + 2, 4, &codepoint)) {
+          return parse_fail(state, it, BSON_JSON_ERROR_SYNTAX);
+        }
+
+        if (codepoint >= 0xd800 && codepoint <= 0xdbff) {
+          uint32_t low;
+          if (end - it < 12 || it[6] != '\\' || it[7] != 'u' || !parse_hex(it + 8, 4, &low) ||
+              low < 0xdc00 || low > 0xdfff) {
+            return parse_fail(state, it, BSON_JSON_ERROR_SYNTAX);
+          }
+          codepoint = 0x10000 + ((codepoint - 0xd800) << 10) + (low - 0xdc00);
+          it += 6;
+        } else if (codepoint >= 0xdc00 && codepoint <= 0xdfff) {
+          return parse_fail(state, it, BSON_JSON_ERROR_SYNTAX);
+        }
+
+        // Keys, patterns and options are C strings
+        if (codepoint == 0 && is_key) return parse_fail(state, it, BSON_JSON_ERROR_SYNTAX);
+
+        it_out = parse_utf8(it_out, codepoint);
+        it += 4;
+        break;
+      }
+
+      default: return parse_fail(state, it, BSON_JSON_ERROR_SYNTAX);
+    }
+    it += 2;
+  }
+
+  *it_out++ = 0;
+  if (!is_key) bson_set_size(out, (uint32_t) (it_out - first), NULL);
+  parse_commit(state, it_out);
+  return true;
+}
+
+// Strict integer of the text, without leading zeros
+static bool
+parse_integer(char const* it, char const* end, int64_t* value) {
+  bool negative = it < end && *it == '-';
+  if (negative) ++it;
+  if (it == end || (*it == '0' && end - it > 1)) return false;
+
+  uint64_t magnitude = 0;
+  uint64_t limit     = negative ? (uint64_t) INT64_MAX + 1 : (uint64_t) INT64_MAX;
+  for (; it < end; ++it) {
+    if (*it < '0' || *it > '9') return false;
+    uint32_t digit = *it - '0';
+    if (magnitude > (limit - digit) / 10) return false;
+    magnitude = magnitude * 10 + digit;
+  }
+
+  *value = negative ? (int64_t) (0 - magnitude) : (int64_t) magnitude;
+  return true;
+}
+
+// JSON number grammar, then strtod on a NUL terminated copy
+static bool
+parse_double(char const* first, char const* end, double* value) {
+  char const* it = first;
+  if (it < end && *it == '-') ++it;
+  char const* digits = it;
+  while (it < end && *it >= '0' && *it <= '9') ++it;
+  if (it == digits || (*digits == '0' && it - digits > 1)) return false;
+
+  if (it < end && *it == '.') {
+    char const* fraction = ++it;
+    while (it < end && *it >= '0' && *it <= '9') ++it;
+    if (it == fraction) return false;
+  }
+
+  if (it < end && (*it == 'e' || *it == 'E')) {
+    ++it;
+    if (it < end && (*it == '+' || *it == '-')) ++it;
+    char const* exponent = it;
+    while (it < end && *it >= '0' && *it <= '9') ++it;
+    if (it == exponent) return false;
+  }
+  if (it != end) return false;
+
+  char local[64];
+  size_t size = end - first;
+  char* copy  = size < sizeof(local) ? local : malloc(size + 1);
+  if (!copy) return false;
+  memcpy(copy, first, size);
+  copy[size] = 0;
+  *value     = strtod(copy, NULL);
+  if (copy != local) free(copy);
+  return true;
+}
+
+// Integers become int32 or int64 when they fit, every other number a double
+static bool
+parse_number(json_parse_state_t* state, uint8_t* type) {
+  char const* first = parse_at(state, state->token);
+  char const* end   = parse_scalar_end(state, state->token);
+
+  int64_t integer;
+  double real;
+  if (parse_integer(first, end, &integer)) {
+    if (integer >= INT32_MIN && integer <= INT32_MAX) {
+      char* out = parse_reserve(state, sizeof(int32_t));
+      if (!out) return false;
+      bson_set_element_value_int32(out, (int32_t) integer, &out);
+      parse_commit(state, out);
+      *type = BSON_INT32;
+    } else {
+      char* out = parse_reserve(state, sizeof(int64_t));
+      if (!out) return false;
+      bson_set_element_value_int64(out, integer, &out);
+      parse_commit(state, out);
+      *type = BSON_INT64;
+    }
+  } else if (parse_double(first, end, &real)) {
+    char* out = parse_reserve(state, sizeof(double));
+    if (!out) return false;
+    bson_set_element_value_double(out, real, &out);
+    parse_commit(state, out);
+    *type = BSON_DOUBLE;
+  } else {
+    return parse_fail(state, first, BSON_JSON_ERROR_SYNTAX);
+  }
+
+  ++state->token;
+  return true;
+}
+
+static bool
+parse_literal(json_parse_state_t* state, char const* literal) {
+  char const* first = parse_at(state, state->token);
+  size_t size       = strlen(literal);
+  if ((size_t) (parse_scalar_end(state, state->token) - first) != size ||
+      memcmp(first, literal, size) != 0) {
+    return parse_fail(state, first, BSON_JSON_ERROR_SYNTAX);
+  }
+
+  ++state->token;
+  return true;
+}
+
+// Token following the value starting at token
+static size_t
+parse_skip(json_parse_state_t* state, size_t token) {
+  size_t depth = 0;
+  do {
+    char c = parse_char(state, token);
+    if (!c) return token;
+    if (c == '{' || c == '[')
+      ++depth;
+    else if ((c == '}' || c == ']') && depth)
+      --depth;
+    ++token;
+  } while (depth);
+  return token;
+}
+
+// Contents of a string token without escapes
+static bool
+parse_raw_string(json_parse_state_t* state, size_t token, char const** str, size_t* size) {
+  if (parse_char(state, token) != '"') return false;
+
+  char const* first = parse_at(state, token) + 1;
+  char const* quote = memchr(first, '"', parse_at(state, token + 1) - first);
+  if (!quote || memchr(first, '\\', quote - first)) return false;
+
+  *str  = first;
+  *size = quote - first;
+  return true;
+}
+
+// Collects the members of the object at token when it has at most max of them, all with plain
+// keys. Returns their count or -1, next is set to the token following the object.
+static int
+parse_members(
+    json_parse_state_t* state,
+    size_t token,
+    json_member_t* members,
+    int max,
+    size_t* next) {
+  if (parse_char(state, token++) != '{') return -1;
+  if (parse_char(state, token) == '}') {
+    *next = token + 1;
+    return 0;
+  }
+
+  int count = 0;
+  while (count < max) {
+    json_member_t* member = &members[count++];
+    if (!parse_raw_string(state, token, &member->key, &member->key_size)) return -1;
+    if (parse_char(state, token + 1) != ':') return -1;
+
+    member->value = token + 2;
+    token         = parse_skip(state, member->value);
+
+    char c = parse_char(state, token++);
+    if (c == '}') {
+      *next = token;
+      return count;
+    }
+    if (c != ',') return -1;
+  }
+
+  return -1;
+}
+
+static bool
+parse_key_is(json_member_t const* member, char const* key) {
+  return member->key_size == strlen(key) && memcmp(member->key, key, member->key_size) == 0;
+}
+
+static json_member_t const*
+parse_member(json_member_t const* members, int count, char const* key) {
+  for (int i = 0; i < count; ++i) {
+    if (parse_key_is(&members[i], key)) return &members[i];
+  }
+  return NULL;
+}
+
+static bool
+parse_oid(json_parse_state_t* state, size_t token) {
+  json_member_t member;
+  size_t next;
+  char const* hex;
+  size_t hex_size;
+  if (parse_members(state, token, &member, 1, &next) != 1 || !parse_key_is(&member, "$oid") ||
+      !parse_raw_string(state, member.value, &hex, &hex_size) || hex_size != 24) {
+    return false;
+  }
+
+  char* out = parse_reserve(state, 12);
+  if (!out) return false;
+  for (int i = 0; i < 12; ++i) {
+    uint32_t byte;
+    if (!parse_hex(hex + 2 * i, 2, &byte)) return false;
+    out[i] = (char) byte;
+  }
+  parse_commit(state, out + 12);
+  return true;
+}
+
+static bool
+parse_digits(char const** it, char const* end, int count, uint32_t* value) {
+  if (end - *it < count) return false;
+  *value = 0;
+  for (int i = 0; i < count; ++i) {
+    char c = (*it)[i];
+    if (c < '0' || c > '9') return false;
+    *value = *value * 10 + (c - '0');
+  }
+  *it += count;
+  return true;
+}
+
+static bool
+parse_separator(char const** it, char const* end, char separator) {
+  if (*it == end || **it != separator) return false;
+  ++*it;
+  return true;
+}
+
+// YYYY-MM-DDTHH:MM:SS[.sss](Z|+HH:MM|-HH:MM) to milliseconds since the epoch
+static bool
+parse_iso_date(char const* it, char const* end, int64_t* ms) {
+  uint32_t year, month, day, hour, minute, second, millis = 0;
+  if (!parse_digits(&it, end, 4, &year) || !parse_separator(&it, end, '-') ||
+      !parse_digits(&it, end, 2, &month) || !parse_separator(&it, end, '-') ||
+      !parse_digits(&it, end, 2, &day) || !parse_separator(&it, end, 'T') ||
+      !parse_digits(&it, end, 2, &hour) || !parse_separator(&it, end, ':') ||
+      !parse_digits(&it, end, 2, &minute) || !parse_separator(&it, end, ':') ||
+      !parse_digits(&it, end, 2, &second)) {
+    return false;
+  }
+  if (month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || minute > 59 || second > 59) {
+    return false;
+  }
+
+  // Milliseconds, extra digits are truncated
+  if (parse_separator(&it, end, '.')) {
+    char const* digits = it;
+    for (int scale = 100; it < end && *it >= '0' && *it <= '9'; ++it, scale /= 10) {
+      millis += (*it - '0') * scale;
+    }
+    if (it == digits) return false;
+  }
+
+  int32_t offset = 0;
+  if (!parse_separator(&it, end, 'Z')) {
+    if (it == end || (*it != '+' && *it != '-')) return false;
+    int32_t sign = *it++ == '-' ? -1 : 1;
+    uint32_t offset_hour, offset_minute;
+    if (!parse_digits(&it, end, 2, &offset_hour)) return false;
+    parse_separator(&it, end, ':');
+    if (!parse_digits(&it, end, 2, &offset_minute)) return false;
+    offset = sign * (int32_t) (offset_hour * 60 + offset_minute);
+  }
+  if (it != end) return false;
+
+  // Civil date to days since 1970-01-01, in 400 years eras starting on March 1st
+  int64_t y       = (int64_t) year - (month <= 2);
+  int64_t era     = (y >= 0 ? y : y - 399) / 400;
+  int64_t yoe     = y - era * 400;
+  int64_t doy     = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+  int64_t doe     = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  int64_t days    = era * 146097 + doe - 719468;
+  int64_t minutes = days * 1440 + (int64_t) hour * 60 + minute - offset;
+
+  *ms = (minutes * 60 + second) * 1000 + millis;
+  return true;
+}
+
+static void
+decimal128_mul10_add(uint64_t* high, uint64_t* low, uint32_t digit) {
+  uint64_t low_low  = (*low & 0xffffffff) * 10 + digit;
+  uint64_t low_high = (*low >> 32) * 10 + (low_low >> 32);
+  *low              = (low_high << 32) | (low_low & 0xffffffff);
+  *high             = *high * 10 + (low_high >> 32);
+}
+
+// Exact decimal128 of the text, values needing rounding are rejected
+static bool
+parse_decimal128(char const* it, char const* end, char* out) {
+  uint64_t high = 0;
+  uint64_t low  = 0;
+
+  bool negative = it < end && *it == '-';
+  if (it < end && (*it == '-' || *it == '+')) ++it;
+
+  size_t rest = end - it;
+  if ((rest == 8 && memcmp(it, "Infinity", 8) == 0) || (rest == 3 && memcmp(it, "Inf", 3) == 0)) {
+    high = 0x7800000000000000ull;
+  } else if (rest == 3 && memcmp(it, "NaN", 3) == 0) {
+    high = 0x7c00000000000000ull;
+  } else {
+    int64_t exponent = 0;
+    int digit_count  = 0;
+    bool has_digits  = false;
+    bool has_point   = false;
+    for (; it < end; ++it) {
+      if (*it == '.' && !has_point) {
+        has_point = true;
+        continue;
+      }
+      if (*it < '0' || *it > '9') break;
+
+      has_digits = true;
+      if (has_point) --exponent;
+      if (digit_count == 0 && *it == '0') continue;
+      if (++digit_count > 34) return false;
+      decimal128_mul10_add(&high, &low, *it - '0');
+    }
+    if (!has_digits) return false;
+
+    if (it < end && (*it == 'e' || *it == 'E')) {
+      int64_t value;
+      ++it;
+      if (it < end && *it == '+') ++it;
+      if (end - it > 6 || !parse_integer(it, end, &value)) return false;
+      exponent += value;
+      it = end;
+    }
+    if (it != end || exponent < -6176 || exponent > 6111) return false;
+
+    high |= (uint64_t) (exponent + 6176) << 49;
+  }
+
+  if (negative) high |= 1ull << 63;
+  bson_set_element_value_int64(out, (int64_t) low, &out);
+  bson_set_element_value_int64(out, (int64_t) high, NULL);
+  return true;
+}
+
+static bool
+parse_base64(char const* str, size_t size, char* out, uint32_t* out_size) {
+  static int8_t const values[128] = {
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62,
+      -1, -1, -1, 63, 52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -1, -1, -1, -1, 0,
+      1,  2,  3,  4,  5,  6,  7,  8,  9,  10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22,
+      23, 24, 25, -1, -1, -1, -1, -1, -1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38,
+      39, 40, 41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
+  };
+
+  if (size % 4) return false;
+  size_t padding = 0;
+  if (size && str[size - 1] == '=') ++padding;
+  if (size > 1 && str[size - 2] == '=') ++padding;
+
+  char* it = out;
+  for (size_t i = 0; i < size; i += 4) {
+    uint32_t bits = 0;
+    for (size_t j = 0; j < 4; ++j) {
+      uint8_t c = (uint8_t) str[i + j];
+      if (c == '=' && i + j >= size - padding) {
+        bits <<= 6;
+        continue;
+      }
+      if (c >= 128 || values[c] < 0) return false;
+      bits = (bits << 6) | (uint32_t) values[c];
+    }
+    *it++ = (char) (bits >> 16);
+    *it++ = (char) (bits >> 8);
+    *it++ = (char) bits;
+  }
+
+  *out_size = (uint32_t) (it - out - padding);
+  return true;
+}
+
+static bool
+parse_document(json_parse_state_t* state, bool is_array);
+
+// Extended JSON v2 wrapper at the current token, matched is false for a plain document.
+// Wrappers with a known key but an unexpected shape are syntax errors.
+static bool
+parse_extended(json_parse_state_t* state, uint8_t* type, bool* matched) {
+  // Only objects whose first key starts with $ can be wrappers
+  size_t key = state->token + 1;
+  *matched   = parse_char(state, key) == '"' && parse_at(state, key)[1] == '$';
+  if (!*matched) return true;
+
+  json_member_t members[2];
+  size_t next;
+  int count = parse_members(state, state->token, members, 2, &next);
+
+  *matched = count > 0 && members[0].key_size > 1;
+  if (!*matched) return true;
+
+  char const* at             = parse_at(state, state->token);
+  json_member_t const* value = &members[0];
+  char const* str;
+  size_t size;
+  bool valid = false;
+
+  if (parse_key_is(value, "$oid")) {
+    *type = BSON_OBJECTID;
+    valid = count == 1 && parse_oid(state, state->token);
+  } else if (parse_key_is(value, "$symbol")) {
+    *type        = BSON_SYMBOL;
+    state->token = value->value;
+    valid        = count == 1 && parse_string(state, false);
+  } else if (parse_key_is(value, "$code") || parse_key_is(value, "$scope")) {
+    json_member_t const* code  = parse_member(members, count, "$code");
+    json_member_t const* scope = parse_member(members, count, "$scope");
+    size_t start               = state->output->size;
+
+    *type = scope ? BSON_SCOPED_JAVASCRIPT : BSON_JAVASCRIPT;
+    valid = code && count == (scope ? 2 : 1);
+    if (valid && scope) {
+      // Total size, patched after the scope
+      char* out = parse_reserve(state, sizeof(uint32_t));
+      valid     = out != NULL;
+      if (valid) parse_commit(state, out + sizeof(uint32_t));
+    }
+    if (valid) {
+      state->token = code->value;
+      valid        = parse_string(state, false);
+    }
+    if (valid && scope) {
+      state->token = scope->value;
+      valid        = parse_char(state, state->token) == '{' && parse_document(state, false);
+      if (valid) bson_set_size(state->output->data + start, state->output->size - start, NULL);
+    }
+  } else if (parse_key_is(value, "$numberInt") || parse_key_is(value, "$numberLong")) {
+    int64_t integer = 0;
+    bool is_int     = value->key[7] == 'I';
+    *type           = is_int ? BSON_INT32 : BSON_INT64;
+    valid           = count == 1 && parse_raw_string(state, value->value, &str, &size) &&
+            parse_integer(str, str + size, &integer) &&
+            (!is_int || (integer >= INT32_MIN && integer <= INT32_MAX));
+
+    char* out = valid ? parse_reserve(state, is_int ? 4 : 8) : NULL;
+    if (out && is_int)
+      bson_set_element_value_int32(out, (int32_t) integer, &out);
+    else if (out)
+      bson_set_element_value_int64(out, integer, &out);
+    if (out) parse_commit(state, out);
+    valid = out != NULL;
+  } else if (parse_key_is(value, "$numberDouble")) {
+    double real = 0;
+    *type       = BSON_DOUBLE;
+    valid       = count == 1 && parse_raw_string(state, value->value, &str, &size);
+    if (valid && size == 8 && memcmp(str, "Infinity", 8) == 0)
+      real = HUGE_VAL;
+    else if (valid && size == 9 && memcmp(str, "-Infinity", 9) == 0)
+      real = -HUGE_VAL;
+    else if (valid && size == 3 && memcmp(str, "NaN", 3) == 0)
+      real = NAN;
+    else
+      valid = valid && parse_double(str, str + size, &real);
+
+    char* out = valid ? parse_reserve(state, 8) : NULL;
+    if (out) {
+      bson_set_element_value_double(out, real, &out);
+      parse_commit(state, out);
+    }
+    valid = out != NULL;
+  } else if (parse_key_is(value, "$numberDecimal")) {
+    *type     = BSON_DECI128;
+    valid     = count == 1 && parse_raw_string(state, value->value, &str, &size);
+    char* out = valid ? parse_reserve(state, 16) : NULL;
+    valid     = out && parse_decimal128(str, str + size, out);
+    if (valid) parse_commit(state, out + 16);
+  } else if (parse_key_is(value, "$binary")) {
+    json_member_t fields[2];
+    size_t fields_next;
+    json_member_t const *base64, *subtype;
+    char const* hex;
+    size_t hex_size;
+    uint32_t subtype_value = 0;
+
+    *type = BSON_BINARY;
+    valid = count == 1 && parse_members(state, value->value, fields, 2, &fields_next) == 2 &&
+            (base64 = parse_member(fields, 2, "base64")) &&
+            (subtype = parse_member(fields, 2, "subType")) &&
+            parse_raw_string(state, base64->value, &str, &size) &&
+            parse_raw_string(state, subtype->value, &hex, &hex_size) && hex_size >= 1 &&
+            hex_size <= 2 && parse_hex(hex, hex_size, &subtype_value);
+
+    // Decoded in place after the size and subtype
+    char* out = valid ? parse_reserve(state, 5 + size / 4 * 3) : NULL;
+    uint32_t binary_size;
+    valid = out && parse_base64(str, size, out + 5, &binary_size);
+    if (valid) {
+      bson_set_size(out, binary_size, NULL);
+      out[4] = (char) subtype_value;
+      parse_commit(state, out + 5 + binary_size);
+    }
+  } else if (parse_key_is(value, "$date")) {
+    json_member_t field;
+    size_t field_next;
+    int64_t ms = 0;
+
+    *type = BSON_DATE;
+    if (count != 1) {
+      valid = false;
+    } else if (parse_raw_string(state, value->value, &str, &size)) {
+      valid = parse_iso_date(str, str + size, &ms);
+    } else if (parse_members(state, value->value, &field, 1, &field_next) == 1) {
+      valid = parse_key_is(&field, "$numberLong") &&
+              parse_raw_string(state, field.value, &str, &size) &&
+              parse_integer(str, str + size, &ms);
+    } else {
+      str   = parse_at(state, value->value);
+      valid = parse_integer(str, parse_scalar_end(state, value->value), &ms);
+    }
+
+    char* out = valid ? parse_reserve(state, 8) : NULL;
+    if (out) {
+      bson_set_element_value_int64(out, ms, &out);
+      parse_commit(state, out);
+    }
+    valid = out != NULL;
+  } else if (parse_key_is(value, "$timestamp")) {
+    json_member_t fields[2];
+    size_t fields_next;
+    json_member_t const *t, *i;
+    int64_t t_value = 0, i_value = 0;
+
+    *type = BSON_TIMESTAMP;
+    valid = count == 1 && parse_members(state, value->value, fields, 2, &fields_next) == 2 &&
+            (t = parse_member(fields, 2, "t")) && (i = parse_member(fields, 2, "i")) &&
+            parse_integer(
+                parse_at(state, t->value), parse_scalar_end(state, t->value), &t_value) &&
+            parse_integer(
+                parse_at(state, i->value), parse_scalar_end(state, i->value), &i_value) &&
+            t_value >= 0 && t_value <= UINT32_MAX && i_value >= 0 && i_value <= UINT32_MAX;
+
+    char* out = valid ? parse_reserve(state, 8) : NULL;
+    if (out) {
+      bson_set_element_value_int64(out, (int64_t) ((uint64_t) t_value << 32 | i_value), &out);
+      parse_commit(state, out);
+    }
+    valid = out != NULL;
+  } else if (parse_key_is(value, "$regularExpression")) {
+    json_member_t fields[2];
+    size_t fields_next;
+    json_member_t const *pattern, *options;
+
+    *type = BSON_REGEX;
+    valid = count == 1 && parse_members(state, value->value, fields, 2, &fields_next) == 2 &&
+            (pattern = parse_member(fields, 2, "pattern")) &&
+            (options = parse_member(fields, 2, "options"));
+    if (valid) {
+      state->token = pattern->value;
+      valid        = parse_string(state, true);
+    }
+    if (valid) {
+      state->token = options->value;
+      valid        = parse_string(state, true);
+    }
+  } else if (parse_key_is(value, "$dbPointer")) {
+    json_member_t fields[2];
+    size_t fields_next;
+    json_member_t const *ref, *id;
+
+    *type = BSON_DBPOINTER;
+    valid = count == 1 && parse_members(state, value->value, fields, 2, &fields_next) == 2 &&
+            (ref = parse_member(fields, 2, "$ref")) && (id = parse_member(fields, 2, "$id"));
+    if (valid) {
+      state->token = ref->value;
+      valid        = parse_string(state, false) && parse_oid(state, id->value);
+    }
+  } else if (parse_key_is(value, "$minKey") || parse_key_is(value, "$maxKey")) {
+    *type = value->key[2] == 'i' ? BSON_MINKEY : BSON_MAXKEY;
+    str   = parse_at(state, value->value);
+    valid = count == 1 && parse_scalar_end(state, value->value) - str == 1 && *str == '1';
+  } else if (parse_key_is(value, "$undefined")) {
+    *type = BSON_UNDEFINED;
+    str   = parse_at(state, value->value);
+    valid = count == 1 && parse_scalar_end(state, value->value) - str == 4 &&
+            memcmp(str, "true", 4) == 0;
+  } else {
+    // Any other $ key starts a plain document
+    *matched = false;
+    return true;
+  }
+
+  if (!valid) return parse_fail(state, at, BSON_JSON_ERROR_SYNTAX);
+  state->token = next;
+  return true;
+}
+
+static bool
+parse_value(json_parse_state_t* state, uint8_t* type) {
+  switch (parse_char(state, state->token)) {
+    case '{': {
+      bool matched;
+      if (!parse_extended(state, type, &matched)) return false;
+      if (matched) return true;
+      *type = BSON_OBJECT;
+      return parse_document(state, false);
+    }
+
+    case '[': *type = BSON_ARRAY; return parse_document(state, true);
+    case '"': *type = BSON_STRING; return parse_string(state, false);
+    case 'n': *type = BSON_NULL; return parse_literal(state, "null");
+
+    case 't':
+    case 'f': {
+      bool value = parse_char(state, state->token) == 't';
+      if (!parse_literal(state, value ? "true" : "false")) return false;
+      char* out = parse_reserve(state, 1);
+      if (!out) return false;
+      bson_set_element_value_bool(out, value, &out);
+      parse_commit(state, out);
+      *type = BSON_BOOLEAN;
+      return true;
+    }
+
+    default: {
+      char c = parse_char(state, state->token);
+      if (c == '-' || (c >= '0' && c <= '9')) return parse_number(state, type);
+      return parse_fail(state, parse_at(state, state->token), BSON_JSON_ERROR_SYNTAX);
+    }
+  }
+}
+
+// Object or array at the current token, its size is written once its end is known
+static bool
+parse_document(json_parse_state_t* state, bool is_array) {
+  if (++state->depth > BSON_VALIDATE_MAX_DEPTH) {
+    return parse_fail(state, parse_at(state, state->token), BSON_JSON_ERROR_DEPTH);
+  }
+
+  size_t start = state->output->size;
+  char* out    = parse_reserve(state, sizeof(uint32_t));
+  if (!out) return false;
+  parse_commit(state, out + sizeof(uint32_t));
+
+  char close = is_array ? ']' : '}';
+  ++state->token;
+  if (parse_char(state, state->token) == close) {
+    ++state->token;
+  } else {
+    for (uint32_t count = 0;; ++count) {
+      // Type byte, patched once the value is parsed
+      size_t type_offset = state->output->size;
+      out                = parse_reserve(state, 12);
+      if (!out) return false;
+      parse_commit(state, out + 1);
+
+      if (is_array) {
+        out  = json_format_uint64(out + 1, count);
+        *out = 0;
+        parse_commit(state, out + 1);
+      } else {
+        if (!parse_string(state, true)) return false;
+        if (parse_char(state, state->token) != ':') {
+          return parse_fail(state, parse_at(state, state->token), BSON_JSON_ERROR_SYNTAX);
+        }
+        ++state->token;
+      }
+
+      uint8_t type;
+      if (!parse_value(state, &type)) return false;
+      bson_set_element_type(state->output->data + type_offset, (bson_element_t) type, NULL);
+
+      char c = parse_char(state, state->token);
+      if (c != ',' && c != close) {
+        return parse_fail(state, parse_at(state, state->token), BSON_JSON_ERROR_SYNTAX);
+      }
+      ++state->token;
+      if (c == close) break;
+    }
+  }
+
+  out = parse_reserve(state, 1);
+  if (!out) return false;
+  *out = BSON_END;
+  parse_commit(state, out + 1);
+
+  size_t size = state->output->size - start;
+  if (size > INT32_MAX) return parse_fail(state, state->json, BSON_JSON_ERROR_MEMORY);
+  bson_set_size(state->output->data + start, (uint32_t) size, NULL);
+
+  --state->depth;
+  return true;
+}
+
+bson_json_status_t
+bson_json_parse(
+    bson_json_parser_t* parser,
+    bson_buffer_t* output,
+    char const* json,
+    size_t size,
+    size_t* error_offset) {
+  size_t offset = 0;
+  size_t count  = 0;
+
+  bson_json_status_t status = size <= UINT32_MAX ? json_index(parser, json, size, &count, &offset)
+                                                 : BSON_JSON_ERROR_MEMORY;
+
+  json_parse_state_t state = {
+      json, size, parser->index, count, 0, output, status, offset, 0,
+  };
+  size_t output_size = output->size;
+
+  if (state.status == BSON_JSON_OK) {
+    if (parse_char(&state, 0) != '{')
+      parse_fail(&state, parse_at(&state, 0), BSON_JSON_ERROR_SYNTAX);
+    else if (parse_document(&state, false) && state.token != count)
+      parse_fail(&state, parse_at(&state, state.token), BSON_JSON_ERROR_SYNTAX);
+  }
+
+  // Leave the output as it was on failure
+  if (state.status != BSON_JSON_OK) {
+    output->size = output_size;
+    if (error_offset) *error_offset = state.error_offset;
+  }
+  if (output->capacity) output->data[output->size] = 0;
+  return state.status;
+}
+
+bson_json_status_t
+bson_from_json(bson_buffer_t* output, char const* json, size_t size, size_t* error_offset) {
+  bson_json_parser_t parser;
+  bson_json_parser_init(&parser);
+  bson_json_status_t status = bson_json_parse(&parser, output, json, size, error_offset);
+  bson_json_parser_destroy(&parser);
+  return status;
+}
+
+// Document builder
+
+static bool
+builder_fail(bson_builder_t* builder) {
+  builder->error = true;
+  return false;
+}
+
+// Writes the type and name of a new element in the current document and makes room for
+// value_size bytes of value, returns where the value goes or NULL on error
+static char*
+builder_element(
+    bson_builder_t* builder,
+    bson_element_t type,
+    char const* name,
+    size_t value_size) {
+  if (builder->error || !builder->depth) {
+    builder_fail(builder);
+    return NULL;
+  }
+
+  bson_builder_frame_t* frame = &builder->frames[builder->depth - 1];
+
+  char key[20];
+  size_t name_size;
+  if (frame->is_array) {
+    name      = key;
+    name_size = json_format_uint64(key, frame->count) - key;
+  } else {
+    name_size = strlen(name);
+  }
+
+  size_t size = 1 + name_size + 1 + value_size;
+  if (!bson_buffer_reserve(&builder->buffer, size)) {
+    builder_fail(builder);
+    return NULL;
+  }
+
+  char* out = builder->buffer.data + builder->buffer.size;
+  bson_set_element_type(out, type, &out);
+  bson_set_element_name(out, name, (uint32_t) name_size, &out);
+
+  builder->buffer.size += size;
+  builder->buffer.data[builder->buffer.size] = 0;
+  ++frame->count;
+  return out;
+}
+
+// Reserves the size of a new document, patched by builder_close
+static bool
+builder_open(bson_builder_t* builder, bool is_array) {
+  if (builder->depth == BSON_VALIDATE_MAX_DEPTH) return builder_fail(builder);
+  if (!bson_buffer_reserve(&builder->buffer, sizeof(uint32_t))) return builder_fail(builder);
+
+  bson_builder_frame_t* frame = &builder->frames[builder->depth++];
+  frame->offset               = (uint32_t) builder->buffer.size;
+  frame->count                = 0;
+  frame->is_array             = is_array;
+
+  builder->buffer.size += sizeof(uint32_t);
+  builder->buffer.data[builder->buffer.size] = 0;
+  return true;
+}
+
+static bool
+builder_close(bson_builder_t* builder, bool is_array) {
+  if (builder->error || !builder->depth) return builder_fail(builder);
+
+  bson_builder_frame_t const* frame = &builder->frames[builder->depth - 1];
+  if (frame->is_array != is_array) return builder_fail(builder);
+
+  size_t size = builder->buffer.size + 1 - frame->offset;
+  if (size > INT32_MAX) return builder_fail(builder);
+  if (!bson_buffer_append(&builder->buffer, "", 1)) return builder_fail(builder);
+
+  bson_set_size(builder->buffer.data + frame->offset, (uint32_t) size, NULL);
+  --builder->depth;
+  return true;
+}
+
+void
+bson_builder_init(bson_builder_t* builder, char* data, size_t capacity) {
+  bson_buffer_init(&builder->buffer, data, capacity);
+  bson_builder_reset(builder);
+}
+
+void
+bson_builder_reset(bson_builder_t* builder) {
+  bson_buffer_clear(&builder->buffer);
+  builder->depth = 0;
+  builder->error = false;
+  builder_open(builder, false);
+}
+
+void
+bson_builder_destroy(bson_builder_t* builder) {
+  bson_buffer_destroy(&builder->buffer);
+  builder->depth = 0;
+  builder->error = true;
+}
+
+bool
+bson_builder_append_double(bson_builder_t* builder, char const* name, double value) {
+  char* out = builder_element(builder, BSON_DOUBLE, name, sizeof(double));
+  if (!out) return false;
+  bson_set_element_value_double(out, value, NULL);
+  return true;
+}
+
+bool
+bson_builder_append_utf8(
+    bson_builder_t* builder,
+    char const* name,
+    char const* str,
+    uint32_t size) {
+  if (size >= INT32_MAX) return builder_fail(builder);
+
+  char* out = builder_element(builder, BSON_STRING, name, sizeof(uint32_t) + size + 1);
+  if (!out) return false;
+
+  // str does not need to be NUL terminated
+  bson_set_size(out, size + 1, &out);
+  memcpy(out, str, size);
+  out[size] = 0;
+  return true;
+}
+
+bool
+bson_builder_append_binary(
+    bson_builder_t* builder,
+    char const* name,
+    void const* binary,
+    uint32_t size,
+    bson_binary_t subtype) {
+  if (size >= INT32_MAX) return builder_fail(builder);
+
+  char* out = builder_element(builder, BSON_BINARY, name, sizeof(uint32_t) + 1 + size);
+  if (!out) return false;
+  bson_set_element_value_binary(out, binary, size, subtype, NULL);
+  return true;
+}
+
+bool
+bson_builder_append_bool(bson_builder_t* builder, char const* name, bool value) {
+  char* out = builder_element(builder, BSON_BOOLEAN, name, 1);
+  if (!out) return false;
+  bson_set_element_value_bool(out, value, NULL);
+  return true;
+}
+
+bool
+bson_builder_append_null(bson_builder_t* builder, char const* name) {
+  return builder_element(builder, BSON_NULL, name, 0) != NULL;
+}
+
+bool
+bson_builder_append_int32(bson_builder_t* builder, char const* name, int32_t value) {
+  char* out = builder_element(builder, BSON_INT32, name, sizeof(int32_t));
+  if (!out) return false;
+  bson_set_element_value_int32(out, value, NULL);
+  return true;
+}
+
+bool
+bson_builder_append_int64(bson_builder_t* builder, char const* name, int64_t value) {
+  char* out = builder_element(builder, BSON_INT64, name, sizeof(int64_t));
+  if (!out) return false;
+  bson_set_element_value_int64(out, value, NULL);
+  return true;
+}
+
+bool
+bson_builder_append_document(bson_builder_t* builder, char const* name, char const* obj) {
+  uint32_t size = bson_get_size(obj, NULL);
+  char* out     = builder_element(builder, BSON_OBJECT, name, size);
+  if (!out) return false;
+  memcpy(out, obj, size);
+  return true;
+}
+
+bool
+bson_builder_begin_document(bson_builder_t* builder, char const* name) {
+  if (builder->depth == BSON_VALIDATE_MAX_DEPTH) return builder_fail(builder);
+  return builder_element(builder, BSON_OBJECT, name, 0) && builder_open(builder, false);
+}
+
+bool
+bson_builder_end_document(bson_builder_t* builder) {
+  // The root document is only closed by bson_builder_finish
+  if (builder->depth < 2) return builder_fail(builder);
+  return builder_close(builder, false);
+}
+
+bool
+bson_builder_begin_array(bson_builder_t* builder, char const* name) {
+  if (builder->depth == BSON_VALIDATE_MAX_DEPTH) return builder_fail(builder);
+  return builder_element(builder, BSON_ARRAY, name, 0) && builder_open(builder, true);
+}
+
+bool
+bson_builder_end_array(bson_builder_t* builder) {
+  return builder_close(builder, true);
+}
+
+char const*
+bson_builder_finish(bson_builder_t* builder, size_t* size) {
+  if (builder->depth != 1 || !builder_close(builder, false)) {
+    builder_fail(builder);
+    return NULL;
+  }
+
+  if (size) *size = builder->buffer.size;
+  return builder->buffer.data;
+}
+
+void
+bson_set_size(char* obj, uint32_t size, char** next) {
+  uint8_t* uobj = (uint8_t*) obj;
+
+  uobj[0] = size >> 0;
+  uobj[1] = size >> 8;
+  uobj[2] = size >> 16;
+  uobj[3] = size >> 24;
+
+  if (next) *next = obj + sizeof(uint32_t);
+}
+
+void
+bson_set_element_type(char* elem, bson_element_t type, char** next) {
+  *elem = type;
+  if (next) *next = elem + 1;
+}
+
+void
+bson_set_element_name(char* elem, char const* name, uint32_t name_size, char** next) {
+  memcpy(elem, name, name_size);
+  elem[name_size] = 0;
+  if (next) *next = elem + name_size + 1;
+}
+
+void
+bson_set_element_value_string(char* elem, char const* str, uint32_t str_size, char** next) {
+  memcpy(elem + sizeof(uint32_t), str, str_size + 1);
+
+  uint8_t* uelem = (uint8_t*) elem;
+  uint32_t size  = str_size + 1;
+
+  uelem[0] = size >> 0;
+  uelem[1] = size >> 8;
+  uelem[2] = size >> 16;
+  uelem[3] = size >> 24;
+
+  if (next) *next = elem + size + sizeof(str_size);
+}
+
+void
+bson_set_element_value_int32(char* elem, int32_t value, char** next) {
+  elem[0] = value >> 0;
+  elem[1] = value >> 8;
+  elem[2] = value >> 16;
+  elem[3] = value >> 24;
+
+  if (next) *next = elem + sizeof(value);
+}
+
+void
+bson_set_element_value_int64(char* elem, int64_t value, char** next) {
+  elem[0] = value >> 0;
+  elem[1] = value >> 8;
+  elem[2] = value >> 16;
+  elem[3] = value >> 24;
+  elem[4] = value >> 32;
+  elem[5] = value >> 40;
+  elem[6] = value >> 48;
+  elem[7] = value >> 56;
+
+  if (next) *next = elem + sizeof(value);
+}
+
+void
+bson_set_element_value_double(char* elem, double value, char** next) {
+  memcpy(elem, &value, sizeof(value));
+  if (next) *next = elem + sizeof(value);
+}
+
+void
+bson_set_element_value_binary(
+    char* elem,
+    void const* binary,
+    uint32_t size,
+    bson_binary_t subtype,
+    char** next) {
+
+  uint8_t* uelem = (uint8_t*) elem;
+
+  uelem[0] = size >> 0;
+  uelem[1] = size >> 8;
+  uelem[2] = size >> 16;
+  uelem[3] = size >> 24;
+
+  uelem[4] = subtype;
+  memcpy(elem + sizeof(uelem[4]) + sizeof(size), binary, size);
+
+  if (next) *next = elem + size + sizeof(size) + sizeof(uelem[4]);
+}
+
+void
+bson_set_element_value_bool(char* elem, bool value, char** next) {
+  *elem = value;
+  if (next) *next = elem + sizeof(value);
+}
+
+void
+bson_next(char const* elem, char const** next) {
+  uint8_t type = (uint8_t) *elem;
+  if (type != BSON_END) elem = skip_value(type, elem + strlen(elem + 1) + 2);
+  if (next) *next = elem;
+}
+
+bool
+bson_path_compile(bson_path_t* path, char const* str, size_t size) {
+  path->count = 0;
+
+  char const* end = str + size;
+  while (true) {
+    char const* dot = memchr(str, '.', end - str);
+    if (!dot) dot = end;
+    if (dot == str || path->count == BSON_PATH_MAX_SEGMENTS) {
+      // Nothing is ever found with an invalid path
+      path->count = 0;
+      return false;
+    }
+
+    bson_path_segment_t* segment = &path->segments[path->count++];
+    segment->name                = str;
+    segment->size                = (uint32_t) (dot - str);
+
+    if (dot == end) return true;
+    str = dot + 1;
+  }
+}
+
+// Element at the first count segments of path and its value, NULL when there is none. When
+// parents is not NULL, it receives the offsets of the count documents enclosing the element.
+static char const*
+path_find(
+    char const* obj,
+    bson_path_t const* path,
+    uint32_t count,
+    uint32_t* parents,
+    char const** elem) {
+  if (count == 0) return NULL;
+
+  uint32_t depth = 0;
+  char const* it = obj + sizeof(uint32_t);
+  if (parents) parents[0] = 0;
+  while (true) {
+    uint8_t it_type = (uint8_t) *it;
+    if (it_type == BSON_END) return NULL;
+
+    bson_path_segment_t const* segment = &path->segments[depth];
+    char const* name                   = it + 1;
+    size_t name_size                   = strlen(name);
+    char const* value                  = name + name_size + 1;
+
+    if (name_size == segment->size && memcmp(name, segment->name, name_size) == 0) {
+      if (++depth == count) {
+        if (elem) *elem = it;
+        return value;
+      }
+
+      // Goes down into the matched subdocument, the rest of obj is never read
+      if (it_type != BSON_OBJECT && it_type != BSON_ARRAY) return NULL;
+      if (parents) parents[depth] = (uint32_t) (value - obj);
+      it = value + sizeof(uint32_t);
+      continue;
+    }
+
+    it = skip_value(it_type, value);
+    if (!it) return NULL;
+  }
+}
+
+char const*
+bson_find_path(char const* obj, bson_path_t const* path, bson_element_t* type, char const** elem) {
+  char const* found;
+  char const* value = path_find(obj, path, path->count, NULL, &found);
+  if (!value) return NULL;
+
+  if (type) *type = (bson_element_t) *found;
+  if (elem) *elem = found;
+  return value;
+}
+
+// Edits
+
+static char*
+edit_value(char* obj, bson_path_t const* path, bson_element_t type) {
+  bson_element_t found;
+  char const* value = bson_find_path(obj, path, &found, NULL);
+  return value && found == type ? (char*) value : NULL;
+}
+
+bool
+bson_update_double(char* obj, bson_path_t const* path, double value) {
+  char* it = edit_value(obj, path, BSON_DOUBLE);
+  if (!it) return false;
+  bson_set_element_value_double(it, value, NULL);
+  return true;
+}
+
+bool
+bson_update_int32(char* obj, bson_path_t const* path, int32_t value) {
+  char* it = edit_value(obj, path, BSON_INT32);
+  if (!it) return false;
+  bson_set_element_value_int32(it, value, NULL);
+  return true;
+}
+
+bool
+bson_update_int64(char* obj, bson_path_t const* path, int64_t value) {
+  char* it = edit_value(obj, path, BSON_INT64);
+  if (!it) return false;
+  bson_set_element_value_int64(it, value, NULL);
+  return true;
+}
+
+bool
+bson_update_bool(char* obj, bson_path_t const* path, bool value) {
+  char* it = edit_value(obj, path, BSON_BOOLEAN);
+  if (!it) return false;
+  bson_set_element_value_bool(it, value, NULL);
+  return true;
+}
+
+// Replaces removed bytes at offset by a gap of inserted bytes and fixes the size of the count
+// documents at parents, returns the gap or NULL when the change does not fit
+static char*
+edit_splice(
+    bson_buffer_t* buffer,
+    uint32_t const* parents,
+    uint32_t count,
+    size_t offset,
+    size_t removed,
+    size_t inserted) {
+  if (inserted > removed) {
+    size_t growth = inserted - removed;
+    if (growth > INT32_MAX) return NULL;
+    for (uint32_t i = 0; i < count; ++i) {
+      if (bson_get_size(buffer->data + parents[i], NULL) + growth > INT32_MAX) return NULL;
+    }
+    if (!bson_buffer_reserve(buffer, growth)) return NULL;
+  }
+
+  char* at = buffer->data + offset;
+  memmove(at + inserted, at + removed, buffer->size - offset - removed);
+  buffer->size               = buffer->size - removed + inserted;
+  buffer->data[buffer->size] = 0;
+
+  for (uint32_t i = 0; i < count; ++i) {
+    char* obj = buffer->data + parents[i];
+    bson_set_size(obj, (uint32_t) (bson_get_size(obj, NULL) - removed + inserted), NULL);
+  }
+  return at;
+}
+
+bool
+bson_replace(
+    bson_buffer_t* buffer,
+    bson_path_t const* path,
+    bson_element_t type,
+    void const* value,
+    size_t value_size) {
+  uint32_t parents[BSON_PATH_MAX_SEGMENTS];
+  char const* elem;
+  char const* old = path_find(buffer->data, path, path->count, parents, &elem);
+  if (!old) return false;
+
+  char const* end = skip_value((uint8_t) *elem, old);
+  if (!end) return false;
+
+  size_t elem_offset = elem - buffer->data;
+  char* at           = edit_splice(
+      buffer, parents, path->count, old - buffer->data, end - old, value_size);
+  if (!at) return false;
+
+  memcpy(at, value, value_size);
+  bson_set_element_type(buffer->data + elem_offset, type, NULL);
+  return true;
+}
+
+bool
+bson_insert(
+    bson_buffer_t* buffer,
+    bson_path_t const* path,
+    bson_element_t type,
+    void const* value,
+    size_t value_size) {
+  if (path->count == 0 || path_find(buffer->data, path, path->count, NULL, NULL)) return false;
+
+  // Offsets of the target document and of the ones enclosing it
+  uint32_t parents[BSON_PATH_MAX_SEGMENTS];
+  uint32_t depth = path->count - 1;
+  parents[0]     = 0;
+  if (depth) {
+    char const* elem;
+    char const* obj = path_find(buffer->data, path, depth, parents, &elem);
+    if (!obj || (*elem != BSON_OBJECT && *elem != BSON_ARRAY)) return false;
+    parents[depth] = (uint32_t) (obj - buffer->data);
+  }
+
+  bson_path_segment_t const* name = &path->segments[depth];
+
+  // The new element takes the place of the END byte
+  size_t offset = parents[depth] + bson_get_size(buffer->data + parents[depth], NULL) - 1;
+
+  char* at = edit_splice(buffer, parents, depth + 1, offset, 0, 1 + name->size + 1 + value_size);
+  if (!at) return false;
+
+  bson_set_element_type(at, type, &at);
+  bson_set_element_name(at, name->name, name->size, &at);
+  memcpy(at, value, value_size);
+  return true;
+}
+
+bool
+bson_remove(bson_buffer_t* buffer, bson_path_t const* path) {
+  uint32_t parents[BSON_PATH_MAX_SEGMENTS];
+  char const* elem;
+  char const* value = path_find(buffer->data, path, path->count, parents, &elem);
+  if (!value) return false;
+
+  char const* end = skip_value((uint8_t) *elem, value);
+  if (!end) return false;
+
+  return edit_splice(buffer, parents, path->count, elem - buffer->data, end - elem, 0) != NULL;
+}
+
+static ptrdiff_t
+reader_fd_callback(void* data, void* buffer, size_t size) {
+  bson_reader_t* reader = (bson_reader_t*) data;
+  while (true) {
+    ssize_t ret = read(reader->fd, buffer, size);
+    if (ret >= 0 || errno != EINTR) return ret;
+  }
+}
+
+static ptrdiff_t
+reader_file_callback(void* data, void* buffer, size_t size) {
+  FILE* file = (FILE*) data;
+  size_t ret = fread(buffer, 1, size, file);
+  if (ret == 0 && ferror(file)) return -1;
+  return ret;
+}
+
+void
+bson_reader_init(
+    bson_reader_t* reader,
+    bson_reader_read_callback_t read,
+    void* read_data,
+    char* buffer,
+    size_t buffer_size) {
+  reader->read        = read;
+  reader->read_data   = read_data;
+  reader->fd          = -1;
+  reader->buffer      = buffer;
+  reader->capacity    = buffer ? buffer_size : 0;
+  reader->begin       = 0;
+  reader->end         = 0;
+  reader->advised     = 0;
+  reader->owns_buffer = buffer == NULL;
+  reader->mapped      = false;
+  reader->eof         = false;
+}
+
+void
+bson_reader_init_fd(bson_reader_t* reader, int fd, char* buffer, size_t buffer_size) {
+  bson_reader_init(reader, reader_fd_callback, reader, buffer, buffer_size);
+  reader->fd = fd;
+}
+
+void
+bson_reader_init_file(bson_reader_t* reader, FILE* file, char* buffer, size_t buffer_size) {
+  bson_reader_init(reader, reader_file_callback, file, buffer, buffer_size);
+}
+
+void
+bson_reader_init_buffer(bson_reader_t* reader, char const* data, size_t size) {
+  // Without read callback the buffer is never written to
+  bson_reader_init(reader, NULL, NULL, (char*) data, size);
+  reader->end         = size;
+  reader->owns_buffer = false;
+  reader->eof         = true;
+}
+
+// Maps a whole regular file read-only, data is NULL for an empty file
+static bool
+map_file(char const* filepath, char** data, size_t* size, struct stat* st) {
+  *data = NULL;
+  *size = 0;
+
+  int fd = open(filepath, O_RDONLY);
+  if (fd < 0) return false;
+
+  if (fstat(fd, st) != 0 || !S_ISREG(st->st_mode)) {
+    close(fd);
+    return false;
+  }
+
+  if (st->st_size == 0) {
+    close(fd);
+    return true;
+  }
+
+  void* mapping = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) return false;
+
+  *data = mapping;
+  *size = st->st_size;
+  return true;
+}
+
+bson_reader_status_t
+bson_reader_init_mmap(bson_reader_t* reader, char const* filepath) {
+  bson_reader_init_buffer(reader, NULL, 0);
+
+  char* data;
+  size_t size;
+  struct stat st;
+  if (!map_file(filepath, &data, &size, &st)) return BSON_READER_ERROR_READ;
+
+  // Nothing to map, the reader is simply at its end
+  if (!data) return BSON_READER_OK;
+
+  madvise(data, size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+  // The mapping is page aligned, let the kernel back it with huge pages when it can
+  madvise(data, size, MADV_HUGEPAGE);
+#endif
+
+  bson_reader_init_buffer(reader, data, size);
+  reader->mapped = true;
+  return BSON_READER_OK;
+}
+
+// Asks the kernel to prefetch the window ahead of the current position
+static void
+reader_advise(bson_reader_t* reader) {
+  if (!reader->mapped || reader->begin + BSON_READER_MMAP_WINDOW / 2 < reader->advised) return;
+
+  size_t page  = (size_t) sysconf(_SC_PAGESIZE);
+  size_t begin = reader->begin & ~(page - 1);
+  size_t end   = reader->begin + BSON_READER_MMAP_WINDOW;
+  if (end > reader->capacity) end = reader->capacity;
+
+  madvise(reader->buffer + begin, end - begin, MADV_WILLNEED);
+  reader->advised = end;
+}
+
+// Makes room for size contiguous bytes starting at begin
+static bson_reader_status_t
+reader_reserve(bson_reader_t* reader, size_t size) {
+  if (reader->begin + size <= reader->capacity) return BSON_READER_OK;
+
+  // Move the pending bytes back to the front of the buffer
+  if (reader->begin > 0) {
+    memmove(reader->buffer, reader->buffer + reader->begin, reader->end - reader->begin);
+    reader->end -= reader->begin;
+    reader->begin = 0;
+  }
+
+  if (size <= reader->capacity) return BSON_READER_OK;
+  if (!reader->owns_buffer) return BSON_READER_ERROR_SIZE;
+
+  size_t capacity = reader->capacity ? reader->capacity : BSON_READER_DEFAULT_SIZE;
+  while (capacity < size) capacity *= 2;
+
+  char* buffer = realloc(reader->buffer, capacity);
+  if (!buffer) return BSON_READER_ERROR_MEMORY;
+
+  reader->buffer   = buffer;
+  reader->capacity = capacity;
+  return BSON_READER_OK;
+}
+
+// Reads until at least size bytes are pending, as many as the buffer can hold
+static bson_reader_status_t
+reader_fill(bson_reader_t* reader, size_t size) {
+  if (!reader->read) return reader->end - reader->begin < size ? BSON_READER_EOF : BSON_READER_OK;
+
+  bson_reader_status_t status = reader_reserve(reader, size);
+  if (status != BSON_READER_OK) return status;
+
+  while (reader->end - reader->begin < size) {
+    if (reader->eof) return BSON_READER_EOF;
+
+    ptrdiff_t ret = reader->read(
+        reader->read_data, reader->buffer + reader->end, reader->capacity - reader->end);
+    if (ret < 0) return BSON_READER_ERROR_READ;
+    if (ret == 0) reader->eof = true;
+    reader->end += ret;
+  }
+
+  return BSON_READER_OK;
+}
+
+char const*
+bson_reader_next(bson_reader_t* reader, bson_reader_status_t* status) {
+  reader_advise(reader);
+
+  bson_reader_status_t result = reader_fill(reader, sizeof(uint32_t));
+  if (result == BSON_READER_EOF && reader->end != reader->begin) {
+    result = BSON_READER_ERROR_TRUNCATED;
+  }
+
+  uint32_t size = 0;
+  if (result == BSON_READER_OK) {
+    size = bson_get_size(reader->buffer + reader->begin, NULL);
+    if (size < 5 || size > INT32_MAX) result = BSON_READER_ERROR_SIZE;
+  }
+
+  if (result == BSON_READER_OK) {
+    result = reader_fill(reader, size);
+    if (result == BSON_READER_EOF) result = BSON_READER_ERROR_TRUNCATED;
+  }
+
+  if (status) *status = result;
+  if (result != BSON_READER_OK) return NULL;
+
+  char const* doc = reader->buffer + reader->begin;
+  reader->begin += size;
+  return doc;
+}
+
+void
+bson_reader_destroy(bson_reader_t* reader) {
+  if (reader->owns_buffer) free(reader->buffer);
+  if (reader->mapped) munmap(reader->buffer, reader->capacity);
+  reader->buffer   = NULL;
+  reader->capacity = 0;
+}
+
+#define ARCHIVE_MAGIC "BSONIDX"
+#define ARCHIVE_VERSION 2
+#define ARCHIVE_HEADER_SIZE 48
+#define ARCHIVE_ENTRY_SIZE 16
+
+// Entries of one key while the index is built, in host order
+typedef struct {
+  uint64_t value;
+  uint64_t position;
+} archive_entry_t;
+
+static uint64_t
+archive_get64(char const* data) {
+  uint8_t const* udata = (uint8_t const*) data;
+  uint64_t result      = 0;
+  for (int i = 7; i >= 0; --i) result = result << 8 | udata[i];
+  return result;
+}
+
+static void
+archive_set64(char* data, uint64_t value) {
+  for (int i = 0; i < 8; ++i) data[i] = (char) (value >> (8 * i));
+}
+
+// FNV-1a
+static uint64_t
+archive_hash(char const* str, uint32_t size) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (uint32_t i = 0; i < size; ++i) hash = (hash ^ (uint8_t) str[i]) * 1099511628211ULL;
+  return hash;
+}
+
+static bool
+archive_push(bson_buffer_t* entries, uint64_t value, uint64_t position) {
+  archive_entry_t entry = {value, position};
+  return bson_buffer_append(entries, &entry, sizeof(entry));
+}
+
+static int
+archive_compare_integers(void const* lhs, void const* rhs) {
+  archive_entry_t const* a = lhs;
+  archive_entry_t const* b = rhs;
+  int64_t a_value          = (int64_t) a->value;
+  int64_t b_value          = (int64_t) b->value;
+  if (a_value != b_value) return a_value < b_value ? -1 : 1;
+  return a->position < b->position ? -1 : a->position > b->position;
+}
+
+static int
+archive_compare_strings(void const* lhs, void const* rhs) {
+  archive_entry_t const* a = lhs;
+  archive_entry_t const* b = rhs;
+  if (a->value != b->value) return a->value < b->value ? -1 : 1;
+  return a->position < b->position ? -1 : a->position > b->position;
+}
+
+// Adds the value at each key path of the document at position
+static bool
+archive_index_document(
+    char const* doc,
+    uint64_t position,
+    bson_path_t const* paths,
+    uint32_t key_count,
+    bson_buffer_t* entries) {
+  for (uint32_t key = 0; key < key_count; ++key) {
+    bson_element_t type;
+    char const* value = bson_find_path(doc, &paths[key], &type, NULL);
+    if (!value) continue;
+
+    bool pushed = true;
+    switch (type) {
+      case BSON_INT32: {
+        int64_t integer = bson_get_element_value_int32(value, NULL);
+        pushed          = archive_push(&entries[2 * key], (uint64_t) integer, position);
+        break;
+      }
+
+      case BSON_INT64:
+      case BSON_DATE: {
+        int64_t integer = bson_get_element_value_int64(value, NULL);
+        pushed          = archive_push(&entries[2 * key], (uint64_t) integer, position);
+        break;
+      }
+
+      case BSON_STRING: {
+        uint32_t size;
+        char const* str = bson_get_element_value_string(value, &size, NULL);
+        pushed          = archive_push(&entries[2 * key + 1], archive_hash(str, size), position);
+        break;
+      }
+
+      default: break;
+    }
+    if (!pushed) return false;
+  }
+
+  return true;
+}
+
+// Modification time in nanoseconds, a rewrite of the same size is told apart by it or the inode
+static uint64_t
+archive_mtime(struct stat const* st) {
+  return (uint64_t) st->st_mtim.tv_sec * 1000000000 + (uint64_t) st->st_mtim.tv_nsec;
+}
+
+static void
+archive_write64(FILE* file, uint64_t value) {
+  char bytes[8];
+  archive_set64(bytes, value);
+  fwrite(bytes, 1, sizeof(bytes), file);
+}
+
+// Write errors are checked once, through ferror
+static void
+archive_write_entries(FILE* file, bson_buffer_t const* entries) {
+  archive_entry_t const* entry = (archive_entry_t const*) entries->data;
+  size_t count                 = entries->size / sizeof(archive_entry_t);
+  for (size_t i = 0; i < count; ++i) {
+    archive_write64(file, entry[i].value);
+    archive_write64(file, entry[i].position);
+  }
+}
+
+static bson_archive_status_t
+archive_write(
+    char const* index_path,
+    struct stat const* archive_stat,
+    bson_buffer_t const* offsets,
+    char const* const* keys,
+    uint32_t key_count,
+    bson_buffer_t const* entries) {
+  // Written aside then renamed, so that readers never see a partial index
+  size_t path_size = strlen(index_path);
+  char* tmp_path   = malloc(path_size + 5);
+  if (!tmp_path) return BSON_ARCHIVE_ERROR_MEMORY;
+  memcpy(tmp_path, index_path, path_size);
+  memcpy(tmp_path + path_size, ".tmp", 5);
+
+  FILE* file = fopen(tmp_path, "wb");
+  if (!file) {
+    free(tmp_path);
+    return BSON_ARCHIVE_ERROR_WRITE;
+  }
+
+  char header[ARCHIVE_HEADER_SIZE] = ARCHIVE_MAGIC;
+  bson_set_size(header + 8, ARCHIVE_VERSION, NULL);
+  bson_set_size(header + 12, key_count, NULL);
+  archive_set64(header + 16, (uint64_t) archive_stat->st_size);
+  archive_set64(header + 24, offsets->size / sizeof(uint64_t));
+  archive_set64(header + 32, archive_mtime(archive_stat));
+  archive_set64(header + 40, (uint64_t) archive_stat->st_ino);
+  fwrite(header, 1, sizeof(header), file);
+  fwrite(offsets->data, 1, offsets->size, file);
+
+  for (uint32_t key = 0; key < key_count; ++key) {
+    uint32_t name_size = (uint32_t) strlen(keys[key]);
+    char size[4];
+    bson_set_size(size, name_size, NULL);
+    fwrite(size, 1, sizeof(size), file);
+    fwrite(keys[key], 1, name_size, file);
+    archive_write64(file, entries[2 * key].size / sizeof(archive_entry_t));
+    archive_write64(file, entries[2 * key + 1].size / sizeof(archive_entry_t));
+    archive_write_entries(file, &entries[2 * key]);
+    archive_write_entries(file, &entries[2 * key + 1]);
+  }
+
+  bool written = !ferror(file);
+  written      = fclose(file) == 0 && written;
+  written      = written && rename(tmp_path, index_path) == 0;
+  if (!written) remove(tmp_path);
+  free(tmp_path);
+  return written ? BSON_ARCHIVE_OK : BSON_ARCHIVE_ERROR_WRITE;
+}
+
+// Path of the index next to the archive, to be freed
+static char*
+archive_index_path(char const* archive_path) {
+  size_t size = strlen(archive_path);
+  char* path  = malloc(size + sizeof(BSON_ARCHIVE_INDEX_SUFFIX));
+  if (!path) return NULL;
+  memcpy(path, archive_path, size);
+  memcpy(path + size, BSON_ARCHIVE_INDEX_SUFFIX, sizeof(BSON_ARCHIVE_INDEX_SUFFIX));
+  return path;
+}
+
+bson_archive_status_t
+bson_archive_index(
+    char const* archive_path,
+    char const* index_path,
+    char const* const* keys,
+    uint32_t key_count) {
+  if (key_count > BSON_ARCHIVE_MAX_KEYS) return BSON_ARCHIVE_ERROR_KEY;
+
+  bson_path_t paths[BSON_ARCHIVE_MAX_KEYS];
+  for (uint32_t key = 0; key < key_count; ++key) {
+    if (!bson_path_compile(&paths[key], keys[key], strlen(keys[key])))
+      return BSON_ARCHIVE_ERROR_KEY;
+  }
+
+  // Taken before reading, so that a write while indexing makes the index stale
+  struct stat st;
+  bson_reader_t reader;
+  if (stat(archive_path, &st) != 0 ||
+      bson_reader_init_mmap(&reader, archive_path) != BSON_READER_OK) {
+    return BSON_ARCHIVE_ERROR_READ;
+  }
+
+  // Offsets are stored as they are written, entries are sorted first
+  bson_buffer_t offsets;
+  bson_buffer_t entries[2 * BSON_ARCHIVE_MAX_KEYS];
+  bson_buffer_init(&offsets, NULL, 0);
+  for (uint32_t i = 0; i < 2 * key_count; ++i) bson_buffer_init(&entries[i], NULL, 0);
+
+  bson_archive_status_t status = BSON_ARCHIVE_OK;
+  bson_reader_status_t read_status;
+  uint64_t offset = 0;
+  char const* doc;
+  while (status == BSON_ARCHIVE_OK && (doc = bson_reader_next(&reader, &read_status))) {
+    char encoded[8];
+    archive_set64(encoded, offset);
+    uint64_t position = offsets.size / sizeof(encoded);
+    uint32_t size     = bson_get_size(doc, NULL);
+
+    // The reader only checks size prefixes, keys are looked up in validated documents only
+    if (key_count && !bson_validate(doc, size, BSON_VALIDATE_NONE, NULL)) {
+      status = BSON_ARCHIVE_ERROR_INVALID;
+    } else if (!bson_buffer_append(&offsets, encoded, sizeof(encoded)) ||
+               !archive_index_document(doc, position, paths, key_count, entries)) {
+      status = BSON_ARCHIVE_ERROR_MEMORY;
+    }
+    offset += size;
+  }
+  bson_reader_destroy(&reader);
+
+  if (status == BSON_ARCHIVE_OK && read_status != BSON_READER_EOF) {
+    status = read_status == BSON_READER_ERROR_MEMORY ? BSON_ARCHIVE_ERROR_MEMORY
+                                                     : BSON_ARCHIVE_ERROR_INVALID;
+  }
+
+  if (status == BSON_ARCHIVE_OK) {
+    for (uint32_t key = 0; key < key_count; ++key) {
+      bson_buffer_t* integers = &entries[2 * key];
+      bson_buffer_t* strings  = &entries[2 * key + 1];
+      qsort(
+          integers->data,
+          integers->size / sizeof(archive_entry_t),
+          sizeof(archive_entry_t),
+          archive_compare_integers);
+      qsort(
+          strings->data,
+          strings->size / sizeof(archive_entry_t),
+          sizeof(archive_entry_t),
+          archive_compare_strings);
+    }
+
+    char* default_path = index_path ? NULL : archive_index_path(archive_path);
+    if (index_path || default_path) {
+      status = archive_write(
+          index_path ? index_path : default_path, &st, &offsets, keys, key_count, entries);
+    } else {
+      status = BSON_ARCHIVE_ERROR_MEMORY;
+    }
+    free(default_path);
+  }
+
+  bson_buffer_destroy(&offsets);
+  for (uint32_t i = 0; i < 2 * key_count; ++i) bson_buffer_destroy(&entries[i]);
+  return status;
+}
+
+// Checks the layout of the index and points the keys into it
+static bson_archive_status_t
+archive_load(bson_archive_t* archive, struct stat const* archive_stat) {
+  char const* index = archive->index;
+  size_t size       = archive->index_size;
+  if (size < ARCHIVE_HEADER_SIZE || memcmp(index, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC)) != 0 ||
+      bson_get_size(index + 8, NULL) != ARCHIVE_VERSION) {
+    return BSON_ARCHIVE_ERROR_INDEX;
+  }
+
+  archive->key_count = bson_get_size(index + 12, NULL);
+  archive->count     = archive_get64(index + 24);
+  if (archive->key_count > BSON_ARCHIVE_MAX_KEYS) return BSON_ARCHIVE_ERROR_INDEX;
+  if (archive_get64(index + 16) != archive->size ||
+      archive_get64(index + 32) != archive_mtime(archive_stat) ||
+      archive_get64(index + 40) != (uint64_t) archive_stat->st_ino) {
+    return BSON_ARCHIVE_ERROR_STALE;
+  }
+
+  // Sizes are checked against what is left before any multiplication
+  size_t cursor = ARCHIVE_HEADER_SIZE;
+  if (archive->count > (size - cursor) / 8) return BSON_ARCHIVE_ERROR_INDEX;
+  archive->offsets = index + cursor;
+  cursor += archive->count * 8;
+
+  for (uint32_t i = 0; i < archive->key_count; ++i) {
+    bson_archive_key_t* key = &archive->keys[i];
+    if (size - cursor < 4) return BSON_ARCHIVE_ERROR_INDEX;
+    key->size = bson_get_size(index + cursor, NULL);
+    cursor += 4;
+
+    if (key->size > size - cursor || size - cursor - key->size < 16) {
+      return BSON_ARCHIVE_ERROR_INDEX;
+    }
+    key->name = index + cursor;
+    cursor += key->size;
+    if (!bson_path_compile(&key->path, key->name, key->size)) return BSON_ARCHIVE_ERROR_INDEX;
+
+    key->integer_count = archive_get64(index + cursor);
+    key->string_count  = archive_get64(index + cursor + 8);
+    cursor += 16;
+
+    uint64_t left = (size - cursor) / ARCHIVE_ENTRY_SIZE;
+    if (key->integer_count > left || key->string_count > left - key->integer_count) {
+      return BSON_ARCHIVE_ERROR_INDEX;
+    }
+    key->integers = index + cursor;
+    cursor += key->integer_count * ARCHIVE_ENTRY_SIZE;
+    key->strings = index + cursor;
+    cursor += key->string_count * ARCHIVE_ENTRY_SIZE;
+  }
+
+  return BSON_ARCHIVE_OK;
+}
+
+bson_archive_status_t
+bson_archive_open(bson_archive_t* archive, char const* archive_path, char const* index_path) {
+  memset(archive, 0, sizeof(*archive));
+
+  char* default_path = index_path ? NULL : archive_index_path(archive_path);
+  if (!index_path && !default_path) return BSON_ARCHIVE_ERROR_MEMORY;
+
+  bson_archive_status_t status = BSON_ARCHIVE_OK;
+  struct stat archive_stat;
+  struct stat index_stat;
+  if (!map_file(archive_path, &archive->data, &archive->size, &archive_stat) ||
+      !map_file(
+          index_path ? index_path : default_path,
+          &archive->index,
+          &archive->index_size,
+          &index_stat)) {
+    status = BSON_ARCHIVE_ERROR_READ;
+  }
+  free(default_path);
+
+  if (status == BSON_ARCHIVE_OK) status = archive_load(archive, &archive_stat);
+  if (status != BSON_ARCHIVE_OK) bson_archive_close(archive);
+  return status;
+}
+
+void
+bson_archive_close(bson_archive_t* archive) {
+  if (archive->data) munmap(archive->data, archive->size);
+  if (archive->index) munmap(archive->index, archive->index_size);
+  memset(archive, 0, sizeof(*archive));
+}
+
+char const*
+bson_archive_get(bson_archive_t const* archive, uint64_t position) {
+  if (position >= archive->count) return NULL;
+
+  // The index may not match the archive despite its size
+  uint64_t offset = archive_get64(archive->offsets + position * 8);
+  if (offset > archive->size || archive->size - offset < 5) return NULL;
+
+  char const* doc = archive->data + offset;
+  if (bson_get_size(doc, NULL) > archive->size - offset) return NULL;
+  return doc;
+}
+
+static bson_archive_key_t const*
+archive_key(bson_archive_t const* archive, char const* name) {
+  size_t size = strlen(name);
+  for (uint32_t i = 0; i < archive->key_count; ++i) {
+    bson_archive_key_t const* key = &archive->keys[i];
+    if (key->size == size && memcmp(key->name, name, size) == 0) return key;
+  }
+
+  return NULL;
+}
+
+// First of the count entries whose value is not less than value
+static uint64_t
+archive_lower_bound(char const* entries, uint64_t count, uint64_t value, bool is_signed) {
+  uint64_t begin = 0;
+  while (count > 0) {
+    uint64_t half  = count / 2;
+    uint64_t entry = archive_get64(entries + (begin + half) * ARCHIVE_ENTRY_SIZE);
+    bool less      = is_signed ? (int64_t) entry < (int64_t) value : entry < value;
+    if (less) {
+      begin += half + 1;
+      count -= half + 1;
+    } else {
+      count = half;
+    }
+  }
+
+  return begin;
+}
+
+uint64_t
+bson_archive_seek_int64(bson_archive_t const* archive, char const* key, int64_t value) {
+  bson_archive_key_t const* indexed = archive_key(archive, key);
+  if (!indexed) return archive->count;
+
+  uint64_t entry =
+      archive_lower_bound(indexed->integers, indexed->integer_count, (uint64_t) value, true);
+  if (entry == indexed->integer_count) return archive->count;
+  return archive_get64(indexed->integers + entry * ARCHIVE_ENTRY_SIZE + 8);
+}
+
+uint64_t
+bson_archive_find_utf8(
+    bson_archive_t const* archive,
+    char const* key,
+    char const* str,
+    uint32_t size) {
+  bson_archive_key_t const* indexed = archive_key(archive, key);
+  if (!indexed) return archive->count;
+
+  // Equal hashes are checked against the documents themselves
+  uint64_t hash  = archive_hash(str, size);
+  uint64_t entry = archive_lower_bound(indexed->strings, indexed->string_count, hash, false);
+  for (; entry < indexed->string_count; ++entry) {
+    char const* it = indexed->strings + entry * ARCHIVE_ENTRY_SIZE;
+    if (archive_get64(it) != hash) break;
+
+    uint64_t position = archive_get64(it + 8);
+    char const* doc   = bson_archive_get(archive, position);
+    if (!doc || !bson_validate(doc, bson_get_size(doc, NULL), BSON_VALIDATE_NONE, NULL)) continue;
+
+    bson_element_t type;
+    char const* value = bson_find_path(doc, &indexed->path, &type, NULL);
+    if (!value || type != BSON_STRING) continue;
+
+    uint32_t value_size;
+    char const* value_str = bson_get_element_value_string(value, &value_size, NULL);
+    if (value_size == size && memcmp(value_str, str, size) == 0) return position;
+  }
+
+  return archive->count;
 }
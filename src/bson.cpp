@@ -18,28 +18,203 @@
 
 #include "./bson.hpp"
 
+#include <algorithm>
 #include <cassert>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
+// Arena
+namespace bson {
+
+Arena::Arena(size_t block_size)
+    : _block_size(block_size)
+    , _used(0)
+    , _blocks(nullptr)
+    , _cursor(nullptr)
+    , _limit(nullptr) {}
+
+Arena::~Arena(void) { _release(); }
+
+void
+Arena::_release(void) {
+  while (_blocks) {
+    Block* next = _blocks->next;
+    ::operator delete(_blocks);
+    _blocks = next;
+  }
+}
+
+void
+Arena::_grow(size_t size) {
+  size_t block_size = _block_size;
+  while (block_size < size) block_size *= 2;
+
+  Block* block = static_cast<Block*>(::operator new(sizeof(Block) + block_size));
+  block->next  = _blocks;
+  block->size  = block_size;
+  _blocks      = block;
+  _cursor      = reinterpret_cast<char*>(block + 1);
+  _limit       = _cursor + block_size;
+}
+
+void*
+Arena::allocate(size_t size, size_t alignment) {
+  uintptr_t cursor = reinterpret_cast<uintptr_t>(_cursor);
+  uintptr_t offset = (alignment - cursor % alignment) % alignment;
+  if (!_cursor || size + offset > (size_t)(_limit - _cursor)) {
+    _grow(size + alignment);
+    cursor = reinterpret_cast<uintptr_t>(_cursor);
+    offset = (alignment - cursor % alignment) % alignment;
+  }
+
+  char* result = _cursor + offset;
+  _cursor      = result + size;
+  _used += size + offset;
+  return result;
+}
+
+void
+Arena::reset(void) {
+  if (!_blocks) return;
+
+  // Several blocks were needed: replace them by a single one that fits them all
+  if (_blocks->next) {
+    size_t total = 0;
+    for (Block* block = _blocks; block; block = block->next) total += block->size;
+
+    _release();
+    _grow(total);
+  }
+
+  _cursor = reinterpret_cast<char*>(_blocks + 1);
+  _limit  = _cursor + _blocks->size;
+  _used   = 0;
+}
+
+} // namespace bson
 
 // Object
 namespace bson {
 
 Object::Object(void) {}
 
-Variant&
-Object::operator[](std::string const& key) {
-  for (auto& value : _data) {
-    if (value.first == key) return value.second;
+Object::Object(Arena& arena)
+    : _data(ArenaAllocator<element>(&arena))
+    , _index(ArenaAllocator<uint32_t>(&arena)) {}
+
+Object::Object(Object const& rhs)
+    : _data(rhs._data)
+    , _size(rhs._size)
+    , _index(rhs._index) {
+  _own(0);
+}
+
+Object::Object(Object&& rhs) noexcept
+    : _data(std::move(rhs._data))
+    , _size(std::move(rhs._size))
+    , _index(std::move(rhs._index)) {
+  _own(0);
+}
+
+Object&
+Object::operator=(Object const& rhs) {
+  _data  = rhs._data;
+  _size  = rhs._size;
+  _index = rhs._index;
+  _own(0);
+  return *this;
+}
+
+Object&
+Object::operator=(Object&& rhs) noexcept {
+  _data  = std::move(rhs._data);
+  _size  = std::move(rhs._size);
+  _index = std::move(rhs._index);
+  _own(0);
+  return *this;
+}
+
+void
+Object::_own(size_t position) noexcept {
+  for (; position < _data.size(); ++position) _data[position].second._setOwner(&_size);
+}
+
+size_t
+Object::_lookup(std::string const& key) const {
+  if (_index.empty()) {
+    for (size_t i = 0; i < _data.size(); ++i) {
+      if (_data[i].first == key) return i;
+    }
+
+    return _data.size();
+  }
+
+  size_t const mask = _index.size() - 1;
+  for (size_t slot = std::hash<std::string>()(key) & mask; _index[slot]; slot = (slot + 1) & mask) {
+    size_t position = _index[slot] - 1;
+    if (_data[position].first == key) return position;
+  }
+
+  return _data.size();
+}
+
+void
+Object::_index_insert(size_t position) {
+  if (_index.empty()) {
+    if (_data.size() > index_threshold) _index_rebuild();
+    return;
+  }
+
+  // Keep load factor under 1/2 so probe sequences stay short
+  if (2 * _data.size() > _index.size()) {
+    _index_rebuild();
+    return;
+  }
+
+  size_t const mask = _index.size() - 1;
+  size_t slot       = std::hash<std::string>()(_data[position].first) & mask;
+  while (_index[slot]) slot = (slot + 1) & mask;
+  _index[slot] = position + 1;
+}
+
+void
+Object::_index_rebuild(void) {
+  size_t capacity = 2 * index_threshold;
+  while (capacity < 4 * _data.size()) capacity *= 2;
+
+  _index.assign(capacity, 0);
+
+  size_t const mask = capacity - 1;
+  for (size_t position = 0; position < _data.size(); ++position) {
+    size_t slot = std::hash<std::string>()(_data[position].first) & mask;
+    while (_index[slot]) slot = (slot + 1) & mask;
+    _index[slot] = position + 1;
   }
+}
 
-  _data.push_back(std::make_pair(key, Variant()));
+Variant&
+Object::operator[](std::string const& key) {
+  size_t position = _lookup(key);
+  if (position != _data.size()) return _data[position].second;
+
+  _size.reset();
+  element const* data = _data.data();
+  _data.emplace_back(key, Variant());
+  _own(data == _data.data() ? position : 0);
+  _index_insert(position);
   return _data.rbegin()->second;
 }
 
 Variant const&
 Object::operator[](std::string const& key) const {
-  for (auto& value : _data) {
-    if (value.first == key) return value.second;
-  }
+  size_t position = _lookup(key);
+  if (position != _data.size()) return _data[position].second;
 
   static Variant const end;
   return end;
@@ -57,20 +232,13 @@ Object::operator[](uint32_t key) const {
 
 Object::iterator
 Object::find(std::string const& key) {
-  for (auto it = _data.begin(); it != _data.end(); ++it) {
-    if (it->first == key) return it;
-  }
-
-  return _data.end();
+  _size.reset();
+  return _data.begin() + _lookup(key);
 }
 
 Object::const_iterator
 Object::find(std::string const& key) const {
-  for (auto it = _data.begin(); it != _data.end(); ++it) {
-    if (it->first == key) return it;
-  }
-
-  return _data.end();
+  return _data.begin() + _lookup(key);
 }
 
 Object::iterator
@@ -85,7 +253,7 @@ Object::find(uint32_t key) const {
 
 bool
 Object::has(std::string const& key) const {
-  return find(key) != end();
+  return _lookup(key) != _data.size();
 }
 
 bool
@@ -93,16 +261,117 @@ Object::has(uint32_t key) const {
   return has(std::to_string(key));
 }
 
+void
+Object::reserve(size_t size) {
+  _data.reserve(size);
+  _own(0);
+}
+
+} // namespace bson
+
+// Array
+namespace bson {
+
+Array::Array(void) {}
+
+Array::Array(Arena& arena)
+    : _data(ArenaAllocator<Variant>(&arena)) {}
+
+Array::Array(Array const& rhs)
+    : _data(rhs._data)
+    , _size(rhs._size) {
+  _own(0);
+}
+
+Array::Array(Array&& rhs) noexcept
+    : _data(std::move(rhs._data))
+    , _size(std::move(rhs._size)) {
+  _own(0);
+}
+
+Array&
+Array::operator=(Array const& rhs) {
+  _data = rhs._data;
+  _size = rhs._size;
+  _own(0);
+  return *this;
+}
+
+Array&
+Array::operator=(Array&& rhs) noexcept {
+  _data = std::move(rhs._data);
+  _size = std::move(rhs._size);
+  _own(0);
+  return *this;
+}
+
+void
+Array::_own(size_t position) noexcept {
+  for (; position < _data.size(); ++position) _data[position]._setOwner(&_size);
+}
+
+Variant&
+Array::operator[](uint32_t key) {
+  if (key == _data.size()) return append();
+  if (key > _data.size()) throw std::out_of_range("bson::Array: index past the end");
+  return _data[key];
+}
+
+Variant const&
+Array::operator[](uint32_t key) const {
+  if (key < _data.size()) return _data[key];
+
+  static Variant const end;
+  return end;
+}
+
+Variant&
+Array::append(void) {
+  _size.reset();
+  Variant const* data = _data.data();
+  _data.emplace_back();
+  _own(data == _data.data() ? _data.size() - 1 : 0);
+  return _data.back();
+}
+
+void
+Array::push_back(Variant const& value) {
+  _size.reset();
+  Variant const* data = _data.data();
+  _data.push_back(value);
+  _own(data == _data.data() ? _data.size() - 1 : 0);
+}
+
+void
+Array::push_back(Variant&& value) {
+  _size.reset();
+  Variant const* data = _data.data();
+  _data.push_back(std::move(value));
+  _own(data == _data.data() ? _data.size() - 1 : 0);
+}
+
+void
+Array::reserve(size_t size) {
+  _data.reserve(size);
+  _own(0);
+}
+
 } // namespace bson
 
 // Variant
 namespace bson {
 
 Variant::Variant(void)
-    : _type(BSON_END) {}
+    : _type(BSON_END)
+    , _arena(false)
+    , _owner(nullptr)
+    , _int64(0) {}
 
 Variant::Variant(bson_element_t type)
-    : _type(type) {
+    : _type(type)
+    , _arena(false)
+    , _owner(nullptr)
+    , _int64(0) {
   switch (_type) {
     case BSON_END: break;
 
@@ -110,14 +379,11 @@ Variant::Variant(bson_element_t type)
     case BSON_BOOLEAN: break;
     case BSON_INT32: break;
     case BSON_INT64: break;
-    case BSON_STRING: _string = new char[1]{0}; break;
+    case BSON_STRING: _string = new std::string(); break;
     case BSON_BINARY: _binary = new Binary(); break;
 
-    case BSON_OBJECT:
-    case BSON_ARRAY: {
-      _object = new Object();
-      break;
-    }
+    case BSON_OBJECT: _object = new Object(); break;
+    case BSON_ARRAY: _array = new Array(); break;
 
     // Not yet supported
     case BSON_UNDEFINED: break;
@@ -131,11 +397,16 @@ Variant::Variant(bson_element_t type)
     case BSON_SCOPED_JAVASCRIPT: break;
     case BSON_TIMESTAMP: break;
     case BSON_DECI128: break;
+    case BSON_MAXKEY: break;
+    case BSON_MINKEY: break;
   }
 }
 
 Variant::Variant(Variant const& rhs)
-    : _type(BSON_END) {
+    : _type(BSON_END)
+    , _arena(false)
+    , _owner(nullptr)
+    , _int64(0) {
   switch (rhs._type) {
     case BSON_END: break;
 
@@ -143,7 +414,12 @@ Variant::Variant(Variant const& rhs)
     case BSON_BOOLEAN: *this = rhs._boolean; break;
     case BSON_INT32: *this = rhs._int32; break;
     case BSON_INT64: *this = rhs._int64; break;
-    case BSON_STRING: *this = rhs._string; break;
+    case BSON_STRING: {
+      uint32_t size;
+      char const* str = rhs.asString(&size);
+      *this           = std::string(str, size);
+      break;
+    }
 
     case BSON_BINARY: {
       _type   = BSON_BINARY;
@@ -151,13 +427,18 @@ Variant::Variant(Variant const& rhs)
       break;
     }
 
-    case BSON_ARRAY:
     case BSON_OBJECT: {
-      _type   = rhs._type;
+      _type   = BSON_OBJECT;
       _object = new Object(*rhs._object);
       break;
     }
 
+    case BSON_ARRAY: {
+      _type  = BSON_ARRAY;
+      _array = new Array(*rhs._array);
+      break;
+    }
+
     // Not yet supported
     case BSON_UNDEFINED: break;
     case BSON_OBJECTID: break;
@@ -170,11 +451,48 @@ Variant::Variant(Variant const& rhs)
     case BSON_SCOPED_JAVASCRIPT: break;
     case BSON_TIMESTAMP: break;
     case BSON_DECI128: break;
+    case BSON_MAXKEY: break;
+    case BSON_MINKEY: break;
   }
 }
 
 Variant::~Variant(void) { _free(); }
 
+// Decimal index without leading zeros, the largest one being kept out so that index + 1 fits
+static bool
+array_index(std::string const& key, uint32_t* index) {
+  if (key.empty() || key.size() > 10 || (key[0] == '0' && key.size() > 1)) return false;
+
+  uint64_t value = 0;
+  for (char c : key) {
+    if (c < '0' || c > '9') return false;
+    value = 10 * value + (c - '0');
+  }
+
+  if (value >= UINT32_MAX) return false;
+  *index = (uint32_t) value;
+  return true;
+}
+
+Variant&
+Variant::operator[](std::string const& key) {
+  if (_type != BSON_ARRAY) return asObject()[key];
+
+  uint32_t index;
+  if (!array_index(key, &index)) throw std::out_of_range("bson::Array: key is not an index");
+  return (*_array)[index];
+}
+
+Variant const&
+Variant::operator[](std::string const& key) const {
+  static Variant const end;
+
+  uint32_t index;
+  if (_type == BSON_OBJECT) return (*_object)[key];
+  if (_type == BSON_ARRAY && array_index(key, &index)) return (*_array)[index];
+  return end;
+}
+
 void
 Variant::_free(void) {
   switch (_type) {
@@ -184,12 +502,32 @@ Variant::_free(void) {
     case BSON_BOOLEAN: break;
     case BSON_INT32: break;
     case BSON_INT64: break;
-    case BSON_STRING: delete[] _string; break;
-    case BSON_BINARY: delete _binary; break;
+    case BSON_STRING: {
+      if (!_arena) delete _string;
+      break;
+    }
+
+    case BSON_BINARY: {
+      if (_arena)
+        _binary->~Binary();
+      else
+        delete _binary;
+      break;
+    }
+
+    case BSON_OBJECT: {
+      if (_arena)
+        _object->~Object();
+      else
+        delete _object;
+      break;
+    }
 
-    case BSON_OBJECT:
     case BSON_ARRAY: {
-      delete _object;
+      if (_arena)
+        _array->~Array();
+      else
+        delete _array;
       break;
     }
 
@@ -204,303 +542,1453 @@ Variant::_free(void) {
     case BSON_SYMBOL:
     case BSON_SCOPED_JAVASCRIPT:
     case BSON_TIMESTAMP:
-    case BSON_DECI128: assert(false); break;
+    case BSON_DECI128:
+    case BSON_MAXKEY:
+    case BSON_MINKEY: assert(false); break;
   }
+
+  _arena = false;
+}
+
+Variant&
+Variant::makeString(char const* str, uint32_t size, Arena& arena) {
+  _touch();
+  _free();
+
+  // The length is stored before the characters, which may hold NUL bytes
+  char* chars = static_cast<char*>(arena.allocate(sizeof(uint32_t) + size + 1, alignof(uint32_t)));
+  memcpy(chars, &size, sizeof(uint32_t));
+  chars += sizeof(uint32_t);
+  memcpy(chars, str, size);
+  chars[size] = 0;
+
+  _type  = BSON_STRING;
+  _arena = true;
+  _chars = chars;
+  return *this;
+}
+
+Binary&
+Variant::makeBinary(bson_binary_t subtype, Arena& arena) {
+  _touch();
+  _free();
+  _type   = BSON_BINARY;
+  _arena  = true;
+  _binary = new (arena.allocate(sizeof(Binary), alignof(Binary))) Binary(subtype, arena);
+  return *_binary;
+}
+
+Object&
+Variant::makeObject(Arena& arena) {
+  _touch();
+  _free();
+  _type   = BSON_OBJECT;
+  _arena  = true;
+  _object = new (arena.allocate(sizeof(Object), alignof(Object))) Object(arena);
+  _setOwner(_owner);
+  return *_object;
+}
+
+Array&
+Variant::makeArray(Arena& arena) {
+  _touch();
+  _free();
+  _type  = BSON_ARRAY;
+  _arena = true;
+  _array = new (arena.allocate(sizeof(Array), alignof(Array))) Array(arena);
+  _setOwner(_owner);
+  return *_array;
 }
 
 } // namespace bson
 
+// View
 namespace bson {
 
-Object
-decode(char const* input) {
-  Object result;
-
-  char const* obj = input + sizeof(uint32_t);
+static char const*
+index_key(uint32_t key, char (&buffer)[11]) {
+  char* it = buffer + sizeof(buffer) - 1;
+  *it      = 0;
+  do {
+    *--it = '0' + key % 10;
+    key /= 10;
+  } while (key);
+  return it;
+}
 
-  bson_element_t type = bson_get_element_type(obj, &obj);
-  while (type != BSON_END) {
-    uint32_t name_size;
-    char const* name = bson_get_element_name(obj, &name_size, &obj);
+Path::Path(std::string path)
+    : _string(std::move(path)) {
+  _compile();
+}
 
-    switch (type) {
-      case BSON_STRING: {
-        char const* value = bson_get_element_value_string(obj, NULL, &obj);
-        result[name]      = value;
-        break;
-      }
+// Segments point into the string, they are recomputed for every copy
+Path::Path(Path const& rhs)
+    : _string(rhs._string) {
+  _compile();
+}
 
-      case BSON_INT32: {
-        int32_t value = bson_get_element_value_int32(obj, &obj);
-        result[name]  = value;
-        break;
-      }
+Path&
+Path::operator=(Path const& rhs) {
+  _string = rhs._string;
+  _compile();
+  return *this;
+}
 
-      case BSON_INT64: {
-        int64_t value = bson_get_element_value_int64(obj, &obj);
-        result[name]  = value;
-        break;
-      }
+void
+Path::_compile(void) {
+  _valid = bson_path_compile(&_path, _string.data(), _string.size());
+}
 
-      case BSON_BOOLEAN: {
-        bool value   = bson_get_element_value_bool(obj, &obj);
-        result[name] = value;
-        break;
-      }
+ElementRef::ElementRef(char const* elem)
+    : _elem(elem)
+    , _value(nullptr) {
+  if (bson_get_element_type(elem, &elem) != BSON_END) bson_get_element_name(elem, NULL, &_value);
+}
 
-      case BSON_DOUBLE: {
-        double value = bson_get_element_value_double(obj, &obj);
-        result[name] = value;
-        break;
-      }
+// Missing elements, and elements which are not documents, are seen as empty documents
+View
+ElementRef::asObject(void) const {
+  bson_element_t type = getType();
+  return View(type == BSON_OBJECT || type == BSON_ARRAY ? _value : BSON_EMPTY);
+}
 
-      case BSON_BINARY: {
-        uint32_t bin_size = 0;
-        bson_binary_t subtype;
-        uint8_t const* ubinary =
-            (uint8_t const*) bson_get_element_value_binary(obj, &bin_size, &subtype, &obj);
+View
+ElementRef::asArray(void) const {
+  return asObject();
+}
 
-        Binary binary = Binary(subtype);
-        binary.set(ubinary, ubinary + bin_size);
-        result[name] = binary;
-        break;
-      }
+ElementRef
+ElementRef::operator[](char const* key) const {
+  return asObject()[key];
+}
 
-      case BSON_OBJECT: {
-        result[name].setObject(decode(obj));
-        uint32_t sizeCurrent = bson_get_size(obj, NULL);
-        obj += sizeCurrent;
-        break;
-      }
+ElementRef
+ElementRef::operator[](std::string const& key) const {
+  return asObject()[key];
+}
 
-      case BSON_ARRAY: {
-        result[name].setArray(decode(obj));
-        uint32_t sizeCurrent = bson_get_size(obj, NULL);
-        obj += sizeCurrent;
-        break;
-      }
+ElementRef
+ElementRef::operator[](uint32_t key) const {
+  return asObject()[key];
+}
 
-      default: assert(false); return result;
-    }
+View::const_iterator&
+View::const_iterator::operator++(void) {
+  char const* next;
+  bson_next(_ref._elem, &next);
+  _ref = ElementRef(next);
+  return *this;
+}
 
-    type = bson_get_element_type(obj, &obj);
+View::const_iterator
+View::find(char const* key) const {
+  char const* elem = _obj + sizeof(uint32_t);
+  while (bson_get_element_type(elem, NULL) != BSON_END) {
+    if (strcmp(elem + 1, key) == 0) return const_iterator(elem);
+    bson_next(elem, &elem);
   }
 
-  return result;
+  return const_iterator(elem);
 }
 
-uint32_t
-encode_len(Object const& obj) {
-  uint32_t result = sizeof(uint32_t);
+View::const_iterator
+View::find(uint32_t key) const {
+  char buffer[11];
+  return find(index_key(key, buffer));
+}
 
-  for (auto const& value : obj) {
-    result += 1; // type
-    result += value.first.length() + 1;
+ElementRef
+View::operator[](char const* key) const {
+  const_iterator it = find(key);
+  return it->getType() != BSON_END ? *it : ElementRef();
+}
 
-    switch (value.second.getType()) {
-      case BSON_END: assert(false); break;
-
-      case BSON_DOUBLE: result += sizeof(double); break;
-      case BSON_BOOLEAN: result += sizeof(bool); break;
-      case BSON_INT32: result += sizeof(int32_t); break;
-      case BSON_INT64: result += sizeof(int64_t); break;
-      case BSON_STRING: result += sizeof(uint32_t) + strlen(value.second.asString()) + 1; break;
-      case BSON_BINARY: {
-        result += sizeof(uint8_t) + sizeof(uint32_t) + value.second.asBinary().length();
-        break;
-      }
-      case BSON_OBJECT: result += encode_len(value.second.asArray()); break;
-      case BSON_ARRAY: result += encode_len(value.second.asObject()); break;
+ElementRef
+View::operator[](uint32_t key) const {
+  char buffer[11];
+  return operator[](index_key(key, buffer));
+}
 
-      // Not yet supported
-      case BSON_UNDEFINED:
-      case BSON_OBJECTID:
-      case BSON_DATE:
-      case BSON_NULL:
-      case BSON_REGEX:
-      case BSON_DBPOINTER:
-      case BSON_JAVASCRIPT:
-      case BSON_SYMBOL:
-      case BSON_SCOPED_JAVASCRIPT:
-      case BSON_TIMESTAMP:
-      case BSON_DECI128: assert(false); break;
-    }
-  }
+ElementRef
+View::operator[](Path const& path) const {
+  char const* elem;
+  if (!bson_find_path(_obj, path.get(), nullptr, &elem)) return ElementRef();
+  return ElementRef(elem);
+}
 
-  result += 1; // BSON_END
+Index::Index(View const& view, uint32_t flags) {
+  _storage.resize(bson_index_storage_size(view.data(), flags) / sizeof(uint32_t));
+  _valid = bson_index_build(
+      &_index, view.data(), flags, _storage.data(), _storage.size() * sizeof(uint32_t));
+  if (!_valid) _index = bson_index_t{view.data(), nullptr, 0, nullptr, 0};
+}
 
-  return result;
+Index::Index(View const& view, Arena& arena, uint32_t flags) {
+  size_t size   = bson_index_storage_size(view.data(), flags);
+  void* storage = arena.allocate(size, alignof(uint32_t));
+  _valid        = bson_index_build(&_index, view.data(), flags, storage, size);
+  if (!_valid) _index = bson_index_t{view.data(), nullptr, 0, nullptr, 0};
 }
 
-void
-encode(Object const& obj, char* output, char** next) {
-  char* it = output + sizeof(uint32_t);
-  for (auto const& value : obj) {
-    bson_set_element_type(it, value.second.getType(), &it);
-    bson_set_element_name(it, value.first.c_str(), value.first.length(), &it);
+Projection::Projection(std::vector<std::string> fields)
+    : _fields(std::move(fields)) {
+  _compile();
+}
 
-    switch (value.second.getType()) {
-      case BSON_END: assert(false); break;
+// Names point into the strings, they are recomputed for every copy
+Projection::Projection(Projection const& rhs)
+    : _fields(rhs._fields) {
+  _compile();
+}
 
-      case BSON_DOUBLE: bson_set_element_value_double(it, value.second.asDouble(), &it); break;
-      case BSON_BOOLEAN: bson_set_element_value_bool(it, value.second.asBoolean(), &it); break;
-      case BSON_INT32: bson_set_element_value_int32(it, value.second.asInt32(), &it); break;
-      case BSON_INT64: bson_set_element_value_int64(it, value.second.asInt64(), &it); break;
+Projection&
+Projection::operator=(Projection const& rhs) {
+  _fields = rhs._fields;
+  _compile();
+  return *this;
+}
 
-      case BSON_STRING: {
-        bson_set_element_value_string(
-            it, value.second.asString(), strlen(value.second.asString()), &it);
-        break;
-      }
+void
+Projection::_compile(void) {
+  std::vector<char const*> names;
+  names.reserve(_fields.size());
+  for (auto const& field : _fields) names.push_back(field.c_str());
 
-      case BSON_BINARY: {
-        bson_set_element_value_binary(
-            it,
-            value.second.asBinary().get().data(),
-            value.second.asBinary().get().size(),
-            value.second.asBinary().getType(),
-            &it);
-        break;
-      }
+  uint32_t count = (uint32_t) std::min<size_t>(names.size(), BSON_PROJECTION_MAX_FIELDS + 1);
+  _valid         = bson_projection_compile(&_projection, names.data(), count);
+}
 
-      case BSON_OBJECT:
-      case BSON_ARRAY: {
-        encode(value.second.asObject(), it, &it);
-        break;
-      }
+size_t
+Projection::extract(View const& view, std::vector<ElementRef>& result) const {
+  bson_projection_slot_t slots[BSON_PROJECTION_MAX_FIELDS];
+  uint32_t found = bson_projection_extract(&_projection, view.data(), slots);
 
-      // Not yet supported
-      case BSON_UNDEFINED:
-      case BSON_OBJECTID:
-      case BSON_DATE:
-      case BSON_NULL:
-      case BSON_REGEX:
-      case BSON_DBPOINTER:
-      case BSON_JAVASCRIPT:
-      case BSON_SYMBOL:
-      case BSON_SCOPED_JAVASCRIPT:
-      case BSON_TIMESTAMP:
-      case BSON_DECI128: assert(false); break;
-    }
+  result.resize(_projection.count);
+  for (uint32_t i = 0; i < _projection.count; ++i) {
+    result[i] = slots[i].elem ? ElementRef(slots[i].elem, slots[i].value) : ElementRef();
   }
-
-  bson_set_element_type(it, BSON_END, &it);
-  bson_set_size(output, it - output, NULL);
-  if (next) *next = it;
+  return found;
 }
 
-std::vector<char>
-encode(Object const& obj) {
-  uint32_t len = encode_len(obj);
-  std::vector<char> result(len);
-  encode(obj, result.data());
-  return result;
-}
+Column::Column(std::string path, bson_element_t type)
+    : _path(std::move(path))
+    , _type(type)
+    , _size(0)
+    , _null_count(0)
+    , _offsets(1, 0) {}
 
-static void
-print_indent(std::ostream& os, size_t indent) {
-  for (size_t i = 0; i < indent; ++i) os << " ";
+void
+Column::clear(void) {
+  _size       = 0;
+  _null_count = 0;
+  _nulls.clear();
+  _int32s.clear();
+  _int64s.clear();
+  _doubles.clear();
+  _bools.clear();
+  _offsets.resize(1);
+  _bytes.clear();
 }
 
-static void
-bson_print_object_or_array(
-    std::ostream& os,
-    Object const& obj,
-    size_t indent,
-    size_t indent_step,
-    bson_element_t base_type,
-    bool indent_first) {
-  uint32_t size = encode_len(obj);
-
-  if (indent_first) print_indent(os, indent);
-  switch (base_type) {
-    case BSON_OBJECT: {
-      os << "object(size=" << size << ") {\n";
+// type is BSON_END and value NULL for a missing field
+void
+Column::_append(bson_element_t type, char const* value) {
+  bool null = false;
+  switch (_type) {
+    case BSON_INT32: {
+      null = type != BSON_INT32;
+      _int32s.push_back(null ? 0 : bson_get_element_value_int32(value, NULL));
       break;
     }
 
-    case BSON_ARRAY: {
-      os << "array(size=" << size << ") [\n";
+    case BSON_INT64: {
+      int64_t integer = 0;
+      if (type == BSON_INT64)
+        integer = bson_get_element_value_int64(value, NULL);
+      else if (type == BSON_INT32)
+        integer = bson_get_element_value_int32(value, NULL);
+      else
+        null = true;
+      _int64s.push_back(integer);
       break;
     }
 
-    default: os << "Not handled: " << (int) base_type << "\n"; return;
-  }
-
-  for (auto it = obj.begin(); it != obj.end(); ++it) {
-    auto const& value = *it;
-    print_indent(os, indent + indent_step);
-    os << '"' << value.first << "\": ";
-
-    switch (value.second.getType()) {
-      case BSON_STRING: os << '"' << value.second.asString() << '"'; break;
-      case BSON_INT32: os << "int32(" << value.second.asInt32() << ')'; break;
-      case BSON_INT64: os << "int64(" << value.second.asInt64() << ')'; break;
-      case BSON_DOUBLE: os << "double(" << value.second.asDouble() << ')'; break;
-      case BSON_BOOLEAN: {
-        os << "bool(" << (value.second.asBoolean() ? "true" : "false") << ')';
-        break;
-      }
-
-      case BSON_BINARY: {
-        Binary const& bin = value.second.asBinary();
-        os << "binary(size=" << bin.length() << ",subtype=" << bin.getType() << ") <";
-        static const uint32_t line_size = 32;
-        char buffer[4]                  = {0};
-        for (uint32_t i = 0; i < bin.length();) {
-          os << "\n";
-          print_indent(os, indent + 2 * indent_step);
-          for (uint32_t len = 0; i < bin.length() && len < line_size; ++len, ++i) {
-            snprintf(buffer, sizeof(buffer), "%02x", bin.get()[i]);
-            os << buffer;
-          }
-        }
-        os << "\n";
-        print_indent(os, indent + indent_step);
-        os << ">";
-        break;
-      }
-
-      case BSON_OBJECT: {
-        bson_print_object_or_array(
-            os, value.second.asObject(), indent + indent_step, indent_step, BSON_OBJECT, false);
-        break;
-      }
-
-      case BSON_ARRAY: {
-        bson_print_object_or_array(
-            os, value.second.asArray(), indent + indent_step, indent_step, BSON_ARRAY, false);
-        break;
-      }
-
-      default: os << "Not handled: " << (int) value.second.getType() << "\n"; return;
+    case BSON_DOUBLE: {
+      double number = 0;
+      if (type == BSON_DOUBLE)
+        number = bson_get_element_value_double(value, NULL);
+      else if (type == BSON_INT64)
+        number = (double) bson_get_element_value_int64(value, NULL);
+      else if (type == BSON_INT32)
+        number = bson_get_element_value_int32(value, NULL);
+      else
+        null = true;
+      _doubles.push_back(number);
+      break;
     }
 
-    if (std::next(it) != obj.end())
-      os << ",\n";
-    else
-      os << "\n";
-  }
-
-  print_indent(os, indent);
-  switch (base_type) {
-    case BSON_OBJECT: {
-      os << "}";
+    case BSON_BOOLEAN: {
+      null = type != BSON_BOOLEAN;
+      _bools.push_back(!null && bson_get_element_value_bool(value, NULL));
       break;
     }
 
-    case BSON_ARRAY: {
-      os << "]";
+    case BSON_STRING: {
+      null = type != BSON_STRING;
+      if (!null) {
+        uint32_t size;
+        char const* str = bson_get_element_value_string(value, &size, NULL);
+        _bytes.insert(_bytes.end(), str, str + size);
+      }
+      _offsets.push_back(_bytes.size());
       break;
     }
 
-    default: os << "Not handled: " << (int) base_type << "\n"; return;
+    default: null = true; break;
+  }
+
+  if (_size % 8 == 0) _nulls.push_back(0);
+  if (null) {
+    _nulls.back() |= 1 << (_size % 8);
+    ++_null_count;
   }
+  ++_size;
+}
+
+ColumnExtractor::ColumnExtractor(std::vector<std::pair<std::string, bson_element_t>> const& fields)
+    : _rows(0) {
+  _columns.reserve(fields.size());
+  for (auto const& field : fields) _columns.push_back(Column(field.first, field.second));
+  _compile();
+}
+
+// Paths point into the column strings, they are recomputed for every copy
+ColumnExtractor::ColumnExtractor(ColumnExtractor const& rhs)
+    : _columns(rhs._columns)
+    , _rows(rhs._rows) {
+  _compile();
+}
+
+ColumnExtractor&
+ColumnExtractor::operator=(ColumnExtractor const& rhs) {
+  _columns = rhs._columns;
+  _rows    = rhs._rows;
+  _compile();
+  return *this;
+}
+
+void
+ColumnExtractor::_compile(void) {
+  _heads.clear();
+  _fields.clear();
+  _valid = true;
+
+  for (Column const& column : _columns) {
+    bson_path_t path;
+    if (!bson_path_compile(&path, column.path().data(), column.path().size())) _valid = false;
+    switch (column.type()) {
+      case BSON_INT32:
+      case BSON_INT64:
+      case BSON_DOUBLE:
+      case BSON_BOOLEAN:
+      case BSON_STRING: break;
+      default: _valid = false; break;
+    }
+    if (!_valid) return;
+
+    std::string head(path.segments[0].name, path.segments[0].size);
+    size_t index = std::find(_heads.begin(), _heads.end(), head) - _heads.begin();
+    if (index == _heads.size()) _heads.push_back(std::move(head));
+
+    Field field;
+    field.head       = (uint32_t) index;
+    field.rest.count = path.count - 1;
+    std::copy(path.segments + 1, path.segments + path.count, field.rest.segments);
+    _fields.push_back(field);
+  }
+
+  std::vector<char const*> names;
+  names.reserve(_heads.size());
+  for (auto const& head : _heads) names.push_back(head.c_str());
+
+  uint32_t count = (uint32_t) std::min<size_t>(names.size(), BSON_PROJECTION_MAX_FIELDS + 1);
+  _valid         = bson_projection_compile(&_projection, names.data(), count);
+}
+
+void
+ColumnExtractor::append(char const* obj) {
+  if (!_valid) return;
+
+  bson_projection_slot_t slots[BSON_PROJECTION_MAX_FIELDS];
+  bson_projection_extract(&_projection, obj, slots);
+
+  for (size_t i = 0; i < _columns.size(); ++i) {
+    Field const& field                 = _fields[i];
+    bson_projection_slot_t const& slot = slots[field.head];
+
+    bson_element_t type = slot.type;
+    char const* value   = slot.value;
+    if (value && field.rest.count) {
+      bool nested = type == BSON_OBJECT || type == BSON_ARRAY;
+      value       = nested ? bson_find_path(value, &field.rest, &type, NULL) : nullptr;
+    }
+
+    _columns[i]._append(value ? type : BSON_END, value);
+  }
+  ++_rows;
+}
+
+bson_reader_status_t
+ColumnExtractor::append(char const* data, size_t size) {
+  bson_reader_t reader;
+  bson_reader_init_buffer(&reader, data, size);
+
+  bson_reader_status_t status;
+  char const* doc;
+  while ((doc = bson_reader_next(&reader, &status))) append(doc);
+  bson_reader_destroy(&reader);
+  return status;
+}
+
+void
+ColumnExtractor::clear(void) {
+  for (Column& column : _columns) column.clear();
+  _rows = 0;
+}
+
+} // namespace bson
+
+namespace bson {
+
+static void
+decode_into(Object& result, char const* input, Arena* arena);
+
+static void
+decode_into(Array& result, char const* input, Arena* arena);
+
+// Decodes the value of an element of the given type, returns the end of that value
+static char const*
+decode_value(Variant& var, bson_element_t type, char const* obj, Arena* arena) {
+  switch (type) {
+    case BSON_STRING: {
+      uint32_t value_size;
+      char const* value = bson_get_element_value_string(obj, &value_size, &obj);
+      if (arena)
+        var.makeString(value, value_size, *arena);
+      else
+        var = std::string(value, value_size);
+      break;
+    }
+
+    case BSON_INT32: {
+      int32_t value = bson_get_element_value_int32(obj, &obj);
+      var           = value;
+      break;
+    }
+
+    case BSON_INT64: {
+      int64_t value = bson_get_element_value_int64(obj, &obj);
+      var           = value;
+      break;
+    }
+
+    case BSON_BOOLEAN: {
+      bool value = bson_get_element_value_bool(obj, &obj);
+      var        = value;
+      break;
+    }
+
+    case BSON_DOUBLE: {
+      double value = bson_get_element_value_double(obj, &obj);
+      var          = value;
+      break;
+    }
+
+    case BSON_BINARY: {
+      uint32_t bin_size = 0;
+      bson_binary_t subtype;
+      uint8_t const* ubinary =
+          (uint8_t const*) bson_get_element_value_binary(obj, &bin_size, &subtype, &obj);
+
+      if (arena) {
+        var.makeBinary(subtype, *arena).set(ubinary, ubinary + bin_size);
+      } else {
+        Binary binary = Binary(subtype);
+        binary.set(ubinary, ubinary + bin_size);
+        var = std::move(binary);
+      }
+      break;
+    }
+
+    case BSON_OBJECT: {
+      if (arena) {
+        decode_into(var.makeObject(*arena), obj, arena);
+      } else {
+        var.setObject(Object());
+        decode_into(var.asObject(), obj, arena);
+      }
+
+      obj += bson_get_size(obj, NULL);
+      break;
+    }
+
+    case BSON_ARRAY: {
+      if (arena) {
+        decode_into(var.makeArray(*arena), obj, arena);
+      } else {
+        var.setArray(Array());
+        decode_into(var.asArray(), obj, arena);
+      }
+
+      obj += bson_get_size(obj, NULL);
+      break;
+    }
+
+    default: assert(false); return nullptr;
+  }
+
+  return obj;
+}
+
+// Children are decoded in place into their parent, allocating from arena when given
+static void
+decode_into(Object& result, char const* input, Arena* arena) {
+  // Growing a vector in an arena would leave the previous storage behind
+  if (arena) result.reserve(bson_get_element_count(input));
+
+  char const* obj = input + sizeof(uint32_t);
+
+  bson_element_t type = bson_get_element_type(obj, &obj);
+  while (type != BSON_END) {
+    uint32_t name_size;
+    char const* name = bson_get_element_name(obj, &name_size, &obj);
+
+    obj = decode_value(result[std::string(name, name_size)], type, obj, arena);
+    if (!obj) return;
+
+    type = bson_get_element_type(obj, &obj);
+  }
+}
+
+// Keys are assumed to be "0", "1"... in order and are not checked
+static void
+decode_into(Array& result, char const* input, Arena* arena) {
+  if (arena) result.reserve(bson_get_element_count(input));
+
+  char const* obj = input + sizeof(uint32_t);
+
+  bson_element_t type = bson_get_element_type(obj, &obj);
+  while (type != BSON_END) {
+    bson_get_element_name(obj, NULL, &obj);
+
+    obj = decode_value(result.append(), type, obj, arena);
+    if (!obj) return;
+
+    type = bson_get_element_type(obj, &obj);
+  }
+}
+
+Object
+decode(char const* input) {
+  Object result;
+  decode_into(result, input, nullptr);
+  return result;
+}
+
+Object
+decode(char const* input, Arena& arena) {
+  Object result(arena);
+  decode_into(result, input, &arena);
+  return result;
+}
+
+// Keys of the first array elements, written as is by the encoder
+static uint32_t const array_key_count = 1000;
+
+struct ArrayKeys {
+  char keys[array_key_count][4];
+  uint8_t sizes[array_key_count];
+
+  ArrayKeys(void) {
+    for (uint32_t key = 0; key < array_key_count; ++key) {
+      char buffer[11];
+      char const* str = index_key(key, buffer);
+      sizes[key]      = (uint8_t) strlen(str);
+      memcpy(keys[key], str, sizes[key] + 1);
+    }
+  }
+};
+
+static ArrayKeys const&
+array_keys(void) {
+  static ArrayKeys const keys;
+  return keys;
+}
+
+static char const*
+array_key(ArrayKeys const& keys, uint32_t key, char (&buffer)[11], uint32_t* size) {
+  if (key < array_key_count) {
+    *size = keys.sizes[key];
+    return keys.keys[key];
+  }
+
+  char const* str = index_key(key, buffer);
+  *size           = buffer + sizeof(buffer) - 1 - str;
+  return str;
+}
+
+static uint32_t
+array_key_size(ArrayKeys const& keys, uint32_t key) {
+  if (key < array_key_count) return keys.sizes[key];
+
+  uint32_t size = 1;
+  for (; key >= 10; key /= 10) ++size;
+  return size;
+}
+
+static uint32_t
+encode_value_len(Variant const& value) {
+  switch (value.getType()) {
+    case BSON_END: assert(false); break;
+
+    case BSON_DOUBLE: return sizeof(double);
+    case BSON_BOOLEAN: return sizeof(bool);
+    case BSON_INT32: return sizeof(int32_t);
+    case BSON_INT64: return sizeof(int64_t);
+    case BSON_STRING: {
+      uint32_t size;
+      value.asString(&size);
+      return sizeof(uint32_t) + size + 1;
+    }
+    case BSON_BINARY: return sizeof(uint8_t) + sizeof(uint32_t) + value.asBinary().length();
+    case BSON_OBJECT: return encode_len(value.asObject());
+    case BSON_ARRAY: return encode_len(value.asArray());
+
+    // Not yet supported
+    case BSON_UNDEFINED:
+    case BSON_OBJECTID:
+    case BSON_DATE:
+    case BSON_NULL:
+    case BSON_REGEX:
+    case BSON_DBPOINTER:
+    case BSON_JAVASCRIPT:
+    case BSON_SYMBOL:
+    case BSON_SCOPED_JAVASCRIPT:
+    case BSON_TIMESTAMP:
+    case BSON_DECI128:
+    case BSON_MAXKEY:
+    case BSON_MINKEY: assert(false); break;
+  }
+
+  return 0;
+}
+
+uint32_t
+encode_len(Object const& obj) {
+  uint32_t result = obj._size.get();
+  if (result) return result;
+
+  result = sizeof(uint32_t);
+
+  for (auto const& value : obj) {
+    result += 1; // type
+    result += value.first.length() + 1;
+    result += encode_value_len(value.second);
+  }
+
+  result += 1; // BSON_END
+
+  obj._size.set(result);
+  return result;
+}
+
+uint32_t
+encode_len(Array const& array) {
+  uint32_t result = array._size.get();
+  if (result) return result;
+
+  result = sizeof(uint32_t);
+
+  ArrayKeys const& keys = array_keys();
+  uint32_t key          = 0;
+  for (auto const& value : array) {
+    result += 1; // type
+    result += array_key_size(keys, key++) + 1;
+    result += encode_value_len(value);
+  }
+
+  result += 1; // BSON_END
+
+  array._size.set(result);
+  return result;
+}
+
+static void
+encode(Array const& array, char* output, char** next);
+
+static char*
+encode_value(Variant const& value, char* it) {
+  switch (value.getType()) {
+    case BSON_END: assert(false); break;
+
+    case BSON_DOUBLE: bson_set_element_value_double(it, value.asDouble(), &it); break;
+    case BSON_BOOLEAN: bson_set_element_value_bool(it, value.asBoolean(), &it); break;
+    case BSON_INT32: bson_set_element_value_int32(it, value.asInt32(), &it); break;
+    case BSON_INT64: bson_set_element_value_int64(it, value.asInt64(), &it); break;
+
+    case BSON_STRING: {
+      uint32_t size;
+      char const* str = value.asString(&size);
+      bson_set_element_value_string(it, str, size, &it);
+      break;
+    }
+
+    case BSON_BINARY: {
+      bson_set_element_value_binary(
+          it,
+          value.asBinary().get().data(),
+          value.asBinary().get().size(),
+          value.asBinary().getType(),
+          &it);
+      break;
+    }
+
+    case BSON_OBJECT: encode(value.asObject(), it, &it); break;
+    case BSON_ARRAY: encode(value.asArray(), it, &it); break;
+
+    // Not yet supported
+    case BSON_UNDEFINED:
+    case BSON_OBJECTID:
+    case BSON_DATE:
+    case BSON_NULL:
+    case BSON_REGEX:
+    case BSON_DBPOINTER:
+    case BSON_JAVASCRIPT:
+    case BSON_SYMBOL:
+    case BSON_SCOPED_JAVASCRIPT:
+    case BSON_TIMESTAMP:
+    case BSON_DECI128:
+    case BSON_MAXKEY:
+    case BSON_MINKEY: assert(false); break;
+  }
+
+  return it;
+}
+
+void
+encode(Object const& obj, char* output, char** next) {
+  char* it = output + sizeof(uint32_t);
+  for (auto const& value : obj) {
+    bson_set_element_type(it, value.second.getType(), &it);
+    bson_set_element_name(it, value.first.c_str(), value.first.length(), &it);
+    it = encode_value(value.second, it);
+  }
+
+  bson_set_element_type(it, BSON_END, &it);
+  bson_set_size(output, it - output, NULL);
+  if (next) *next = it;
+}
+
+static void
+encode(Array const& array, char* output, char** next) {
+  char* it = output + sizeof(uint32_t);
+
+  ArrayKeys const& keys = array_keys();
+  uint32_t key          = 0;
+  for (auto const& value : array) {
+    char buffer[11];
+    uint32_t key_size;
+    char const* key_str = array_key(keys, key++, buffer, &key_size);
+
+    bson_set_element_type(it, value.getType(), &it);
+    bson_set_element_name(it, key_str, key_size, &it);
+    it = encode_value(value, it);
+  }
+
+  bson_set_element_type(it, BSON_END, &it);
+  bson_set_size(output, it - output, NULL);
+  if (next) *next = it;
+}
+
+// Outputs of the single-pass encoder. Documents sizes are patched through their offset since
+// grow() may move the output.
+
+template<typename Container>
+class ContainerOutput {
+ public:
+  explicit ContainerOutput(Container& container)
+      : _container(container) {}
+
+  inline char*
+  grow(size_t size) {
+    size_t offset = _container.size();
+    _container.resize(offset + size);
+    return &_container[offset];
+  }
+
+  inline size_t
+  size(void) const {
+    return _container.size();
+  }
+
+  inline char*
+  at(size_t offset) {
+    return &_container[offset];
+  }
+
+ private:
+  Container& _container;
+};
+
+class BufferOutput {
+ public:
+  explicit BufferOutput(bson_buffer_t* buffer)
+      : _buffer(buffer) {}
+
+  inline char*
+  grow(size_t size) {
+    if (!bson_buffer_reserve(_buffer, size)) throw std::bad_alloc();
+
+    char* result = _buffer->data + _buffer->size;
+    _buffer->size += size;
+    _buffer->data[_buffer->size] = 0;
+    return result;
+  }
+
+  inline size_t
+  size(void) const {
+    return _buffer->size;
+  }
+
+  inline char*
+  at(size_t offset) {
+    return _buffer->data + offset;
+  }
+
+ private:
+  bson_buffer_t* _buffer;
+};
+
+template<typename Output>
+static void
+encode_append(Output& output, Object const& obj);
+
+template<typename Output>
+static void
+encode_append(Output& output, Array const& array);
+
+template<typename Output>
+static void
+encode_append_element(Output& output, Variant const& value, char const* name, uint32_t name_size) {
+  char* it = output.grow(1 + name_size + 1);
+  bson_set_element_type(it, value.getType(), &it);
+  bson_set_element_name(it, name, name_size, &it);
+
+  switch (value.getType()) {
+    case BSON_END: assert(false); break;
+
+    case BSON_DOUBLE: {
+      bson_set_element_value_double(output.grow(sizeof(double)), value.asDouble(), nullptr);
+      break;
+    }
+
+    case BSON_BOOLEAN: {
+      bson_set_element_value_bool(output.grow(sizeof(bool)), value.asBoolean(), nullptr);
+      break;
+    }
+
+    case BSON_INT32: {
+      bson_set_element_value_int32(output.grow(sizeof(int32_t)), value.asInt32(), nullptr);
+      break;
+    }
+
+    case BSON_INT64: {
+      bson_set_element_value_int64(output.grow(sizeof(int64_t)), value.asInt64(), nullptr);
+      break;
+    }
+
+    case BSON_STRING: {
+      uint32_t size;
+      char const* str = value.asString(&size);
+      bson_set_element_value_string(output.grow(sizeof(uint32_t) + size + 1), str, size, nullptr);
+      break;
+    }
+
+    case BSON_BINARY: {
+      Binary const& binary = value.asBinary();
+      bson_set_element_value_binary(
+          output.grow(sizeof(uint32_t) + sizeof(uint8_t) + binary.length()),
+          binary.get().data(),
+          binary.length(),
+          binary.getType(),
+          nullptr);
+      break;
+    }
+
+    case BSON_OBJECT: encode_append(output, value.asObject()); break;
+    case BSON_ARRAY: encode_append(output, value.asArray()); break;
+
+    // Not yet supported
+    case BSON_UNDEFINED:
+    case BSON_OBJECTID:
+    case BSON_DATE:
+    case BSON_NULL:
+    case BSON_REGEX:
+    case BSON_DBPOINTER:
+    case BSON_JAVASCRIPT:
+    case BSON_SYMBOL:
+    case BSON_SCOPED_JAVASCRIPT:
+    case BSON_TIMESTAMP:
+    case BSON_DECI128:
+    case BSON_MAXKEY:
+    case BSON_MINKEY: assert(false); break;
+  }
+}
+
+template<typename Output>
+static void
+encode_append(Output& output, Object const& obj) {
+  size_t start = output.size();
+  output.grow(sizeof(uint32_t));
+
+  for (auto const& value : obj) {
+    encode_append_element(output, value.second, value.first.data(), value.first.size());
+  }
+
+  bson_set_element_type(output.grow(1), BSON_END, nullptr);
+  bson_set_size(output.at(start), (uint32_t)(output.size() - start), nullptr);
+}
+
+template<typename Output>
+static void
+encode_append(Output& output, Array const& array) {
+  size_t start = output.size();
+  output.grow(sizeof(uint32_t));
+
+  ArrayKeys const& keys = array_keys();
+  uint32_t key          = 0;
+  for (auto const& value : array) {
+    char buffer[11];
+    uint32_t key_size;
+    char const* key_str = array_key(keys, key++, buffer, &key_size);
+    encode_append_element(output, value, key_str, key_size);
+  }
+
+  bson_set_element_type(output.grow(1), BSON_END, nullptr);
+  bson_set_size(output.at(start), (uint32_t)(output.size() - start), nullptr);
+}
+
+std::vector<char>
+encode(Object const& obj) {
+  // Unchanged documents have their size cached, sizing the result up front saves reallocations
+  std::vector<char> result;
+  result.reserve(encode_len(obj));
+  encode(obj, result);
+  return result;
+}
+
+void
+encode(Object const& obj, std::vector<char>& output) {
+  ContainerOutput<std::vector<char>> container(output);
+  encode_append(container, obj);
+}
+
+void
+encode(Object const& obj, std::string& output) {
+  ContainerOutput<std::string> container(output);
+  encode_append(container, obj);
+}
+
+void
+encode(Object const& obj, bson_buffer_t* output) {
+  BufferOutput buffer(output);
+  encode_append(buffer, obj);
+}
+
+static void
+print_indent(std::ostream& os, size_t indent) {
+  for (size_t i = 0; i < indent; ++i) os << " ";
+}
+
+static void
+print_object(std::ostream& os, Object const& obj, size_t indent, size_t indent_step);
+
+static void
+print_array(std::ostream& os, Array const& array, size_t indent, size_t indent_step);
+
+// Returns false on a type that cannot be printed
+static bool
+print_value(std::ostream& os, Variant const& value, size_t indent, size_t indent_step) {
+  switch (value.getType()) {
+    case BSON_STRING: os << '"' << value.asString() << '"'; break;
+    case BSON_INT32: os << "int32(" << value.asInt32() << ')'; break;
+    case BSON_INT64: os << "int64(" << value.asInt64() << ')'; break;
+    case BSON_DOUBLE: os << "double(" << value.asDouble() << ')'; break;
+    case BSON_BOOLEAN: os << "bool(" << (value.asBoolean() ? "true" : "false") << ')'; break;
+
+    case BSON_BINARY: {
+      Binary const& bin = value.asBinary();
+      os << "binary(size=" << bin.length() << ",subtype=" << bin.getType() << ") <";
+      static const uint32_t line_size = 32;
+      char buffer[4]                  = {0};
+      for (uint32_t i = 0; i < bin.length();) {
+        os << "\n";
+        print_indent(os, indent + indent_step);
+        for (uint32_t len = 0; i < bin.length() && len < line_size; ++len, ++i) {
+          snprintf(buffer, sizeof(buffer), "%02x", bin.get()[i]);
+          os << buffer;
+        }
+      }
+      os << "\n";
+      print_indent(os, indent);
+      os << ">";
+      break;
+    }
+
+    case BSON_OBJECT: print_object(os, value.asObject(), indent, indent_step); break;
+    case BSON_ARRAY: print_array(os, value.asArray(), indent, indent_step); break;
+
+    default: os << "Not handled: " << (int) value.getType() << "\n"; return false;
+  }
+
+  return true;
+}
+
+static void
+print_object(std::ostream& os, Object const& obj, size_t indent, size_t indent_step) {
+  os << "object(size=" << encode_len(obj) << ") {\n";
+
+  for (auto it = obj.begin(); it != obj.end(); ++it) {
+    print_indent(os, indent + indent_step);
+    os << '"' << it->first << "\": ";
+    if (!print_value(os, it->second, indent + indent_step, indent_step)) return;
+    os << (std::next(it) != obj.end() ? ",\n" : "\n");
+  }
+
+  print_indent(os, indent);
+  os << "}";
+}
+
+static void
+print_array(std::ostream& os, Array const& array, size_t indent, size_t indent_step) {
+  os << "array(size=" << encode_len(array) << ") [\n";
+
+  uint32_t key = 0;
+  for (auto it = array.begin(); it != array.end(); ++it) {
+    print_indent(os, indent + indent_step);
+    os << '"' << key++ << "\": ";
+    if (!print_value(os, *it, indent + indent_step, indent_step)) return;
+    os << (std::next(it) != array.end() ? ",\n" : "\n");
+  }
+
+  print_indent(os, indent);
+  os << "]";
 }
 
 void
 print(std::ostream& os, bson::Object const& obj, size_t indent, size_t indent_step) {
-  bson_print_object_or_array(os, obj, indent, indent_step, BSON_OBJECT, true);
+  print_indent(os, indent);
+  print_object(os, obj, indent, indent_step);
+}
+
+} // namespace bson
+
+// WorkerPool
+namespace bson {
+
+static uint64_t
+pool_range(uint32_t begin, uint32_t end) {
+  return (uint64_t) end << 32 | begin;
+}
+
+struct WorkerPool::Impl {
+  Impl(void)
+      : generation(0)
+      , running(0)
+      , stop(false)
+      , task(nullptr)
+      , base(0)
+      , failed(false) {}
+
+  struct Worker {
+    // Remaining items, begin in the low half and end in the high half
+    std::atomic<uint64_t> range;
+    Arena arena;
+    std::thread thread;
+  };
+
+  void
+  main(size_t worker);
+
+  void
+  work(size_t worker);
+
+  bool
+  steal(size_t worker);
+
+  std::vector<std::unique_ptr<Worker>> workers;
+  std::mutex mutex;
+  std::condition_variable start;
+  std::condition_variable done;
+  uint64_t generation;
+  size_t running;
+  bool stop;
+  std::function<void(size_t, size_t)> const* task;
+  size_t base;
+  std::atomic<bool> failed;
+  std::exception_ptr error;
+};
+
+WorkerPool::WorkerPool(size_t threads)
+    : _impl(new Impl()) {
+  if (!threads) threads = std::max(std::thread::hardware_concurrency(), 1u);
+
+  std::vector<std::unique_ptr<Impl::Worker>>& workers = _impl->workers;
+  workers.reserve(threads);
+  for (size_t i = 0; i < threads; ++i) {
+    workers.push_back(std::unique_ptr<Impl::Worker>(new Impl::Worker()));
+    workers.back()->range.store(0, std::memory_order_relaxed);
+  }
+  // Started once every worker exists, as they steal from each other
+  for (size_t i = 0; i < threads; ++i) {
+    workers[i]->thread = std::thread(&Impl::main, _impl.get(), i);
+  }
+}
+
+WorkerPool::~WorkerPool(void) {
+  {
+    std::lock_guard<std::mutex> lock(_impl->mutex);
+    _impl->stop = true;
+  }
+  _impl->start.notify_all();
+  for (std::unique_ptr<Impl::Worker>& worker : _impl->workers) worker->thread.join();
+}
+
+size_t
+WorkerPool::size(void) const {
+  return _impl->workers.size();
+}
+
+Arena&
+WorkerPool::arena(size_t worker) {
+  return _impl->workers[worker]->arena;
+}
+
+void
+WorkerPool::reset(void) {
+  for (std::unique_ptr<Impl::Worker>& worker : _impl->workers) worker->arena.reset();
+}
+
+void
+WorkerPool::run(size_t count, std::function<void(size_t item, size_t worker)> const& task) {
+  Impl& impl = *_impl;
+
+  // Ranges hold 32 bits indices: larger batches are run in several rounds
+  size_t const round = UINT32_MAX;
+  for (size_t base = 0; base < count; base += round) {
+    size_t items = std::min(count - base, round);
+    size_t size  = impl.workers.size();
+    for (size_t i = 0; i < size; ++i) {
+      uint32_t begin = (uint32_t)(items * i / size);
+      uint32_t end   = (uint32_t)(items * (i + 1) / size);
+      impl.workers[i]->range.store(pool_range(begin, end), std::memory_order_relaxed);
+    }
+
+    {
+      std::unique_lock<std::mutex> lock(impl.mutex);
+      impl.task    = &task;
+      impl.base    = base;
+      impl.running = size;
+      ++impl.generation;
+      impl.start.notify_all();
+      impl.done.wait(lock, [&impl] { return !impl.running; });
+    }
+
+    if (impl.failed.load(std::memory_order_relaxed)) {
+      std::exception_ptr error = impl.error;
+      impl.error               = nullptr;
+      impl.failed.store(false, std::memory_order_relaxed);
+      std::rethrow_exception(error);
+    }
+  }
+}
+
+void
+WorkerPool::Impl::main(size_t worker) {
+  uint64_t seen = 0;
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      start.wait(lock, [&] { return stop || generation != seen; });
+      if (stop) return;
+      seen = generation;
+    }
+
+    try {
+      work(worker);
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!failed.exchange(true, std::memory_order_relaxed)) error = std::current_exception();
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!--running) done.notify_one();
+  }
+}
+
+void
+WorkerPool::Impl::work(size_t worker) {
+  std::atomic<uint64_t>& range = workers[worker]->range;
+  do {
+    uint64_t bounds = range.load(std::memory_order_relaxed);
+    while (!failed.load(std::memory_order_relaxed)) {
+      uint32_t begin = (uint32_t) bounds;
+      uint32_t end   = (uint32_t)(bounds >> 32);
+      if (begin >= end) break;
+
+      // Large chunks first, smaller ones as the range shrinks and may be stolen from
+      uint32_t next = begin + 1 + (end - begin) / 32;
+      if (!range.compare_exchange_weak(bounds, pool_range(next, end), std::memory_order_relaxed))
+        continue;
+
+      for (uint32_t item = begin; item < next; ++item) (*task)(base + item, worker);
+      bounds = range.load(std::memory_order_relaxed);
+    }
+  } while (!failed.load(std::memory_order_relaxed) && steal(worker));
+}
+
+// Moves the upper half of another worker's range into the empty one of worker
+bool
+WorkerPool::Impl::steal(size_t worker) {
+  size_t size = workers.size();
+  for (size_t i = 1; i < size; ++i) {
+    std::atomic<uint64_t>& victim = workers[(worker + i) % size]->range;
+
+    uint64_t bounds = victim.load(std::memory_order_relaxed);
+    for (;;) {
+      uint32_t begin = (uint32_t) bounds;
+      uint32_t end   = (uint32_t)(bounds >> 32);
+      if (begin >= end) break;
+
+      uint32_t middle = begin + (end - begin) / 2;
+      uint64_t left   = pool_range(begin, middle);
+      if (!victim.compare_exchange_weak(bounds, left, std::memory_order_relaxed)) continue;
+
+      // Nobody takes from an empty range, so it can be overwritten
+      workers[worker]->range.store(pool_range(middle, end), std::memory_order_relaxed);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void
+decode_batch(
+    char const* const* documents,
+    size_t count,
+    WorkerPool& pool,
+    std::vector<Object>& results) {
+  // Destroyed before the arenas they may point into are reset
+  results.clear();
+  pool.reset();
+
+  results.resize(count);
+  pool.run(count, [&](size_t item, size_t worker) {
+    results[item] = decode(documents[item], pool.arena(worker));
+  });
+}
+
+bson_reader_status_t
+decode_batch(char const* data, size_t size, WorkerPool& pool, std::vector<Object>& results) {
+  bson_reader_t reader;
+  bson_reader_init_buffer(&reader, data, size);
+
+  std::vector<char const*> documents;
+  bson_reader_status_t status;
+  char const* doc;
+  while ((doc = bson_reader_next(&reader, &status))) documents.push_back(doc);
+  bson_reader_destroy(&reader);
+
+  if (status != BSON_READER_EOF) {
+    results.clear();
+    return status;
+  }
+
+  decode_batch(documents.data(), documents.size(), pool, results);
+  return status;
+}
+
+// Documents of one range are found by hopping from its first one
+struct ScanRange {
+  char const* begin;
+  size_t index;
+  size_t count;
+};
+
+// First phase, the reader keeping its documents in memory
+static bson_reader_status_t
+scan_ranges(bson_reader_t* reader, size_t range_size, std::vector<ScanRange>& ranges) {
+  bson_reader_status_t status;
+  char const* doc;
+  size_t index = 0;
+  while ((doc = bson_reader_next(reader, &status))) {
+    ScanRange* range = ranges.empty() ? nullptr : &ranges.back();
+    if (!range || (size_t)(doc - range->begin) >= range_size) {
+      ranges.push_back(ScanRange{doc, index, 0});
+      range = &ranges.back();
+    }
+    ++range->count;
+    ++index;
+  }
+
+  return status;
+}
+
+// Second phase
+static void
+scan_run(
+    std::vector<ScanRange> const& ranges,
+    size_t base,
+    WorkerPool& pool,
+    ScanCallback const& callback) {
+  pool.run(ranges.size(), [&](size_t item, size_t worker) {
+    ScanRange const& range = ranges[item];
+    char const* doc        = range.begin;
+    for (size_t i = 0; i < range.count; ++i) {
+      callback(doc, base + range.index + i, worker);
+      doc += bson_get_size(doc, nullptr);
+    }
+  });
+}
+
+// Destroys the reader however the scan ends
+struct ScanReader {
+  bson_reader_t reader;
+
+  inline ~ScanReader(void) {
+    bson_reader_destroy(&reader);
+  }
+};
+
+bson_reader_status_t
+scan(
+    char const* data,
+    size_t size,
+    WorkerPool& pool,
+    ScanCallback const& callback,
+    size_t range_size) {
+  ScanReader reader;
+  bson_reader_init_buffer(&reader.reader, data, size);
+
+  std::vector<ScanRange> ranges;
+  bson_reader_status_t status = scan_ranges(&reader.reader, range_size, ranges);
+  scan_run(ranges, 0, pool, callback);
+  return status;
+}
+
+bson_reader_status_t
+scan_file(char const* filepath, WorkerPool& pool, ScanCallback const& callback, size_t range_size) {
+  ScanReader reader;
+  if (bson_reader_init_mmap(&reader.reader, filepath) == BSON_READER_OK) {
+    std::vector<ScanRange> ranges;
+    bson_reader_status_t status = scan_ranges(&reader.reader, range_size, ranges);
+    scan_run(ranges, 0, pool, callback);
+    return status;
+  }
+
+  // Not mappable (pipe, special file...): stream it instead
+  FILE* file = fopen(filepath, "rb");
+  if (!file) return BSON_READER_ERROR_READ;
+
+  bson_reader_init_file(&reader.reader, file, nullptr, 0);
+  bson_reader_status_t status;
+  try {
+    status = scan(&reader.reader, pool, callback);
+  } catch (...) {
+    fclose(file);
+    throw;
+  }
+  fclose(file);
+  return status;
+}
+
+bson_reader_status_t
+scan(bson_reader_t* reader, WorkerPool& pool, ScanCallback const& callback, size_t chunk_size) {
+  std::vector<char> chunk;
+  std::vector<ScanRange> ranges;
+  size_t base = 0;
+
+  bson_reader_status_t status = BSON_READER_OK;
+  while (status == BSON_READER_OK) {
+    // The chunk only grows past chunk_size for a document larger than it
+    chunk.clear();
+    size_t count = 0;
+    char const* doc;
+    while (chunk.size() < chunk_size && (doc = bson_reader_next(reader, &status))) {
+      chunk.insert(chunk.end(), doc, doc + bson_get_size(doc, nullptr));
+      ++count;
+    }
+    if (!count) break;
+
+    // Pointers into the chunk are only taken once it is complete
+    ranges.clear();
+    bson_reader_t chunk_reader;
+    bson_reader_init_buffer(&chunk_reader, chunk.data(), chunk.size());
+    scan_ranges(&chunk_reader, BSON_SCAN_RANGE_SIZE, ranges);
+    bson_reader_destroy(&chunk_reader);
+
+    scan_run(ranges, base, pool, callback);
+    base += count;
+  }
+
+  return status;
+}
+
+} // namespace bson
+
+// JSON
+namespace bson {
+
+JsonWriter::JsonWriter(bson_json_mode_t mode)
+    : _mode(mode) {
+  bson_buffer_init(&_buffer, nullptr, 0);
+}
+
+JsonWriter::~JsonWriter(void) { bson_buffer_destroy(&_buffer); }
+
+bool
+JsonWriter::write(char const* obj) {
+  return bson_to_json(&_buffer, obj, _mode);
+}
+
+JsonParser::JsonParser(void)
+    : _error_offset(0) {
+  bson_json_parser_init(&_parser);
+  bson_buffer_init(&_buffer, nullptr, 0);
+}
+
+JsonParser::~JsonParser(void) {
+  bson_json_parser_destroy(&_parser);
+  bson_buffer_destroy(&_buffer);
+}
+
+bson_json_status_t
+JsonParser::parse(char const* json, size_t size) {
+  bson_buffer_clear(&_buffer);
+  return bson_json_parse(&_parser, &_buffer, json, size, &_error_offset);
+}
+
+std::string
+to_json(char const* obj, bson_json_mode_t mode) {
+  JsonWriter writer(mode);
+  if (!writer.write(obj)) return std::string();
+  return writer.str();
+}
+
+std::string
+to_json(Object const& obj, bson_json_mode_t mode) {
+  return to_json(encode(obj).data(), mode);
 }
 
 } // namespace bson
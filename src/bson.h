@@ -21,6 +21,7 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -49,6 +50,8 @@ typedef enum {
   BSON_TIMESTAMP         = 0x11,
   BSON_INT64             = 0x12,
   BSON_DECI128           = 0x13,
+  BSON_MAXKEY            = 0x7f,
+  BSON_MINKEY            = 0xff,
 } bson_element_t;
 
 typedef enum {
@@ -61,6 +64,19 @@ typedef enum {
   BSON_BINARY_USER_DEFINED = 0x80,
 } bson_binary_t;
 
+typedef enum {
+  BSON_VALIDATE_NONE = 0x00,
+  BSON_VALIDATE_UTF8 = 0x01, // Also check strings and keys are valid UTF-8
+} bson_validate_flags_t;
+
+#define BSON_VALIDATE_MAX_DEPTH 100
+
+// Checks sizes, terminators, nesting and type codes of the size bytes at obj in a single pass.
+// On failure returns false and sets error_offset to the offset of the first invalid byte.
+// Once a buffer is validated, every bson_get_* accessor can be used on it safely.
+bool
+bson_validate(char const* obj, size_t size, uint32_t flags, size_t* error_offset);
+
 uint32_t
 bson_get_size(char const* obj, char const** next);
 
@@ -95,6 +111,81 @@ bson_get_element_value_bool(char const* elem, char const** next);
 uint32_t
 bson_get_element_count(char const* object);
 
+// Pulls a set of top-level fields out of documents in a single scan. The field names are hashed
+// with a perfect hash, so each element of the document costs one hash and at most one compare.
+// Names point into the caller strings, which must outlive the projection.
+
+#ifndef BSON_PROJECTION_MAX_FIELDS
+# define BSON_PROJECTION_MAX_FIELDS 64
+#endif
+
+#define BSON_PROJECTION_MAX_TABLE (8 * BSON_PROJECTION_MAX_FIELDS)
+
+typedef struct {
+  char const* names[BSON_PROJECTION_MAX_FIELDS];
+  uint32_t sizes[BSON_PROJECTION_MAX_FIELDS];
+  uint32_t count;
+  uint32_t seed;
+  uint32_t mask;
+  uint8_t table[BSON_PROJECTION_MAX_TABLE]; // Field index + 1, 0 for an empty bucket
+} bson_projection_t;
+
+typedef struct {
+  char const* elem;  // NULL when the field is missing
+  char const* value;
+  bson_element_t type;
+} bson_projection_slot_t;
+
+// Returns false on duplicate names or more than BSON_PROJECTION_MAX_FIELDS of them
+bool
+bson_projection_compile(bson_projection_t* projection, char const* const* names, uint32_t count);
+
+// Fills one slot per field, in the order of the names, and returns the number of fields found.
+// The scan stops as soon as every field is found.
+uint32_t
+bson_projection_extract(
+    bson_projection_t const* projection,
+    char const* obj,
+    bson_projection_slot_t* slots);
+
+// Offset side-table of one document, built in one pass over a caller buffer, giving O(1) access
+// to its elements by position and, optionally, by key.
+
+typedef enum {
+  BSON_INDEX_POSITIONS = 0x00, // Element offsets only, enough for arrays
+  BSON_INDEX_KEYS      = 0x01, // Also a hash table of the element names
+} bson_index_flags_t;
+
+typedef struct {
+  char const* obj;
+  uint32_t const* offsets; // From obj, one per element in document order
+  uint32_t count;
+  uint32_t const* buckets; // Element position + 1, 0 for an empty bucket
+  uint32_t mask;
+} bson_index_t;
+
+// Bytes of storage needed to index obj with these flags
+size_t
+bson_index_storage_size(char const* obj, uint32_t flags);
+
+// storage must be aligned for uint32_t, returns false when it is too small.
+// obj and storage must outlive the index.
+bool
+bson_index_build(
+    bson_index_t* index,
+    char const* obj,
+    uint32_t flags,
+    void* storage,
+    size_t storage_size);
+
+// Element at position, NULL past the end
+char const*
+bson_index_at(bson_index_t const* index, uint32_t position);
+
+// First element named key, NULL when there is none. Without BSON_INDEX_KEYS the names are scanned.
+char const*
+bson_index_find(bson_index_t const* index, char const* key);
+
 void
 bson_print(char const* obj, size_t indent, size_t indent_step);
 
@@ -114,6 +205,202 @@ bson_fnprint(
     size_t indent,
     size_t indent_step);
 
+// Buffered output: formatted text is batched and handed to the write callback in large chunks.
+// bson_sink_callback can be given to bson_fnprint with the sink as callback data.
+
+#ifndef BSON_PRINT_BUFFER_SIZE
+# define BSON_PRINT_BUFFER_SIZE 4096
+#endif
+
+#ifndef BSON_SINK_STDOUT_BUFFER_SIZE
+# define BSON_SINK_STDOUT_BUFFER_SIZE (64 * 1024)
+#endif
+
+// Returns the number of bytes written or a negative value on error
+typedef ptrdiff_t (*bson_sink_write_callback_t)(void* data, void const* buffer, size_t size);
+
+typedef struct {
+  bson_sink_write_callback_t write;
+  void* write_data;
+  int fd;
+  char* buffer;
+  size_t size;
+  size_t used;
+  bool error;
+} bson_sink_t;
+
+void
+bson_sink_init(
+    bson_sink_t* sink,
+    bson_sink_write_callback_t write,
+    void* write_data,
+    char* buffer,
+    size_t buffer_size);
+
+void
+bson_sink_init_fd(bson_sink_t* sink, int fd, char* buffer, size_t buffer_size);
+
+// Sink to the standard output over a static buffer: only one may be in use at a time
+void
+bson_sink_init_stdout(bson_sink_t* sink);
+
+int
+bson_sink_callback(void* sink, char const* format, ...);
+
+// Returns false if any write failed since the sink was initialized
+bool
+bson_sink_flush(bson_sink_t* sink);
+
+// Growable byte buffer. It starts on the caller storage, if any, and moves to the heap when
+// that storage is too small. Contents are always followed by a NUL byte not counted in size.
+
+typedef struct {
+  char* data;
+  size_t size;
+  size_t capacity;
+  bool owns_data;
+} bson_buffer_t;
+
+void
+bson_buffer_init(bson_buffer_t* buffer, char* data, size_t capacity);
+
+// Makes room for size more bytes, returns false if memory is exhausted
+bool
+bson_buffer_reserve(bson_buffer_t* buffer, size_t size);
+
+bool
+bson_buffer_append(bson_buffer_t* buffer, void const* data, size_t size);
+
+// Empties the buffer but keeps its storage for reuse
+void
+bson_buffer_clear(bson_buffer_t* buffer);
+
+void
+bson_buffer_destroy(bson_buffer_t* buffer);
+
+typedef enum {
+  BSON_JSON_RELAXED,   // Numbers and dates as plain JSON where it does not lose information
+  BSON_JSON_CANONICAL, // Every value keeps its exact BSON type
+} bson_json_mode_t;
+
+// Appends obj to output as MongoDB Extended JSON v2, returns false on memory exhaustion
+bool
+bson_to_json(bson_buffer_t* output, char const* obj, bson_json_mode_t mode);
+
+typedef enum {
+  BSON_JSON_OK,
+  BSON_JSON_ERROR_SYNTAX, // Invalid JSON, or malformed Extended JSON wrapper
+  BSON_JSON_ERROR_DEPTH,  // Nested deeper than BSON_VALIDATE_MAX_DEPTH
+  BSON_JSON_ERROR_MEMORY,
+} bson_json_status_t;
+
+// Token index built by the parser, kept from one document to the next
+typedef struct {
+  uint32_t* index;
+  size_t capacity;
+} bson_json_parser_t;
+
+void
+bson_json_parser_init(bson_json_parser_t* parser);
+
+void
+bson_json_parser_destroy(bson_json_parser_t* parser);
+
+// Appends the BSON document of the JSON object in json to output. Extended JSON v2 wrappers such
+// as {"$oid": ...} or {"$numberLong": ...} produce their own BSON type. On failure output is left
+// as it was and error_offset is set to the offset of the offending character in json.
+bson_json_status_t
+bson_json_parse(
+    bson_json_parser_t* parser,
+    bson_buffer_t* output,
+    char const* json,
+    size_t size,
+    size_t* error_offset);
+
+// bson_json_parse with a parser of its own
+bson_json_status_t
+bson_from_json(bson_buffer_t* output, char const* json, size_t size, size_t* error_offset);
+
+// Streaming document writer into a growable buffer. The size of every open document is reserved
+// and written when it is closed, so a whole document is built in one pass. Appends return false
+// once any of them failed, on memory exhaustion, too deep nesting or unbalanced calls.
+// Inside an array, names are ignored and may be NULL: keys "0", "1"... are written instead.
+
+typedef struct {
+  uint32_t offset; // Of the size prefix in the buffer
+  uint32_t count;  // Elements so far, also the next key of an array
+  bool is_array;
+} bson_builder_frame_t;
+
+typedef struct {
+  bson_buffer_t buffer;
+  bson_builder_frame_t frames[BSON_VALIDATE_MAX_DEPTH];
+  uint32_t depth;
+  bool error;
+} bson_builder_t;
+
+// Starts the root document, see bson_buffer_init for data and capacity
+void
+bson_builder_init(bson_builder_t* builder, char* data, size_t capacity);
+
+// Starts a new root document, keeping the storage of the previous one
+void
+bson_builder_reset(bson_builder_t* builder);
+
+void
+bson_builder_destroy(bson_builder_t* builder);
+
+bool
+bson_builder_append_double(bson_builder_t* builder, char const* name, double value);
+
+bool
+bson_builder_append_utf8(
+    bson_builder_t* builder,
+    char const* name,
+    char const* str,
+    uint32_t size);
+
+bool
+bson_builder_append_binary(
+    bson_builder_t* builder,
+    char const* name,
+    void const* binary,
+    uint32_t size,
+    bson_binary_t subtype);
+
+bool
+bson_builder_append_bool(bson_builder_t* builder, char const* name, bool value);
+
+bool
+bson_builder_append_null(bson_builder_t* builder, char const* name);
+
+bool
+bson_builder_append_int32(bson_builder_t* builder, char const* name, int32_t value);
+
+bool
+bson_builder_append_int64(bson_builder_t* builder, char const* name, int64_t value);
+
+// Copies the encoded document obj as a subdocument
+bool
+bson_builder_append_document(bson_builder_t* builder, char const* name, char const* obj);
+
+bool
+bson_builder_begin_document(bson_builder_t* builder, char const* name);
+
+bool
+bson_builder_end_document(bson_builder_t* builder);
+
+bool
+bson_builder_begin_array(bson_builder_t* builder, char const* name);
+
+bool
+bson_builder_end_array(bson_builder_t* builder);
+
+// Closes the root document and returns it, NULL on error or while subdocuments are still open.
+// The document stays valid until the builder is reset or destroyed.
+char const*
+bson_builder_finish(bson_builder_t* builder, size_t* size);
+
 void
 bson_set_size(char* obj, uint32_t size, char** next);
 
@@ -146,9 +433,220 @@ bson_set_element_value_int64(char* elem, int64_t value, char** next);
 void
 bson_set_element_value_bool(char* elem, bool value, char** next);
 
+// next receives the element after elem, elem itself on BSON_END and NULL on an unknown type
 void
 bson_next(char const* elem, char const** next);
 
+// Dotted path such as "a.b.3.c", split once and reused for any number of lookups.
+// Segments point into the path string, which must outlive the compiled path.
+
+#ifndef BSON_PATH_MAX_SEGMENTS
+# define BSON_PATH_MAX_SEGMENTS 32
+#endif
+
+typedef struct {
+  char const* name;
+  uint32_t size;
+} bson_path_segment_t;
+
+typedef struct {
+  bson_path_segment_t segments[BSON_PATH_MAX_SEGMENTS];
+  uint32_t count;
+} bson_path_t;
+
+// Returns false on an empty path or segment, or on more than BSON_PATH_MAX_SEGMENTS segments
+bool
+bson_path_compile(bson_path_t* path, char const* str, size_t size);
+
+// Value of the element at path in obj, NULL when there is none. Subdocuments not on the path are
+// skipped through their size prefix. type and elem, when not NULL, receive the element type and
+// the element itself.
+char const*
+bson_find_path(char const* obj, bson_path_t const* path, bson_element_t* type, char const** elem);
+
+// Edits of an encoded document in place. Fixed-width values are overwritten, other changes move
+// the rest of the buffer and fix the size of every document enclosing the change.
+
+// Overwrites the value at path, returns false when there is none or it has another type
+bool
+bson_update_double(char* obj, bson_path_t const* path, double value);
+
+bool
+bson_update_int32(char* obj, bson_path_t const* path, int32_t value);
+
+bool
+bson_update_int64(char* obj, bson_path_t const* path, int64_t value);
+
+bool
+bson_update_bool(char* obj, bson_path_t const* path, bool value);
+
+// The document is at the start of buffer, value is the encoded value of an element of type type,
+// as it follows the element name. On failure the document is left unchanged: the path is not
+// found, or already exists for bson_insert, a document would outgrow INT32_MAX bytes or memory
+// is exhausted.
+
+// Replaces the type and value of the element at path, keeping its name and position
+bool
+bson_replace(
+    bson_buffer_t* buffer,
+    bson_path_t const* path,
+    bson_element_t type,
+    void const* value,
+    size_t value_size);
+
+// Appends an element named after the last segment of path to the document at the other segments
+bool
+bson_insert(
+    bson_buffer_t* buffer,
+    bson_path_t const* path,
+    bson_element_t type,
+    void const* value,
+    size_t value_size);
+
+bool
+bson_remove(bson_buffer_t* buffer, bson_path_t const* path);
+
+// Reads concatenated documents from a stream through one reusable buffer.
+// The pointer returned by bson_reader_next is valid until the next call.
+
+#define BSON_READER_DEFAULT_SIZE (64 * 1024)
+
+// Read-ahead window requested from the kernel ahead of a memory-mapped reader
+#define BSON_READER_MMAP_WINDOW (4 * 1024 * 1024)
+
+typedef enum {
+  BSON_READER_OK,
+  BSON_READER_EOF,
+  BSON_READER_ERROR_READ,      // The read callback failed
+  BSON_READER_ERROR_TRUNCATED, // The stream ends in the middle of a document
+  BSON_READER_ERROR_SIZE,      // Invalid document size or larger than a fixed buffer
+  BSON_READER_ERROR_MEMORY,
+} bson_reader_status_t;
+
+// Returns the number of bytes read, 0 at end of stream or a negative value on error
+typedef ptrdiff_t (*bson_reader_read_callback_t)(void* data, void* buffer, size_t size);
+
+typedef struct {
+  bson_reader_read_callback_t read;
+  void* read_data;
+  int fd;
+  char* buffer;
+  size_t capacity;
+  size_t begin;
+  size_t end;
+  size_t advised;
+  bool owns_buffer;
+  bool mapped;
+  bool eof;
+} bson_reader_t;
+
+// When buffer is NULL, the reader allocates and grows its own buffer as documents need it
+void
+bson_reader_init(
+    bson_reader_t* reader,
+    bson_reader_read_callback_t read,
+    void* read_data,
+    char* buffer,
+    size_t buffer_size);
+
+void
+bson_reader_init_fd(bson_reader_t* reader, int fd, char* buffer, size_t buffer_size);
+
+void
+bson_reader_init_file(bson_reader_t* reader, FILE* file, char* buffer, size_t buffer_size);
+
+// Iterates over documents already in memory, returning pointers into data
+void
+bson_reader_init_buffer(bson_reader_t* reader, char const* data, size_t size);
+
+// Maps the whole file read-only and iterates over it without copying
+bson_reader_status_t
+bson_reader_init_mmap(bson_reader_t* reader, char const* filepath);
+
+char const*
+bson_reader_next(bson_reader_t* reader, bson_reader_status_t* status);
+
+void
+bson_reader_destroy(bson_reader_t* reader);
+
+// Sidecar index of a multi-document archive, stored next to it as <archive>.bsonidx.
+// It holds the offset of every document and, for a few paths, the documents sorted by their
+// integer value or by the hash of their string value, so that readers reach any document or
+// key value in O(log n) without scanning the archive. Integers are stored little-endian.
+
+#define BSON_ARCHIVE_INDEX_SUFFIX ".bsonidx"
+
+#ifndef BSON_ARCHIVE_MAX_KEYS
+# define BSON_ARCHIVE_MAX_KEYS 8
+#endif
+
+typedef enum {
+  BSON_ARCHIVE_OK,
+  BSON_ARCHIVE_ERROR_READ,    // The archive or the index cannot be read
+  BSON_ARCHIVE_ERROR_WRITE,   // The index cannot be written
+  BSON_ARCHIVE_ERROR_INVALID, // Truncated archive or document with an invalid size
+  BSON_ARCHIVE_ERROR_INDEX,   // Not an index, or an index of another version
+  BSON_ARCHIVE_ERROR_STALE,   // The archive changed since its index was built
+  BSON_ARCHIVE_ERROR_KEY,     // Invalid path or more than BSON_ARCHIVE_MAX_KEYS
+  BSON_ARCHIVE_ERROR_MEMORY,
+} bson_archive_status_t;
+
+// Scans the archive once and writes its index to index_path, or next to the archive when NULL.
+// keys are dotted paths, see bson_path_compile. Documents where a path leads to an int32, int64
+// or date value are indexed by that value, those where it leads to a string by its hash.
+bson_archive_status_t
+bson_archive_index(
+    char const* archive_path,
+    char const* index_path,
+    char const* const* keys,
+    uint32_t key_count);
+
+typedef struct {
+  char const* name; // Not NUL terminated, points into the index
+  uint32_t size;
+  bson_path_t path;
+  uint64_t integer_count;
+  char const* integers; // (value, position) pairs sorted by value then position
+  uint64_t string_count;
+  char const* strings; // (hash, position) pairs sorted by hash then position
+} bson_archive_key_t;
+
+typedef struct {
+  char* data;
+  size_t size;
+  char* index;
+  size_t index_size;
+  uint64_t count;
+  char const* offsets;
+  bson_archive_key_t keys[BSON_ARCHIVE_MAX_KEYS];
+  uint32_t key_count;
+} bson_archive_t;
+
+// Maps the archive and its index, index_path being NULL for the one next to the archive
+bson_archive_status_t
+bson_archive_open(bson_archive_t* archive, char const* archive_path, char const* index_path);
+
+void
+bson_archive_close(bson_archive_t* archive);
+
+// Document at position, NULL past the end
+char const*
+bson_archive_get(bson_archive_t const* archive, uint64_t position);
+
+// Position of the document with the smallest integer value at key not less than value, the
+// first one in the archive on a tie. archive->count when there is none or key is not indexed.
+uint64_t
+bson_archive_seek_int64(bson_archive_t const* archive, char const* key, int64_t value);
+
+// Position of the first document whose value at key is the string of size bytes at str,
+// archive->count when there is none or key is not indexed
+uint64_t
+bson_archive_find_utf8(
+    bson_archive_t const* archive,
+    char const* key,
+    char const* str,
+    uint32_t size);
+
 #ifdef __cplusplus
 }
 #endif
@@ -23,11 +23,19 @@
 
 #pragma once
 
+#include <cassert>
+#include <cstddef>
 #include <cstring>
 
+#include <atomic>
+#include <functional>
+#include <iterator>
 #include <map>
+#include <memory>
+#include <new>
 #include <ostream>
 #include <string>
+#include <type_traits>
 #include <vector>
 
 #include <bson.h>
@@ -36,8 +44,112 @@ namespace bson {
 
 class Variant;
 
+// Monotonic allocator: memory is carved out of large blocks and only given back
+// all at once by reset() or by the destructor.
+// Everything allocated from an arena must be destroyed before the arena is reset.
+class Arena {
+ public:
+  explicit Arena(size_t block_size = 4096);
+
+  Arena(Arena const& rhs) = delete;
+
+  Arena&
+  operator=(Arena const& rhs) = delete;
+
+  ~Arena(void);
+
+  void*
+  allocate(size_t size, size_t alignment);
+
+  // Drops every allocation but keeps one block large enough for the same workload
+  void
+  reset(void);
+
+  inline size_t
+  used(void) const {
+    return _used;
+  }
+
+ private:
+  struct Block {
+    Block* next;
+    size_t size;
+  };
+
+  void
+  _grow(size_t size);
+
+  void
+  _release(void);
+
+  size_t _block_size;
+  size_t _used;
+  Block* _blocks;
+  char* _cursor;
+  char* _limit;
+};
+
+// Standard allocator over an optional Arena, falling back on the global heap.
+// Copies of a container always go back to the heap, so they outlive the arena.
+template<typename T>
+class ArenaAllocator {
+ public:
+  typedef T value_type;
+  typedef std::false_type propagate_on_container_copy_assignment;
+  typedef std::true_type propagate_on_container_move_assignment;
+  typedef std::true_type propagate_on_container_swap;
+
+  inline ArenaAllocator(void) noexcept
+      : _arena(nullptr) {}
+
+  explicit inline ArenaAllocator(Arena* arena) noexcept
+      : _arena(arena) {}
+
+  template<typename U>
+  inline ArenaAllocator(ArenaAllocator<U> const& rhs) noexcept
+      : _arena(rhs.arena()) {}
+
+  inline T*
+  allocate(std::size_t n) {
+    if (_arena) return static_cast<T*>(_arena->allocate(n * sizeof(T), alignof(T)));
+    return static_cast<T*>(::operator new(n * sizeof(T)));
+  }
+
+  inline void
+  deallocate(T* ptr, std::size_t) noexcept {
+    if (!_arena) ::operator delete(ptr);
+  }
+
+  inline ArenaAllocator
+  select_on_container_copy_construction(void) const {
+    return ArenaAllocator();
+  }
+
+  inline Arena*
+  arena(void) const {
+    return _arena;
+  }
+
+ private:
+  Arena* _arena;
+};
+
+template<typename T, typename U>
+inline bool
+operator==(ArenaAllocator<T> const& lhs, ArenaAllocator<U> const& rhs) {
+  return lhs.arena() == rhs.arena();
+}
+
+template<typename T, typename U>
+inline bool
+operator!=(ArenaAllocator<T> const& lhs, ArenaAllocator<U> const& rhs) {
+  return lhs.arena() != rhs.arena();
+}
+
 class Binary {
  public:
+  typedef std::vector<uint8_t, ArenaAllocator<uint8_t>> buffer;
+
   explicit inline Binary(void)
       : _type(BSON_BINARY_BINARY)
       , _value() {}
@@ -46,17 +158,30 @@ class Binary {
       : _type(type)
       , _value() {}
 
+  inline Binary(bson_binary_t type, Arena& arena)
+      : _type(type)
+      , _value(ArenaAllocator<uint8_t>(&arena)) {}
+
+  Binary(Binary const& rhs) = default;
+  Binary(Binary&& rhs) noexcept = default;
+
+  Binary&
+  operator=(Binary const& rhs) = default;
+
+  Binary&
+  operator=(Binary&& rhs) noexcept = default;
+
   inline bson_binary_t
   getType(void) const {
     return _type;
   }
 
-  inline std::vector<uint8_t> const&
+  inline buffer const&
   get(void) const {
     return _value;
   }
 
-  inline std::vector<uint8_t>&
+  inline buffer&
   get(void) {
     return _value;
   }
@@ -64,7 +189,12 @@ class Binary {
   template<typename _Iterator>
   inline void
   set(_Iterator beg, _Iterator end) {
-    _value = std::vector<uint8_t>(beg, end);
+    _value.assign(beg, end);
+  }
+
+  inline void
+  set(buffer&& value) {
+    _value = std::move(value);
   }
 
   inline std::size_t
@@ -74,11 +204,80 @@ class Binary {
 
  private:
   bson_binary_t _type;
-  std::vector<uint8_t> _value;
+  buffer _value;
+};
+
+// Encoded size of a document, 0 until computed. Atomic so that a const document can be sized
+// from several threads at once.
+class EncodedSize {
+ public:
+  inline EncodedSize(void) noexcept
+      : _size(0)
+      , _parent(nullptr) {}
+
+  // Copies are not linked to the size of any enclosing document
+  inline EncodedSize(EncodedSize const& rhs) noexcept
+      : _size(rhs.get())
+      , _parent(nullptr) {}
+
+  // The moved from document is empty
+  inline EncodedSize(EncodedSize&& rhs) noexcept
+      : _size(rhs.get())
+      , _parent(nullptr) {
+    rhs.reset();
+  }
+
+  inline EncodedSize&
+  operator=(EncodedSize const& rhs) noexcept {
+    reset();
+    set(rhs.get());
+    return *this;
+  }
+
+  inline EncodedSize&
+  operator=(EncodedSize&& rhs) noexcept {
+    reset();
+    set(rhs.get());
+    rhs.reset();
+    return *this;
+  }
+
+  inline uint32_t
+  get(void) const {
+    return _size.load(std::memory_order_relaxed);
+  }
+
+  inline void
+  set(uint32_t size) const {
+    _size.store(size, std::memory_order_relaxed);
+  }
+
+  // Drops this size and the ones of the enclosing documents. A document is only sized once its
+  // nested documents are, so the walk stops at the first size already dropped.
+  inline void
+  reset(void) const {
+    for (EncodedSize const* it = this; it && it->get(); it = it->_parent) it->set(0);
+  }
+
+  inline void
+  setParent(EncodedSize const* parent) noexcept {
+    _parent = parent;
+  }
+
+ private:
+  mutable std::atomic<uint32_t> _size;
+  EncodedSize const* _parent;
 };
 
+// The encoded size is cached by encode_len. Any write drops it, including writes through a
+// reference to an element or to a nested document, as every element is linked to the size of the
+// document holding it. Binaries are written through their buffer: ask for a Binary& again to
+// write into it once the size is computed.
 class Object {
-  typedef std::vector<std::pair<std::string const, Variant>> data;
+  // Keys are not const so that elements are moved, not copied, when the vector grows.
+  // They must not be modified through an iterator.
+  typedef std::pair<std::string, Variant> element;
+  typedef std::vector<element, ArenaAllocator<element>> data;
 
  public:
   typedef data::iterator iterator;
@@ -86,6 +285,19 @@ class Object {
 
   Object(void);
 
+  // Elements storage and hash index are allocated from the arena. Keys are std::string: those
+  // too long for its inline buffer still go to the heap.
+  explicit Object(Arena& arena);
+
+  Object(Object const& rhs);
+  Object(Object&& rhs) noexcept;
+
+  Object&
+  operator=(Object const& rhs);
+
+  Object&
+  operator=(Object&& rhs) noexcept;
+
   Variant&
   operator[](std::string const& key);
 
@@ -100,6 +312,7 @@ class Object {
 
   inline iterator
   begin(void) {
+    _size.reset();
     return _data.begin();
   }
 
@@ -110,6 +323,7 @@ class Object {
 
   inline iterator
   end(void) {
+    _size.reset();
     return _data.end();
   }
 
@@ -139,8 +353,137 @@ class Object {
   size_t
   size(void) const;
 
+  void
+  reserve(size_t size);
+
+ private:
+  friend class Variant;
+
+  friend uint32_t
+  encode_len(Object const& obj);
+
+  // Below this many keys a linear scan beats hashing
+  static size_t const index_threshold = 16;
+
+  size_t
+  _lookup(std::string const& key) const;
+
+  void
+  _index_insert(size_t position);
+
+  void
+  _index_rebuild(void);
+
+  // Links the elements from position on to this object, once added or moved
+  void
+  _own(size_t position) noexcept;
+
+  data _data;
+  EncodedSize _size;
+
+  // Open addressing table of positions in _data (+1, 0 meaning empty slot),
+  // only built once the object grows past index_threshold keys
+  std::vector<uint32_t, ArenaAllocator<uint32_t>> _index;
+};
+
+// Elements are stored by position, keys "0", "1"... only exist in the encoded form
+class Array {
+  typedef std::vector<Variant, ArenaAllocator<Variant>> data;
+
+ public:
+  typedef data::iterator iterator;
+  typedef data::const_iterator const_iterator;
+
+  Array(void);
+
+  // Elements storage is allocated from the arena
+  explicit Array(Arena& arena);
+
+  Array(Array const& rhs);
+  Array(Array&& rhs) noexcept;
+
+  Array&
+  operator=(Array const& rhs);
+
+  Array&
+  operator=(Array&& rhs) noexcept;
+
+  // Appends a BSON_END element to be assigned when key is the size of the array, throws
+  // std::out_of_range past it: elements are never left unassigned between others
+  Variant&
+  operator[](uint32_t key);
+
+  Variant const&
+  operator[](uint32_t key) const;
+
+  inline iterator
+  begin(void) {
+    _size.reset();
+    return _data.begin();
+  }
+
+  inline const_iterator
+  begin(void) const {
+    return _data.begin();
+  }
+
+  inline iterator
+  end(void) {
+    _size.reset();
+    return _data.end();
+  }
+
+  inline const_iterator
+  end(void) const {
+    return _data.end();
+  }
+
+  inline bool
+  has(uint32_t key) const {
+    return key < _data.size();
+  }
+
+  inline iterator
+  find(uint32_t key) {
+    _size.reset();
+    return has(key) ? _data.begin() + key : _data.end();
+  }
+
+  inline const_iterator
+  find(uint32_t key) const {
+    return has(key) ? begin() + key : end();
+  }
+
+  // Appends a BSON_END element to be assigned by the caller
+  Variant&
+  append(void);
+
+  void
+  push_back(Variant const& value);
+
+  void
+  push_back(Variant&& value);
+
+  inline size_t
+  size(void) const {
+    return _data.size();
+  }
+
+  void
+  reserve(size_t size);
+
  private:
+  friend class Variant;
+
+  friend uint32_t
+  encode_len(Array const& array);
+
+  // Links the elements from position on to this array, once added or moved
+  void
+  _own(size_t position) noexcept;
+
   data _data;
+  EncodedSize _size;
 };
 
 class Variant {
@@ -150,7 +493,15 @@ class Variant {
   explicit Variant(bson_element_t type);
 
   Variant(Variant const& rhs);
-  Variant(Variant&& rhs) = delete;
+
+  inline Variant(Variant&& rhs) noexcept
+      : _type(rhs._type)
+      , _arena(rhs._arena)
+      , _owner(nullptr) {
+    memcpy(&_int64, &rhs._int64, sizeof(_int64));
+    rhs._type = BSON_END;
+    _setOwner(nullptr);
+  }
 
   ~Variant(void);
 
@@ -181,27 +532,42 @@ class Variant {
 
   inline char const*
   asString(void) const {
-    return _string;
+    return _arena ? _chars : _string->c_str();
+  }
+
+  inline char const*
+  asString(uint32_t* size) const {
+    if (_arena) {
+      memcpy(size, _chars - sizeof(uint32_t), sizeof(uint32_t));
+      return _chars;
+    }
+
+    *size = _string->size();
+    return _string->c_str();
   }
 
   inline Object const&
   asObject(void) const {
+    assert(_type == BSON_OBJECT);
     return *_object;
   }
 
   inline Object&
   asObject(void) {
+    assert(_type == BSON_OBJECT);
     return *_object;
   }
 
-  inline Object const&
+  inline Array const&
   asArray(void) const {
-    return *_object;
+    assert(_type == BSON_ARRAY);
+    return *_array;
   }
 
-  inline Object&
+  inline Array&
   asArray(void) {
-    return *_object;
+    assert(_type == BSON_ARRAY);
+    return *_array;
   }
 
   inline Binary const&
@@ -209,40 +575,56 @@ class Variant {
     return *_binary;
   }
 
+  // The binary may be resized through its buffer: the enclosing documents drop their sizes
   inline Binary&
   asBinary(void) {
+    assert(_type == BSON_BINARY);
+    _touch();
     return *_binary;
   }
 
-  inline Variant&
-  operator[](std::string const& key) {
-    return (*_object)[key];
-  }
+  // Keys of an array are decimal indexes, as in the encoded form, see Array::operator[].
+  // Throws std::out_of_range for other keys.
+  Variant&
+  operator[](std::string const& key);
 
-  inline Variant const&
-  operator[](std::string const& key) const {
-    return (*_object)[key];
-  }
+  // Missing keys, or any key of a variant which is not a document, give a BSON_END variant
+  Variant const&
+  operator[](std::string const& key) const;
 
   inline Variant&
   operator[](uint32_t key) {
-    return (*_object)[key];
+    return _type == BSON_ARRAY ? (*_array)[key] : (*_object)[key];
   }
 
   inline Variant const&
   operator[](uint32_t key) const {
-    return (*_object)[key];
+    return _type == BSON_ARRAY ? (*_array)[key] : (*_object)[key];
   }
 
   inline Variant&
   operator=(Variant const& rhs) {
-    this->~Variant();
-    new (this) Variant(rhs);
+    return operator=(Variant(rhs));
+  }
+
+  inline Variant&
+  operator=(Variant&& rhs) noexcept {
+    if (this != &rhs) {
+      _touch();
+      _free();
+      _type  = rhs._type;
+      _arena = rhs._arena;
+      memcpy(&_int64, &rhs._int64, sizeof(_int64));
+      rhs._type = BSON_END;
+      _setOwner(_owner);
+    }
+
     return *this;
   }
 
   inline Variant&
   operator=(double value) {
+    _touch();
     if (_type != BSON_DOUBLE) {
       _free();
       _type = BSON_DOUBLE;
@@ -254,6 +636,7 @@ class Variant {
 
   inline Variant&
   operator=(bool value) {
+    _touch();
     if (_type != BSON_BOOLEAN) {
       _free();
       _type = BSON_BOOLEAN;
@@ -265,6 +648,7 @@ class Variant {
 
   inline Variant&
   operator=(int32_t value) {
+    _touch();
     if (_type != BSON_INT32) {
       _free();
       _type = BSON_INT32;
@@ -276,6 +660,7 @@ class Variant {
 
   inline Variant&
   operator=(int64_t value) {
+    _touch();
     if (_type != BSON_INT64) {
       _free();
       _type = BSON_INT64;
@@ -287,22 +672,49 @@ class Variant {
 
   inline Variant&
   operator=(char const* value) {
-    _free();
-    _type = BSON_STRING;
+    _touch();
+    if (_type != BSON_STRING || _arena) {
+      _free();
+      _type   = BSON_STRING;
+      _string = new std::string(value);
+    } else {
+      _string->assign(value);
+    }
 
-    size_t len = strlen(value);
-    _string    = new char[len + 1];
-    memcpy(_string, value, len + 1);
     return *this;
   }
 
   inline Variant&
   operator=(std::string const& value) {
-    return operator=(value.c_str());
+    _touch();
+    if (_type != BSON_STRING || _arena) {
+      _free();
+      _type   = BSON_STRING;
+      _string = new std::string(value);
+    } else {
+      *_string = value;
+    }
+
+    return *this;
+  }
+
+  inline Variant&
+  operator=(std::string&& value) {
+    _touch();
+    if (_type != BSON_STRING || _arena) {
+      _free();
+      _type   = BSON_STRING;
+      _string = new std::string(std::move(value));
+    } else {
+      *_string = std::move(value);
+    }
+
+    return *this;
   }
 
   inline Variant&
   operator=(Binary const& value) {
+    _touch();
     if (_type != BSON_BINARY) {
       _free();
       _type   = BSON_BINARY;
@@ -315,33 +727,51 @@ class Variant {
   }
 
   inline Variant&
-  setArray(Object&& value) {
-    if (_type != BSON_ARRAY && _type != BSON_OBJECT) {
+  operator=(Binary&& value) {
+    _touch();
+    if (_type != BSON_BINARY) {
       _free();
-      _object = new Object(std::move(value));
+      _type   = BSON_BINARY;
+      _binary = new Binary(std::move(value));
     } else {
-      *_object = std::move(value);
+      *_binary = std::move(value);
+    }
+
+    return *this;
+  }
+
+  inline Variant&
+  setArray(Array&& value) {
+    _touch();
+    if (_type != BSON_ARRAY) {
+      _free();
+      _array = new Array(std::move(value));
+    } else {
+      *_array = std::move(value);
     }
 
     _type = BSON_ARRAY;
+    _setOwner(_owner);
 
     return *this;
   }
 
   inline Variant&
-  setArray(Object const& value) {
-    return setArray(Object(value));
+  setArray(Array const& value) {
+    return setArray(Array(value));
   }
 
   inline Variant&
   setObject(Object&& value) {
-    if (_type != BSON_ARRAY && _type != BSON_OBJECT) {
+    _touch();
+    if (_type != BSON_OBJECT) {
       _free();
       _object = new Object(std::move(value));
     } else {
       *_object = std::move(value);
     }
     _type = BSON_OBJECT;
+    _setOwner(_owner);
 
     return *this;
   }
@@ -351,20 +781,61 @@ class Variant {
     return setObject(Object(value));
   }
 
+  // The following setters place the value in an arena, which must outlive the variant
+
+  Variant&
+  makeString(char const* str, uint32_t size, Arena& arena);
+
+  Binary&
+  makeBinary(bson_binary_t subtype, Arena& arena);
+
+  Object&
+  makeObject(Arena& arena);
+
+  Array&
+  makeArray(Arena& arena);
+
  private:
+  friend class Object;
+  friend class Array;
+
   void
   _free(void);
 
+  // Drops the cached sizes of the documents holding this element
+  inline void
+  _touch(void) const {
+    if (_owner) _owner->reset();
+  }
+
+  // Links this element, and the document it holds if any, to the size of the enclosing document
+  inline void
+  _setOwner(EncodedSize const* owner) noexcept {
+    _owner = owner;
+    if (_type == BSON_OBJECT)
+      _object->_size.setParent(owner);
+    else if (_type == BSON_ARRAY)
+      _array->_size.setParent(owner);
+  }
+
   bson_element_t _type;
 
+  // Payload lives in an arena: destroy it in place but never delete it
+  bool _arena;
+
+  // Size of the enclosing document, null for a standalone variant
+  EncodedSize const* _owner;
+
   union {
     double _double;
     bool _boolean;
     int32_t _int32;
     int64_t _int64;
 
-    char* _string;
+    std::string* _string;
+    char const* _chars;
     Object* _object;
+    Array* _array;
     Binary* _binary;
   };
 };
@@ -374,20 +845,791 @@ Object::size(void) const {
   return _data.size();
 }
 
-Object
-decode(char const* input);
+class View;
 
-uint32_t
-encode_len(Object const& obj);
+// Dotted path compiled once, see bson_path_compile
+class Path {
+ public:
+  explicit Path(std::string path);
 
-void
-encode(Object const& obj, char* output, char** next = nullptr);
+  Path(Path const& rhs);
 
-std::vector<char>
-encode(Object const& obj);
+  Path&
+  operator=(Path const& rhs);
 
-void
-print(std::ostream& os, bson::Object const& obj, size_t indent, size_t indent_step);
+  inline bool
+  valid(void) const {
+    return _valid;
+  }
+
+  inline std::string const&
+  str(void) const {
+    return _string;
+  }
+
+  inline bson_path_t const*
+  get(void) const {
+    return &_path;
+  }
+
+ private:
+  void
+  _compile(void);
+
+  std::string _string;
+  bson_path_t _path;
+  bool _valid;
+};
+
+// Read-only reference to one element of a raw bson buffer.
+// It does not own any memory: the underlying buffer must outlive it.
+class ElementRef {
+ public:
+  inline ElementRef(void)
+      : _elem(nullptr)
+      , _value(nullptr) {}
+
+  explicit ElementRef(char const* elem);
+
+  // Element whose value position is already known
+  inline ElementRef(char const* elem, char const* value)
+      : _elem(elem)
+      , _value(value) {}
+
+  inline bool
+  valid(void) const {
+    return _elem != nullptr;
+  }
+
+  inline explicit operator bool(void) const {
+    return valid();
+  }
+
+  inline bson_element_t
+  getType(void) const {
+    return _elem ? bson_get_element_type(_elem, NULL) : BSON_END;
+  }
+
+  inline char const*
+  getName(void) const {
+    return _elem + 1;
+  }
+
+  inline char const*
+  data(void) const {
+    return _elem;
+  }
+
+  inline char const*
+  value(void) const {
+    return _value;
+  }
+
+  inline double
+  asDouble(void) const {
+    return bson_get_element_value_double(_value, NULL);
+  }
+
+  inline bool
+  asBoolean(void) const {
+    return bson_get_element_value_bool(_value, NULL);
+  }
+
+  inline int32_t
+  asInt32(void) const {
+    return bson_get_element_value_int32(_value, NULL);
+  }
+
+  inline int64_t
+  asInt64(void) const {
+    return bson_get_element_value_int64(_value, NULL);
+  }
+
+  inline char const*
+  asString(uint32_t* size = nullptr) const {
+    return bson_get_element_value_string(_value, size, NULL);
+  }
+
+  inline void const*
+  asBinary(uint32_t* size, bson_binary_t* subtype = nullptr) const {
+    return bson_get_element_value_binary(_value, size, subtype, NULL);
+  }
+
+  View
+  asObject(void) const;
+
+  View
+  asArray(void) const;
+
+  ElementRef
+  operator[](char const* key) const;
+
+  ElementRef
+  operator[](std::string const& key) const;
+
+  ElementRef
+  operator[](uint32_t key) const;
+
+  // Disambiguates a literal 0 from a null key
+  inline ElementRef
+  operator[](int key) const {
+    return operator[]((uint32_t) key);
+  }
+
+ private:
+  friend class View;
+
+  char const* _elem;
+  char const* _value;
+};
+
+// Zero-copy read-only view over a raw bson object or array.
+// Lookups walk the buffer with the bson_get_* primitives and never allocate.
+class View {
+ public:
+  class const_iterator {
+   public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef ElementRef value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef ElementRef const* pointer;
+    typedef ElementRef const& reference;
+
+    inline const_iterator(void)
+        : _ref() {}
+
+    explicit inline const_iterator(char const* elem)
+        : _ref(elem) {}
+
+    inline reference
+    operator*(void) const {
+      return _ref;
+    }
+
+    inline pointer
+    operator->(void) const {
+      return &_ref;
+    }
+
+    const_iterator&
+    operator++(void);
+
+    inline const_iterator
+    operator++(int) {
+      const_iterator result = *this;
+      ++*this;
+      return result;
+    }
+
+    inline bool
+    operator==(const_iterator const& rhs) const {
+      return _ref._elem == rhs._ref._elem;
+    }
+
+    inline bool
+    operator!=(const_iterator const& rhs) const {
+      return _ref._elem != rhs._ref._elem;
+    }
+
+   private:
+    ElementRef _ref;
+  };
+
+  typedef const_iterator iterator;
+
+  inline View(void)
+      : _obj(BSON_EMPTY) {}
+
+  explicit inline View(char const* obj)
+      : _obj(obj) {}
+
+  inline char const*
+  data(void) const {
+    return _obj;
+  }
+
+  inline uint32_t
+  size(void) const {
+    return bson_get_size(_obj, NULL);
+  }
+
+  inline uint32_t
+  count(void) const {
+    return bson_get_element_count(_obj);
+  }
+
+  inline bool
+  empty(void) const {
+    return bson_get_element_type(_obj + sizeof(uint32_t), NULL) == BSON_END;
+  }
+
+  inline const_iterator
+  begin(void) const {
+    return const_iterator(_obj + sizeof(uint32_t));
+  }
+
+  inline const_iterator
+  end(void) const {
+    return const_iterator(_obj + size() - 1);
+  }
+
+  const_iterator
+  find(char const* key) const;
+
+  inline const_iterator
+  find(std::string const& key) const {
+    return find(key.c_str());
+  }
+
+  const_iterator
+  find(uint32_t key) const;
+
+  inline const_iterator
+  find(int key) const {
+    return find((uint32_t) key);
+  }
+
+  inline bool
+  has(char const* key) const {
+    return find(key) != end();
+  }
+
+  inline bool
+  has(std::string const& key) const {
+    return has(key.c_str());
+  }
+
+  inline bool
+  has(uint32_t key) const {
+    return find(key) != end();
+  }
+
+  inline bool
+  has(int key) const {
+    return has((uint32_t) key);
+  }
+
+  ElementRef
+  operator[](char const* key) const;
+
+  inline ElementRef
+  operator[](std::string const& key) const {
+    return operator[](key.c_str());
+  }
+
+  ElementRef
+  operator[](uint32_t key) const;
+
+  // Disambiguates a literal 0 from a null key
+  inline ElementRef
+  operator[](int key) const {
+    return operator[]((uint32_t) key);
+  }
+
+  ElementRef
+  operator[](Path const& path) const;
+
+  inline bool
+  has(Path const& path) const {
+    return operator[](path).valid();
+  }
+
+ private:
+  char const* _obj;
+};
+
+// Offset side-table of one document for O(1) access by position or key, see bson_index_build
+class Index {
+ public:
+  explicit Index(View const& view, uint32_t flags = BSON_INDEX_KEYS);
+
+  // Storage taken from arena, which must outlive the index
+  Index(View const& view, Arena& arena, uint32_t flags = BSON_INDEX_KEYS);
+
+  Index(Index const& rhs) = delete;
+
+  Index&
+  operator=(Index const& rhs) = delete;
+
+  Index(Index&& rhs) = default;
+
+  Index&
+  operator=(Index&& rhs) = default;
+
+  // False when the document holds an unknown element type
+  inline bool
+  valid(void) const {
+    return _valid;
+  }
+
+  inline uint32_t
+  size(void) const {
+    return _index.count;
+  }
+
+  inline View
+  view(void) const {
+    return View(_index.obj);
+  }
+
+  inline ElementRef
+  operator[](uint32_t position) const {
+    char const* elem = bson_index_at(&_index, position);
+    return elem ? ElementRef(elem) : ElementRef();
+  }
+
+  // Disambiguates a literal 0 from a null key
+  inline ElementRef
+  operator[](int position) const {
+    return operator[]((uint32_t) position);
+  }
+
+  inline ElementRef
+  operator[](char const* key) const {
+    char const* elem = bson_index_find(&_index, key);
+    return elem ? ElementRef(elem) : ElementRef();
+  }
+
+  inline ElementRef
+  operator[](std::string const& key) const {
+    return operator[](key.c_str());
+  }
+
+ private:
+  std::vector<uint32_t> _storage;
+  bson_index_t _index;
+  bool _valid;
+};
+
+// Top-level fields pulled out of documents in a single scan, see bson_projection_compile
+class Projection {
+ public:
+  explicit Projection(std::vector<std::string> fields);
+
+  Projection(Projection const& rhs);
+
+  Projection&
+  operator=(Projection const& rhs);
+
+  inline bool
+  valid(void) const {
+    return _valid;
+  }
+
+  inline std::vector<std::string> const&
+  fields(void) const {
+    return _fields;
+  }
+
+  // Sets one reference per field, invalid for missing ones, and returns the number found
+  size_t
+  extract(View const& view, std::vector<ElementRef>& result) const;
+
+ private:
+  void
+  _compile(void);
+
+  std::vector<std::string> _fields;
+  bson_projection_t _projection;
+  bool _valid;
+};
+
+// Values of one field across documents, one row per document, stored contiguously by type.
+// Rows without a value of the column type are null: their bit is set in the null bitmap and
+// they hold 0, false or an empty string.
+class Column {
+ public:
+  // Strings are kept as bytes plus row offsets, offsets()[row] to offsets()[row + 1]
+  Column(std::string path, bson_element_t type);
+
+  inline std::string const&
+  path(void) const {
+    return _path;
+  }
+
+  inline bson_element_t
+  type(void) const {
+    return _type;
+  }
+
+  inline size_t
+  size(void) const {
+    return _size;
+  }
+
+  // Bit row % 8 of byte row / 8 is set for null rows
+  inline uint8_t const*
+  nulls(void) const {
+    return _nulls.data();
+  }
+
+  inline bool
+  isNull(size_t row) const {
+    return _nulls[row / 8] >> (row % 8) & 1;
+  }
+
+  inline size_t
+  nullCount(void) const {
+    return _null_count;
+  }
+
+  inline int32_t const*
+  int32s(void) const {
+    return _int32s.data();
+  }
+
+  inline int64_t const*
+  int64s(void) const {
+    return _int64s.data();
+  }
+
+  inline double const*
+  doubles(void) const {
+    return _doubles.data();
+  }
+
+  // One byte per row, 0 or 1
+  inline uint8_t const*
+  bools(void) const {
+    return _bools.data();
+  }
+
+  inline uint64_t const*
+  offsets(void) const {
+    return _offsets.data();
+  }
+
+  inline char const*
+  bytes(void) const {
+    return _bytes.data();
+  }
+
+  inline std::string
+  str(size_t row) const {
+    return std::string(_bytes.data() + _offsets[row], _offsets[row + 1] - _offsets[row]);
+  }
+
+  // Drops every row but keeps the storage
+  void
+  clear(void);
+
+ private:
+  friend class ColumnExtractor;
+
+  void
+  _append(bson_element_t type, char const* value);
+
+  std::string _path;
+  bson_element_t _type;
+  size_t _size;
+  size_t _null_count;
+  std::vector<uint8_t> _nulls;
+  std::vector<int32_t> _int32s;
+  std::vector<int64_t> _int64s;
+  std::vector<double> _doubles;
+  std::vector<uint8_t> _bools;
+  std::vector<uint64_t> _offsets;
+  std::vector<char> _bytes;
+};
+
+// Appends typed fields of documents to columns, without building any document.
+// Paths are dotted, see bson_path_compile, and columns are BSON_INT32, BSON_INT64, BSON_DOUBLE,
+// BSON_BOOLEAN or BSON_STRING. Integers are widened into int64 and double columns, any other type
+// mismatch gives a null. Top-level fields are found in one scan of each document, see
+// bson_projection_compile, deeper ones from there through their subdocument.
+class ColumnExtractor {
+ public:
+  explicit ColumnExtractor(std::vector<std::pair<std::string, bson_element_t>> const& fields);
+
+  ColumnExtractor(ColumnExtractor const& rhs);
+
+  ColumnExtractor&
+  operator=(ColumnExtractor const& rhs);
+
+  // False on an invalid path or column type, or more than BSON_PROJECTION_MAX_FIELDS distinct
+  // top-level fields
+  inline bool
+  valid(void) const {
+    return _valid;
+  }
+
+  inline std::vector<Column> const&
+  columns(void) const {
+    return _columns;
+  }
+
+  inline Column const&
+  operator[](size_t column) const {
+    return _columns[column];
+  }
+
+  // Rows appended so far
+  inline size_t
+  size(void) const {
+    return _rows;
+  }
+
+  // Adds one row to every column
+  void
+  append(char const* obj);
+
+  inline void
+  append(View const& view) {
+    append(view.data());
+  }
+
+  // Adds one row per document of size bytes of concatenated documents. When one is truncated or
+  // has an invalid size, the rows of the documents before it are kept and the reader status
+  // tells why, BSON_READER_EOF otherwise.
+  bson_reader_status_t
+  append(char const* data, size_t size);
+
+  void
+  clear(void);
+
+ private:
+  // Where the value of a column is found: a top-level field, then the rest of its path
+  struct Field {
+    uint32_t head;
+    bson_path_t rest;
+  };
+
+  void
+  _compile(void);
+
+  std::vector<Column> _columns;
+  std::vector<std::string> _heads;
+  std::vector<Field> _fields;
+  bson_projection_t _projection;
+  size_t _rows;
+  bool _valid;
+};
+
+// Extended JSON output reusing its buffer from one document to the next
+class JsonWriter {
+ public:
+  explicit JsonWriter(bson_json_mode_t mode = BSON_JSON_RELAXED);
+
+  JsonWriter(JsonWriter const& rhs) = delete;
+
+  JsonWriter&
+  operator=(JsonWriter const& rhs) = delete;
+
+  ~JsonWriter(void);
+
+  // Appends obj, returns false on an unknown element type or memory exhaustion
+  bool
+  write(char const* obj);
+
+  inline bool
+  write(View const& view) {
+    return write(view.data());
+  }
+
+  inline char const*
+  data(void) const {
+    return _buffer.data;
+  }
+
+  inline size_t
+  size(void) const {
+    return _buffer.size;
+  }
+
+  inline std::string
+  str(void) const {
+    return std::string(_buffer.data, _buffer.size);
+  }
+
+  inline void
+  clear(void) {
+    bson_buffer_clear(&_buffer);
+  }
+
+ private:
+  bson_json_mode_t _mode;
+  bson_buffer_t _buffer;
+};
+
+// JSON to BSON, reusing its token index and output buffer from one document to the next
+class JsonParser {
+ public:
+  JsonParser(void);
+
+  JsonParser(JsonParser const& rhs) = delete;
+
+  JsonParser&
+  operator=(JsonParser const& rhs) = delete;
+
+  ~JsonParser(void);
+
+  // Replaces the previous document
+  bson_json_status_t
+  parse(char const* json, size_t size);
+
+  inline bson_json_status_t
+  parse(std::string const& json) {
+    return parse(json.data(), json.size());
+  }
+
+  // Only valid after a successful parse
+  inline View
+  view(void) const {
+    return View(_buffer.data);
+  }
+
+  inline char const*
+  data(void) const {
+    return _buffer.data;
+  }
+
+  inline size_t
+  size(void) const {
+    return _buffer.size;
+  }
+
+  // Offset of the offending character in the input after a failed parse
+  inline size_t
+  error_offset(void) const {
+    return _error_offset;
+  }
+
+ private:
+  bson_json_parser_t _parser;
+  bson_buffer_t _buffer;
+  size_t _error_offset;
+};
+
+// Fixed set of threads sharing out the items of a batch. Each worker starts on an equal slice of
+// the items and, once done, steals half of what remains from the others.
+// Each worker owns an arena, for what it allocates without contending with the others.
+class WorkerPool {
+ public:
+  // 0 starts one thread per hardware thread
+  explicit WorkerPool(size_t threads = 0);
+
+  WorkerPool(WorkerPool const& rhs) = delete;
+
+  WorkerPool&
+  operator=(WorkerPool const& rhs) = delete;
+
+  ~WorkerPool(void);
+
+  size_t
+  size(void) const;
+
+  // Calls task(item, worker) once for every item in [0, count) from the pool threads and returns
+  // once they are all done. The first exception thrown by task stops the batch and is rethrown.
+  // Batches must not be run from several threads at once.
+  void
+  run(size_t count, std::function<void(size_t item, size_t worker)> const& task);
+
+  Arena&
+  arena(size_t worker);
+
+  // Resets every arena, see Arena::reset
+  void
+  reset(void);
+
+ private:
+  // Threads and their synchronization, shared with the threads
+  struct Impl;
+
+  std::unique_ptr<Impl> _impl;
+};
+
+Object
+decode(char const* input);
+
+// Decodes into memory taken from arena, which must outlive the result
+Object
+decode(char const* input, Arena& arena);
+
+// Decodes documents[i] into results[i] across the pool, documents being assumed valid.
+// Results are allocated from the pool arenas, which the next batch resets: they must not
+// outlive it.
+void
+decode_batch(
+    char const* const* documents,
+    size_t count,
+    WorkerPool& pool,
+    std::vector<Object>& results);
+
+// Same over size bytes of concatenated documents. When one is truncated or has an invalid size,
+// nothing is decoded and the reader status tells why, BSON_READER_EOF otherwise.
+bson_reader_status_t
+decode_batch(char const* data, size_t size, WorkerPool& pool, std::vector<Object>& results);
+
+// Called with each document, its position in the input and the worker running it
+typedef std::function<void(char const* doc, size_t index, size_t worker)> ScanCallback;
+
+// Documents are scanned in two phases: their starts are first found by hopping their size
+// prefixes, then ranges of about range_size bytes are handed out to the pool.
+// Documents before a truncated end or an invalid size are still scanned, the reader status
+// tells why the scan stopped, BSON_READER_EOF once every document was scanned.
+
+#define BSON_SCAN_RANGE_SIZE (256 * 1024)
+#define BSON_SCAN_CHUNK_SIZE (64 * 1024 * 1024)
+
+bson_reader_status_t
+scan(
+    char const* data,
+    size_t size,
+    WorkerPool& pool,
+    ScanCallback const& callback,
+    size_t range_size = BSON_SCAN_RANGE_SIZE);
+
+// Maps the file, or reads it in chunks as a stream when it cannot be mapped
+bson_reader_status_t
+scan_file(
+    char const* filepath,
+    WorkerPool& pool,
+    ScanCallback const& callback,
+    size_t range_size = BSON_SCAN_RANGE_SIZE);
+
+// Documents are copied out of the reader into chunks of about chunk_size bytes, each chunk being
+// scanned before the next one is read. Pointers given to callback are only valid during the call.
+bson_reader_status_t
+scan(
+    bson_reader_t* reader,
+    WorkerPool& pool,
+    ScanCallback const& callback,
+    size_t chunk_size = BSON_SCAN_CHUNK_SIZE);
+
+uint32_t
+encode_len(Object const& obj);
+
+uint32_t
+encode_len(Array const& array);
+
+void
+encode(Object const& obj, char* output, char** next = nullptr);
+
+std::vector<char>
+encode(Object const& obj);
+
+// Appends obj to output in a single pass, sizes being written once each document is complete.
+// Output keeps its storage from one call to the next; running out of memory throws
+// std::bad_alloc, for bson_buffer_t as well.
+
+void
+encode(Object const& obj, std::vector<char>& output);
+
+void
+encode(Object const& obj, std::string& output);
+
+void
+encode(Object const& obj, bson_buffer_t* output);
+
+void
+print(std::ostream& os, bson::Object const& obj, size_t indent, size_t indent_step);
+
+// Empty on an unknown element type
+std::string
+to_json(char const* obj, bson_json_mode_t mode = BSON_JSON_RELAXED);
+
+std::string
+to_json(Object const& obj, bson_json_mode_t mode = BSON_JSON_RELAXED);
 
 } // namespace bson
 
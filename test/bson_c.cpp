@@ -16,10 +16,15 @@
  *   along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
 #include <cstdlib>
+#include <unistd.h>
 
 #include <iostream>
 #include <set>
+#include <vector>
 #include <string>
 
 #include <gtest/gtest.h>
@@ -240,6 +245,685 @@ TEST(bson, encode) {
   free(buffer);
 }
 
+TEST(bson, validate) {
+  uint32_t size = bson_get_size(message1, NULL);
+  size_t error_offset;
+
+  EXPECT_TRUE(bson_validate(message1, size, BSON_VALIDATE_UTF8, &error_offset));
+  EXPECT_TRUE(bson_validate(BSON_EMPTY, 5, BSON_VALIDATE_NONE, NULL));
+
+  // Every truncation is detected
+  for (uint32_t len = 0; len < size; ++len) {
+    std::vector<char> truncated(message1, message1 + len);
+    EXPECT_FALSE(bson_validate(truncated.data(), len, BSON_VALIDATE_NONE, NULL)) << len;
+  }
+
+  std::vector<char> message(message1, message1 + size);
+
+  // Unknown type code
+  message[0x29] = 0x42;
+  EXPECT_FALSE(bson_validate(message.data(), size, BSON_VALIDATE_NONE, &error_offset));
+  EXPECT_EQ(error_offset, 0x29u);
+  message[0x29] = 0x10;
+
+  // String size past its terminator
+  message[0x0a] = 0x07;
+  EXPECT_FALSE(bson_validate(message.data(), size, BSON_VALIDATE_NONE, &error_offset));
+  EXPECT_EQ(error_offset, 0x0au);
+  message[0x0a] = 0x06;
+
+  // Missing document terminator
+  message[size - 1] = 0x01;
+  EXPECT_FALSE(bson_validate(message.data(), size, BSON_VALIDATE_NONE, &error_offset));
+  EXPECT_EQ(error_offset, 0u);
+  message[size - 1] = 0x00;
+
+  // Invalid UTF-8 is only reported on demand
+  message[0x0e] = '\xc0';
+  EXPECT_TRUE(bson_validate(message.data(), size, BSON_VALIDATE_NONE, NULL));
+  EXPECT_FALSE(bson_validate(message.data(), size, BSON_VALIDATE_UTF8, &error_offset));
+  EXPECT_EQ(error_offset, 0x0au);
+
+  EXPECT_EQ(memcmp(message.data(), message1, 0x0e), 0);
+}
+
+TEST(bson, validate_depth) {
+  std::string message(BSON_EMPTY, 5);
+  for (int depth = 0; depth <= BSON_VALIDATE_MAX_DEPTH; ++depth) {
+    EXPECT_TRUE(bson_validate(message.data(), message.size(), BSON_VALIDATE_NONE, NULL));
+
+    char header[6];
+    bson_set_size(header, message.size() + sizeof(header) + 1, NULL);
+    bson_set_element_type(header + 4, BSON_OBJECT, NULL);
+    bson_set_element_name(header + 5, "", 0, NULL);
+    message = std::string(header, sizeof(header)) + message + '\0';
+  }
+
+  EXPECT_FALSE(bson_validate(message.data(), message.size(), BSON_VALIDATE_NONE, NULL));
+}
+
+static ptrdiff_t
+string_write_callback(void* data, void const* buffer, size_t size) {
+  std::vector<std::string>* writes = (std::vector<std::string>*) data;
+  writes->push_back(std::string((char const*) buffer, size));
+  return size;
+}
+
+TEST(bson, sink) {
+  char expected[1024];
+  int expected_size = bson_snprint(expected, sizeof(expected), message1, 0, 2);
+  ASSERT_GT(expected_size, 0);
+
+  for (size_t buffer_size : {8, 64, 4096}) {
+    std::vector<std::string> writes;
+    std::vector<char> buffer(buffer_size);
+    bson_sink_t sink;
+    bson_sink_init(&sink, string_write_callback, &writes, buffer.data(), buffer.size());
+    bson_fnprint(bson_sink_callback, &sink, message1, 0, 2);
+    EXPECT_TRUE(bson_sink_flush(&sink));
+
+    std::string output;
+    for (auto const& write : writes) output += write;
+
+    EXPECT_EQ(output, std::string(expected, expected_size));
+    EXPECT_EQ(writes.size() == 1, buffer_size > (size_t) expected_size);
+  }
+}
+
+typedef struct {
+  std::string data;
+  size_t offset;
+} short_read_data_t;
+
+// Hands out at most 3 bytes per call, like a slow pipe
+static ptrdiff_t
+short_read_callback(void* data_, void* buffer, size_t size) {
+  short_read_data_t* data = (short_read_data_t*) data_;
+  size_t len              = std::min(std::min(size, (size_t) 3), data->data.size() - data->offset);
+  memcpy(buffer, data->data.data() + data->offset, len);
+  data->offset += len;
+  return len;
+}
+
+TEST(bson, reader) {
+  uint32_t size = bson_get_size(message1, NULL);
+
+  short_read_data_t data = {"", 0};
+  for (int i = 0; i < 3; ++i) data.data.append(message1, size);
+  data.data.append(BSON_EMPTY, 5);
+
+  bson_reader_t reader;
+  bson_reader_init(&reader, short_read_callback, &data, NULL, 0);
+
+  bson_reader_status_t status;
+  for (int i = 0; i < 3; ++i) {
+    char const* doc = bson_reader_next(&reader, &status);
+    ASSERT_EQ(status, BSON_READER_OK);
+    EXPECT_EQ(memcmp(doc, message1, size), 0);
+  }
+
+  char const* doc = bson_reader_next(&reader, &status);
+  ASSERT_EQ(status, BSON_READER_OK);
+  EXPECT_EQ(bson_get_element_count(doc), 0u);
+
+  EXPECT_EQ(bson_reader_next(&reader, &status), nullptr);
+  EXPECT_EQ(status, BSON_READER_EOF);
+
+  bson_reader_destroy(&reader);
+}
+
+TEST(bson, reader_buffer) {
+  uint32_t size = bson_get_size(message1, NULL);
+
+  std::string data;
+  data.append(message1, size);
+  data.append(message1, size);
+
+  bson_reader_t reader;
+  bson_reader_init_buffer(&reader, data.data(), data.size());
+
+  bson_reader_status_t status;
+  EXPECT_EQ(bson_reader_next(&reader, &status), data.data());
+  EXPECT_EQ(bson_reader_next(&reader, &status), data.data() + size);
+  EXPECT_EQ(bson_reader_next(&reader, &status), nullptr);
+  EXPECT_EQ(status, BSON_READER_EOF);
+  bson_reader_destroy(&reader);
+
+  bson_reader_init_buffer(&reader, data.data(), data.size() - 1);
+  EXPECT_EQ(bson_reader_next(&reader, &status), data.data());
+  EXPECT_EQ(bson_reader_next(&reader, &status), nullptr);
+  EXPECT_EQ(status, BSON_READER_ERROR_TRUNCATED);
+  bson_reader_destroy(&reader);
+}
+
+TEST(bson, reader_errors) {
+  uint32_t size = bson_get_size(message1, NULL);
+
+  // Truncated stream
+  {
+    short_read_data_t data = {std::string(message1, size - 1), 0};
+    bson_reader_t reader;
+    bson_reader_init(&reader, short_read_callback, &data, NULL, 0);
+
+    bson_reader_status_t status;
+    EXPECT_EQ(bson_reader_next(&reader, &status), nullptr);
+    EXPECT_EQ(status, BSON_READER_ERROR_TRUNCATED);
+    bson_reader_destroy(&reader);
+  }
+
+  // Document larger than a fixed buffer
+  {
+    short_read_data_t data = {std::string(message1, size), 0};
+    char buffer[16];
+    bson_reader_t reader;
+    bson_reader_init(&reader, short_read_callback, &data, buffer, sizeof(buffer));
+
+    bson_reader_status_t status;
+    EXPECT_EQ(bson_reader_next(&reader, &status), nullptr);
+    EXPECT_EQ(status, BSON_READER_ERROR_SIZE);
+    bson_reader_destroy(&reader);
+  }
+}
+
+static std::string
+to_json(char const* obj, bson_json_mode_t mode) {
+  bson_buffer_t buffer;
+  bson_buffer_init(&buffer, NULL, 0);
+  EXPECT_TRUE(bson_to_json(&buffer, obj, mode));
+  std::string result(buffer.data, buffer.size);
+  EXPECT_EQ(buffer.data[buffer.size], '\0');
+  bson_buffer_destroy(&buffer);
+  return result;
+}
+
+TEST(bson, json) {
+  EXPECT_EQ(
+      to_json(message1, BSON_JSON_RELAXED),
+      "{\"dest\":\"cloud\",\"value\":{\"test\":[12,23,-1167088121787636991]}}");
+  EXPECT_EQ(
+      to_json(message1, BSON_JSON_CANONICAL),
+      "{\"dest\":\"cloud\",\"value\":{\"test\":[{\"$numberInt\":\"12\"},{\"$numberInt\":\"23\"},"
+      "{\"$numberLong\":\"-1167088121787636991\"}]}}");
+  EXPECT_EQ(to_json(BSON_EMPTY, BSON_JSON_RELAXED), "{}");
+
+  // Starts on caller storage, moves to the heap once it is too small, appends
+  char storage[16];
+  bson_buffer_t buffer;
+  bson_buffer_init(&buffer, storage, sizeof(storage));
+  ASSERT_TRUE(bson_to_json(&buffer, BSON_EMPTY, BSON_JSON_RELAXED));
+  EXPECT_EQ(buffer.data, storage);
+  ASSERT_TRUE(bson_to_json(&buffer, message1, BSON_JSON_RELAXED));
+  EXPECT_NE(buffer.data, storage);
+  EXPECT_EQ(std::string(buffer.data), "{}" + to_json(message1, BSON_JSON_RELAXED));
+  bson_buffer_destroy(&buffer);
+}
+
+// One element of every type
+static std::string
+all_types_message(void) {
+  std::string elements;
+  auto add = [&elements](char type, char const* name, std::string const& value) {
+    elements += type;
+    elements += name;
+    elements += '\0';
+    elements += value;
+  };
+  auto int64 = [](int64_t value) {
+    char bytes[8];
+    bson_set_element_value_int64(bytes, value, NULL);
+    return std::string(bytes, sizeof(bytes));
+  };
+  auto double_ = [](double value) {
+    char bytes[8];
+    bson_set_element_value_double(bytes, value, NULL);
+    return std::string(bytes, sizeof(bytes));
+  };
+
+  add(BSON_DOUBLE, "d1", double_(1.0));
+  add(BSON_DOUBLE, "d2", double_(0.1));
+  add(BSON_DOUBLE, "d3", double_(-1e300));
+  add(BSON_DOUBLE, "d4", double_(1.0 / 0.0));
+  add(BSON_STRING, "s", std::string("\x09\0\0\0a\"\\\n\x01\0\xc3\xa9\0", 13));
+  add(BSON_BINARY, "bin", std::string("\x05\0\0\0\x80\x00\xff\x10" "ab", 10));
+  add(BSON_UNDEFINED, "u", "");
+  add(BSON_OBJECTID, "id", std::string("\x01\x23\x45\x67\x89\xab\xcd\xef\x00\x11\x22\x33", 12));
+  add(BSON_BOOLEAN, "b", std::string("\x01", 1));
+  add(BSON_DATE, "date1", int64(1000000000000));
+  add(BSON_DATE, "date2", int64(-1));
+  add(BSON_NULL, "n", "");
+  add(BSON_REGEX, "re", std::string("^a/b$\0i\0", 8));
+  add(BSON_TIMESTAMP, "ts", int64((int64_t) 7 << 32 | 3));
+  add(BSON_DECI128, "dec1", int64(1) + int64(0x3040000000000000));
+  add(BSON_DECI128, "dec2", int64(1) + int64(0x303a000000000000));
+  add(BSON_DECI128, "dec3", int64(-12345) + int64(0xb04c000000000000 | 0x1ffffffffffff));
+  add(BSON_DECI128, "dec4", int64(0) + int64(0x7c00000000000000));
+  add((char) BSON_MINKEY, "min", "");
+  add(BSON_MAXKEY, "max", "");
+
+  std::string message = std::string(4, '\0') + elements + '\0';
+  bson_set_size(&message[0], message.size(), NULL);
+  return message;
+}
+
+TEST(bson, json_types) {
+  std::string message = all_types_message();
+  ASSERT_TRUE(bson_validate(message.data(), message.size(), BSON_VALIDATE_NONE, NULL));
+
+  EXPECT_EQ(
+      to_json(message.data(), BSON_JSON_RELAXED),
+      "{\"d1\":1.0,\"d2\":0.1,\"d3\":-1e+300,\"d4\":{\"$numberDouble\":\"Infinity\"},"
+      "\"s\":\"a\\\"\\\\\\n\\u0001\\u0000\xc3\xa9\","
+      "\"bin\":{\"$binary\":{\"base64\":\"AP8QYWI=\",\"subType\":\"80\"}},"
+      "\"u\":{\"$undefined\":true},\"id\":{\"$oid\":\"0123456789abcdef00112233\"},\"b\":true,"
+      "\"date1\":{\"$date\":\"2001-09-09T01:46:40.000Z\"},"
+      "\"date2\":{\"$date\":{\"$numberLong\":\"-1\"}},\"n\":null,"
+      "\"re\":{\"$regularExpression\":{\"pattern\":\"^a/b$\",\"options\":\"i\"}},"
+      "\"ts\":{\"$timestamp\":{\"t\":7,\"i\":3}},\"dec1\":{\"$numberDecimal\":\"1\"},"
+      "\"dec2\":{\"$numberDecimal\":\"0.001\"},\"dec3\":{\"$numberDecimal\":\"-0E+6\"},"
+      "\"dec4\":{\"$numberDecimal\":\"NaN\"},\"min\":{\"$minKey\":1},\"max\":{\"$maxKey\":1}}");
+
+  std::string canonical = to_json(message.data(), BSON_JSON_CANONICAL);
+  EXPECT_NE(canonical.find("\"d1\":{\"$numberDouble\":\"1.0\"}"), std::string::npos);
+  EXPECT_NE(
+      canonical.find("\"date1\":{\"$date\":{\"$numberLong\":\"1000000000000\"}}"),
+      std::string::npos);
+
+  // Unknown types cannot be skipped, the output is left untouched
+  message[4] = 0x42;
+  bson_buffer_t buffer;
+  bson_buffer_init(&buffer, NULL, 0);
+  EXPECT_FALSE(bson_to_json(&buffer, message.data(), BSON_JSON_RELAXED));
+  EXPECT_EQ(buffer.size, 0u);
+  EXPECT_STREQ(buffer.data, "");
+  bson_buffer_destroy(&buffer);
+}
+
+TEST(bson, builder) {
+  char storage[64];
+  bson_builder_t builder;
+  bson_builder_init(&builder, storage, sizeof(storage));
+
+  EXPECT_TRUE(bson_builder_append_utf8(&builder, "dest", "cloudy", 5));
+  EXPECT_TRUE(bson_builder_begin_document(&builder, "value"));
+  EXPECT_TRUE(bson_builder_begin_array(&builder, "test"));
+  EXPECT_TRUE(bson_builder_append_int32(&builder, NULL, 12));
+  EXPECT_TRUE(bson_builder_append_int64(&builder, "ignored", -1));
+  EXPECT_TRUE(bson_builder_append_document(&builder, NULL, BSON_EMPTY));
+  EXPECT_TRUE(bson_builder_end_array(&builder));
+  EXPECT_TRUE(bson_builder_append_bool(&builder, "ok", true));
+  EXPECT_TRUE(bson_builder_append_null(&builder, "none"));
+  EXPECT_TRUE(bson_builder_end_document(&builder));
+  EXPECT_TRUE(bson_builder_append_double(&builder, "pi", 3.5));
+  EXPECT_TRUE(bson_builder_append_binary(&builder, "bin", "\x01\x02", 2, BSON_BINARY_UUID));
+
+  size_t size;
+  char const* obj = bson_builder_finish(&builder, &size);
+  ASSERT_TRUE(obj);
+  EXPECT_NE(obj, storage);
+  EXPECT_TRUE(bson_validate(obj, size, BSON_VALIDATE_NONE, NULL));
+  EXPECT_EQ(
+      to_json(obj, BSON_JSON_CANONICAL),
+      "{\"dest\":\"cloud\",\"value\":{\"test\":"
+      "[{\"$numberInt\":\"12\"},{\"$numberLong\":\"-1\"},{}],"
+      "\"ok\":true,\"none\":null},\"pi\":{\"$numberDouble\":\"3.5\"},"
+      "\"bin\":{\"$binary\":{\"base64\":\"AQI=\",\"subType\":\"04\"}}}");
+
+  // Finished documents take no more elements
+  EXPECT_FALSE(bson_builder_append_int32(&builder, "late", 0));
+  EXPECT_FALSE(bson_builder_finish(&builder, NULL));
+
+  bson_builder_reset(&builder);
+  EXPECT_FALSE(bson_builder_end_document(&builder));
+  EXPECT_FALSE(bson_builder_append_int32(&builder, "after_error", 0));
+
+  bson_builder_reset(&builder);
+  EXPECT_TRUE(bson_builder_begin_array(&builder, "a"));
+  EXPECT_FALSE(bson_builder_end_document(&builder));
+
+  bson_builder_reset(&builder);
+  EXPECT_TRUE(bson_builder_begin_document(&builder, "open"));
+  EXPECT_FALSE(bson_builder_finish(&builder, NULL));
+
+  bson_builder_reset(&builder);
+  bool nested = true;
+  for (int i = 0; i < BSON_VALIDATE_MAX_DEPTH; ++i) nested = bson_builder_begin_array(&builder, "");
+  EXPECT_FALSE(nested);
+
+  // Storage is kept across resets
+  char const* data = builder.buffer.data;
+  bson_builder_reset(&builder);
+  EXPECT_EQ(builder.buffer.data, data);
+  obj = bson_builder_finish(&builder, &size);
+  ASSERT_TRUE(obj);
+  EXPECT_EQ(std::string(obj, size), std::string(BSON_EMPTY, 5));
+  bson_builder_destroy(&builder);
+}
+
+static std::string
+from_json(std::string const& json, bson_json_status_t expected = BSON_JSON_OK) {
+  bson_buffer_t buffer;
+  bson_buffer_init(&buffer, NULL, 0);
+  size_t error_offset = 0;
+  EXPECT_EQ(bson_from_json(&buffer, json.data(), json.size(), &error_offset), expected) << json;
+  std::string result = expected == BSON_JSON_OK ? std::string(buffer.data, buffer.size)
+                                                : std::to_string(error_offset);
+  bson_buffer_destroy(&buffer);
+  return result;
+}
+
+TEST(bson, json_parse) {
+  uint32_t size = bson_get_size(message1, NULL);
+  EXPECT_EQ(
+      from_json(
+          " {\"dest\" : \"cloud\",\n"
+          " \"value\": {\"test\": [12, 23, -1167088121787636991]}}\n"),
+      std::string(message1, size));
+  EXPECT_EQ(from_json("{}"), std::string(BSON_EMPTY, 5));
+
+  // Both Extended JSON modes read back to the same document
+  std::string message = all_types_message();
+  for (bson_json_mode_t mode : {BSON_JSON_RELAXED, BSON_JSON_CANONICAL}) {
+    std::string json   = to_json(message.data(), mode);
+    std::string parsed = from_json(json);
+    ASSERT_TRUE(bson_validate(parsed.data(), parsed.size(), BSON_VALIDATE_NONE, NULL));
+    EXPECT_EQ(to_json(parsed.data(), mode), json);
+  }
+
+  // Negative zero keeps its sign through relaxed mode
+  std::string const zero = from_json("{\"z\":{\"$numberDouble\":\"-0.0\"}}");
+  ASSERT_EQ(zero.size(), 16u);
+  double real = bson_get_element_value_double(zero.data() + 7, NULL);
+  EXPECT_TRUE(real == 0 && std::signbit(real));
+  EXPECT_EQ(to_json(zero.data(), BSON_JSON_RELAXED), "{\"z\":{\"$numberDouble\":\"-0.0\"}}");
+  EXPECT_EQ(to_json(zero.data(), BSON_JSON_CANONICAL), "{\"z\":{\"$numberDouble\":\"-0.0\"}}");
+
+  std::string const parsed = from_json(
+      "{\"s\":\"\\u00e9\\ud83d\\ude00\\/\",\"f\":false,\"big\":1e3,\"neg\":-2147483649,"
+      "\"date\":{\"$date\":\"2001-09-09T03:46:40.5+02:00\"},\"$plain\":{\"$unknown\":1}}");
+  EXPECT_EQ(
+      to_json(parsed.data(), BSON_JSON_RELAXED),
+      "{\"s\":\"\xc3\xa9\xf0\x9f\x98\x80/\",\"f\":false,\"big\":1000.0,\"neg\":-2147483649,"
+      "\"date\":{\"$date\":\"2001-09-09T01:46:40.500Z\"},\"$plain\":{\"$unknown\":1}}");
+
+  // Raw UTF-8 is copied as is
+  std::string const raw = from_json("{\"\xc3\xa9\":\"abcdefgh\xf0\x9f\x98\x80\"}");
+  EXPECT_TRUE(bson_validate(raw.data(), raw.size(), BSON_VALIDATE_UTF8, NULL));
+  EXPECT_EQ(to_json(raw.data(), BSON_JSON_RELAXED), "{\"\xc3\xa9\":\"abcdefgh\xf0\x9f\x98\x80\"}");
+}
+
+TEST(bson, json_parse_errors) {
+  EXPECT_EQ(from_json("", BSON_JSON_ERROR_SYNTAX), "0");
+  EXPECT_EQ(from_json("[1]", BSON_JSON_ERROR_SYNTAX), "0");
+  EXPECT_EQ(from_json("{\"a\":}", BSON_JSON_ERROR_SYNTAX), "5");
+  EXPECT_EQ(from_json("{\"a\":1,}", BSON_JSON_ERROR_SYNTAX), "7");
+  EXPECT_EQ(from_json("{\"a\":01}", BSON_JSON_ERROR_SYNTAX), "5");
+  EXPECT_EQ(from_json("{\"a\":tru}", BSON_JSON_ERROR_SYNTAX), "5");
+  EXPECT_EQ(from_json("{\"a\":\"x", BSON_JSON_ERROR_SYNTAX), "5");
+  EXPECT_EQ(from_json("{\"a\":\"\\x\"}", BSON_JSON_ERROR_SYNTAX), "6");
+  EXPECT_EQ(from_json("{\"a\":[1 2]}", BSON_JSON_ERROR_SYNTAX), "8");
+  EXPECT_EQ(from_json("{\"a\":1} {}", BSON_JSON_ERROR_SYNTAX), "8");
+  EXPECT_EQ(from_json("{\"\\u0000\":1}", BSON_JSON_ERROR_SYNTAX), "2");
+  EXPECT_EQ(from_json("{\"\xc0\x80\":1}", BSON_JSON_ERROR_SYNTAX), "2");
+  EXPECT_EQ(from_json("{\"a\":\"\xe2\x82\"}", BSON_JSON_ERROR_SYNTAX), "6");
+  EXPECT_EQ(from_json("{\"a\":\"abcdefgh\xff\"}", BSON_JSON_ERROR_SYNTAX), "14");
+  EXPECT_EQ(from_json("{\"a\":\"\xed\xa0\x80\"}", BSON_JSON_ERROR_SYNTAX), "6");
+  EXPECT_EQ(from_json("{\"a\":{\"$oid\":\"0123\"}}", BSON_JSON_ERROR_SYNTAX), "5");
+  EXPECT_EQ(from_json("{\"a\":{\"$numberInt\":\"2147483648\"}}", BSON_JSON_ERROR_SYNTAX), "5");
+
+  std::string deep = "{\"a\":1}";
+  for (int depth = 0; depth < BSON_VALIDATE_MAX_DEPTH; ++depth) deep = "{\"a\":" + deep + "}";
+  EXPECT_EQ(from_json(deep, BSON_JSON_ERROR_DEPTH), std::to_string(5 * BSON_VALIDATE_MAX_DEPTH));
+
+  // The output is left untouched
+  bson_buffer_t buffer;
+  bson_buffer_init(&buffer, NULL, 0);
+  ASSERT_EQ(bson_from_json(&buffer, "{}", 2, NULL), BSON_JSON_OK);
+  EXPECT_EQ(bson_from_json(&buffer, "{\"a\"}", 5, NULL), BSON_JSON_ERROR_SYNTAX);
+  EXPECT_EQ(std::string(buffer.data, buffer.size), std::string(BSON_EMPTY, 5));
+  bson_buffer_destroy(&buffer);
+}
+
+static char const*
+find_path(char const* obj, char const* str, bson_element_t* type = NULL) {
+  bson_path_t path;
+  EXPECT_TRUE(bson_path_compile(&path, str, strlen(str))) << str;
+  return bson_find_path(obj, &path, type, NULL);
+}
+
+TEST(bson, find_path) {
+  bson_element_t type;
+  char const* value = find_path(message1, "value.test.2", &type);
+  ASSERT_TRUE(value);
+  EXPECT_EQ(type, BSON_INT64);
+  EXPECT_EQ(bson_get_element_value_int64(value, NULL), (int64_t) 0xefcdab8967452301);
+
+  EXPECT_EQ(find_path(message1, "value.test", &type), message1 + 0x25);
+  EXPECT_EQ(type, BSON_ARRAY);
+  EXPECT_STREQ(bson_get_element_value_string(find_path(message1, "dest"), NULL, NULL), "cloud");
+
+  EXPECT_FALSE(find_path(message1, "value.test.3"));
+  EXPECT_FALSE(find_path(message1, "value.tes"));
+  EXPECT_FALSE(find_path(message1, "dest.cloud"));
+
+  // Every element type is skipped on the way
+  std::string message = all_types_message();
+  char const* elem;
+  bson_path_t path;
+  ASSERT_TRUE(bson_path_compile(&path, "max", 3));
+  ASSERT_TRUE(bson_find_path(message.data(), &path, &type, &elem));
+  EXPECT_EQ(type, BSON_MAXKEY);
+  EXPECT_STREQ(elem + 1, "max");
+
+  for (char const* invalid : {"", ".", "a.", ".a", "a..b"}) {
+    EXPECT_FALSE(bson_path_compile(&path, invalid, strlen(invalid))) << invalid;
+    EXPECT_FALSE(bson_find_path(message1, &path, NULL, NULL));
+  }
+
+  std::string deep = "a";
+  for (int i = 1; i < BSON_PATH_MAX_SEGMENTS; ++i) deep += ".a";
+  EXPECT_TRUE(bson_path_compile(&path, deep.data(), deep.size()));
+  deep += ".a";
+  EXPECT_FALSE(bson_path_compile(&path, deep.data(), deep.size()));
+}
+
+TEST(bson, projection) {
+  std::string message = all_types_message();
+
+  char const* names[] = {"max", "s", "missing", "d2", "id"};
+  bson_projection_t projection;
+  ASSERT_TRUE(bson_projection_compile(&projection, names, 5));
+
+  bson_projection_slot_t slots[5];
+  EXPECT_EQ(bson_projection_extract(&projection, message.data(), slots), 4u);
+  EXPECT_EQ(slots[0].type, BSON_MAXKEY);
+  EXPECT_STREQ(slots[0].elem + 1, "max");
+  EXPECT_EQ(slots[1].type, BSON_STRING);
+  EXPECT_STREQ(bson_get_element_value_string(slots[1].value, NULL, NULL), "a\"\\\n\x01");
+  EXPECT_EQ(slots[2].elem, nullptr);
+  EXPECT_EQ(slots[2].type, BSON_END);
+  EXPECT_EQ(slots[3].type, BSON_DOUBLE);
+  EXPECT_EQ(bson_get_element_value_double(slots[3].value, NULL), 0.1);
+  EXPECT_EQ(slots[4].type, BSON_OBJECTID);
+
+  // The scan stops once every field is found, the unknown type after them is never read
+  message[message.find("max") - 1] = 0x42;
+  char const* first[] = {"d1"};
+  ASSERT_TRUE(bson_projection_compile(&projection, first, 1));
+  EXPECT_EQ(bson_projection_extract(&projection, message.data(), slots), 1u);
+
+  char const* duplicates[] = {"a", "b", "a"};
+  EXPECT_FALSE(bson_projection_compile(&projection, duplicates, 3));
+
+  std::vector<std::string> many;
+  std::vector<char const*> many_names;
+  for (int i = 0; i <= BSON_PROJECTION_MAX_FIELDS; ++i) many.push_back("field" + std::to_string(i));
+  for (auto const& name : many) many_names.push_back(name.c_str());
+  EXPECT_TRUE(bson_projection_compile(&projection, many_names.data(), BSON_PROJECTION_MAX_FIELDS));
+  EXPECT_FALSE(
+      bson_projection_compile(&projection, many_names.data(), BSON_PROJECTION_MAX_FIELDS + 1));
+}
+
+// Array of count int32 equal to their position
+static std::string
+int32_array(uint32_t count) {
+  std::string message(4, '\0');
+  for (uint32_t i = 0; i < count; ++i) {
+    char value[4];
+    bson_set_element_value_int32(value, (int32_t) i, NULL);
+    message += (char) BSON_INT32;
+    message += std::to_string(i);
+    message += '\0';
+    message.append(value, sizeof(value));
+  }
+  message += '\0';
+  bson_set_size(&message[0], message.size(), NULL);
+  return message;
+}
+
+TEST(bson, index) {
+  std::string const message = int32_array(10000);
+
+  size_t storage_size = bson_index_storage_size(message.data(), BSON_INDEX_KEYS);
+  EXPECT_EQ(storage_size, (10000 + 32768) * sizeof(uint32_t));
+  std::vector<uint32_t> storage(storage_size / sizeof(uint32_t));
+
+  bson_index_t index;
+  ASSERT_TRUE(
+      bson_index_build(&index, message.data(), BSON_INDEX_KEYS, storage.data(), storage_size));
+  ASSERT_EQ(index.count, 10000u);
+
+  for (uint32_t i : {0u, 1u, 4242u, 9999u}) {
+    char const* elem = bson_index_at(&index, i);
+    ASSERT_TRUE(elem);
+    EXPECT_EQ(std::string(elem + 1), std::to_string(i));
+
+    elem = bson_index_find(&index, std::to_string(i).c_str());
+    ASSERT_TRUE(elem);
+    EXPECT_EQ(bson_get_element_value_int32(elem + 2 + strlen(elem + 1), NULL), (int32_t) i);
+  }
+  EXPECT_FALSE(bson_index_at(&index, 10000));
+  EXPECT_FALSE(bson_index_find(&index, "10000"));
+
+  // Positions only, keys are still found by scanning
+  storage_size = bson_index_storage_size(message.data(), BSON_INDEX_POSITIONS);
+  EXPECT_EQ(storage_size, 10000 * sizeof(uint32_t));
+  ASSERT_TRUE(bson_index_build(
+      &index, message.data(), BSON_INDEX_POSITIONS, storage.data(), storage_size));
+  EXPECT_EQ(bson_index_find(&index, "9998"), bson_index_at(&index, 9998));
+
+  EXPECT_FALSE(
+      bson_index_build(&index, message.data(), BSON_INDEX_KEYS, storage.data(), storage_size));
+
+  std::string types = all_types_message();
+  std::vector<uint32_t> small(bson_index_storage_size(types.data(), BSON_INDEX_KEYS) / 4);
+  ASSERT_TRUE(bson_index_build(
+      &index, types.data(), BSON_INDEX_KEYS, small.data(), small.size() * sizeof(uint32_t)));
+  EXPECT_STREQ(bson_index_find(&index, "dec2") + 1, "dec2");
+  EXPECT_EQ(bson_index_find(&index, "max"), bson_index_at(&index, index.count - 1));
+}
+
+TEST(bson, next_every_type) {
+  std::string message = all_types_message();
+  EXPECT_EQ(bson_get_element_count(message.data()), 20u);
+
+  std::vector<std::string> names;
+  char const* elem = message.data() + sizeof(uint32_t);
+  while (bson_get_element_type(elem, NULL) != BSON_END) {
+    names.push_back(elem + 1);
+    bson_next(elem, &elem);
+  }
+  EXPECT_EQ(names.size(), 20u);
+  EXPECT_EQ(names.back(), "max");
+  EXPECT_EQ(elem, message.data() + message.size() - 1);
+  bson_next(elem, &elem);
+  EXPECT_EQ(elem, message.data() + message.size() - 1);
+
+  std::string const code("\x06\0\0\0a = 1\0", 10);
+  std::string const scope(BSON_EMPTY, 5);
+  std::string elements;
+  elements += std::string("\x0d" "js\0", 4) + code;
+  elements += std::string("\x0e" "sym\0", 5) + code;
+  elements += std::string("\x0c" "ptr\0", 5) + code + std::string(12, '\x01');
+  elements += std::string("\x0f" "scoped\0", 8) + std::string("\x13\0\0\0", 4) + code + scope;
+  elements += std::string("\x10" "i\0" "\x02\0\0\0", 7);
+  message = std::string(4, '\0') + elements + '\0';
+  bson_set_size(&message[0], message.size(), NULL);
+  ASSERT_TRUE(bson_validate(message.data(), message.size(), BSON_VALIDATE_NONE, NULL));
+  EXPECT_EQ(bson_get_element_count(message.data()), 5u);
+
+  // Printers step over the types they do not format
+  char printed[512];
+  bson_snprint(printed, sizeof(printed), message.data(), 0, 2);
+  EXPECT_TRUE(strstr(printed, "\"scoped\": type(0x0f,size=19),\n  \"i\": int32(2)\n}")) << printed;
+
+  message[4] = 0x42;
+  elem       = message.data() + sizeof(uint32_t);
+  bson_next(elem, &elem);
+  EXPECT_FALSE(elem);
+}
+
+static bson_path_t
+compile_path(char const* str) {
+  bson_path_t path;
+  EXPECT_TRUE(bson_path_compile(&path, str, strlen(str))) << str;
+  return path;
+}
+
+TEST(bson, edit) {
+  uint32_t size = bson_get_size(message1, NULL);
+
+  // A second document checks the tail of the buffer is moved along
+  bson_buffer_t buffer;
+  bson_buffer_init(&buffer, NULL, 0);
+  ASSERT_TRUE(bson_buffer_append(&buffer, message1, size));
+  ASSERT_TRUE(bson_buffer_append(&buffer, BSON_EMPTY, 5));
+
+  bson_path_t const test1 = compile_path("value.test.1");
+  EXPECT_TRUE(bson_update_int32(buffer.data, &test1, 42));
+  EXPECT_FALSE(bson_update_int64(buffer.data, &test1, 42));
+  bson_path_t const test2 = compile_path("value.test.2");
+  EXPECT_TRUE(bson_update_int64(buffer.data, &test2, -2));
+  bson_path_t const missing = compile_path("value.missing");
+  EXPECT_FALSE(bson_update_bool(buffer.data, &missing, true));
+  EXPECT_FALSE(bson_update_double(buffer.data, &missing, 1.5));
+  EXPECT_EQ(buffer.size, size + 5);
+
+  bson_path_t const dest = compile_path("dest");
+  EXPECT_TRUE(bson_replace(&buffer, &dest, BSON_STRING, "\x0b\0\0\0blue skies", 15));
+  bson_path_t const test0 = compile_path("value.test.0");
+  EXPECT_TRUE(bson_replace(&buffer, &test0, BSON_BOOLEAN, "\x01", 1));
+  EXPECT_FALSE(bson_replace(&buffer, &missing, BSON_NULL, "", 0));
+
+  EXPECT_TRUE(bson_insert(&buffer, &missing, BSON_NULL, "", 0));
+  EXPECT_FALSE(bson_insert(&buffer, &missing, BSON_NULL, "", 0));
+  bson_path_t const test3 = compile_path("value.test.3");
+  EXPECT_TRUE(bson_insert(&buffer, &test3, BSON_OBJECT, BSON_EMPTY, 5));
+  bson_path_t const top = compile_path("top");
+  EXPECT_TRUE(bson_insert(&buffer, &top, BSON_INT32, "\x07\0\0\0", 4));
+  bson_path_t const under_string = compile_path("dest.a");
+  EXPECT_FALSE(bson_insert(&buffer, &under_string, BSON_NULL, "", 0));
+  bson_path_t const under_missing = compile_path("missing.a");
+  EXPECT_FALSE(bson_insert(&buffer, &under_missing, BSON_NULL, "", 0));
+
+  EXPECT_EQ(
+      to_json(buffer.data, BSON_JSON_RELAXED),
+      "{\"dest\":\"blue skies\",\"value\":{\"test\":[true,42,-2,{}],\"missing\":null},"
+      "\"top\":7}");
+
+  EXPECT_TRUE(bson_remove(&buffer, &test1));
+  EXPECT_TRUE(bson_remove(&buffer, &dest));
+  EXPECT_FALSE(bson_remove(&buffer, &dest));
+  EXPECT_TRUE(bson_remove(&buffer, &missing));
+  EXPECT_EQ(
+      to_json(buffer.data, BSON_JSON_RELAXED), "{\"value\":{\"test\":[true,-2,{}]},\"top\":7}");
+
+  size = bson_get_size(buffer.data, NULL);
+  EXPECT_TRUE(bson_validate(buffer.data, size, BSON_VALIDATE_NONE, NULL));
+  ASSERT_EQ(buffer.size, size + 5);
+  EXPECT_EQ(memcmp(buffer.data + size, BSON_EMPTY, 5), 0);
+  bson_buffer_destroy(&buffer);
+}
+
 char const* test_filepath = NULL;
 
 TEST(bson, decode_large) {
@@ -373,9 +1057,164 @@ TEST(bson, decode_large) {
 
   EXPECT_EQ(expected, keys);
 
+  EXPECT_TRUE(bson_validate(buffer, file_size, BSON_VALIDATE_UTF8, NULL));
+
   free(buffer);
 }
 
+TEST(bson, reader_file) {
+  FILE* f = fopen(test_filepath, "rb");
+  ASSERT_TRUE(f);
+
+  // A fixed buffer is enough as long as documents fit in it
+  std::vector<char> buffer(512 * 1024);
+  bson_reader_t reader;
+  bson_reader_init_file(&reader, f, buffer.data(), buffer.size());
+
+  bson_reader_status_t status;
+  char const* doc = bson_reader_next(&reader, &status);
+  ASSERT_EQ(status, BSON_READER_OK);
+  EXPECT_TRUE(bson_validate(doc, bson_get_size(doc, NULL), BSON_VALIDATE_NONE, NULL));
+
+  EXPECT_EQ(bson_reader_next(&reader, &status), nullptr);
+  EXPECT_EQ(status, BSON_READER_EOF);
+
+  bson_reader_destroy(&reader);
+  fclose(f);
+}
+
+TEST(bson, reader_mmap) {
+  bson_reader_t reader;
+  ASSERT_EQ(bson_reader_init_mmap(&reader, test_filepath), BSON_READER_OK);
+
+  bson_reader_status_t status;
+  char const* doc = bson_reader_next(&reader, &status);
+  ASSERT_EQ(status, BSON_READER_OK);
+  EXPECT_EQ(doc, reader.buffer);
+  EXPECT_TRUE(bson_validate(doc, bson_get_size(doc, NULL), BSON_VALIDATE_NONE, NULL));
+
+  EXPECT_EQ(bson_reader_next(&reader, &status), nullptr);
+  EXPECT_EQ(status, BSON_READER_EOF);
+  bson_reader_destroy(&reader);
+
+  EXPECT_EQ(bson_reader_init_mmap(&reader, "/nonexistent.bson"), BSON_READER_ERROR_READ);
+}
+
+TEST(bson, archive) {
+  char archive_path[] = "/tmp/bson_archive_XXXXXX";
+  int fd              = mkstemp(archive_path);
+  ASSERT_GE(fd, 0);
+  close(fd);
+  std::string const index_path = std::string(archive_path) + BSON_ARCHIVE_INDEX_SUFFIX;
+
+  // Sequence numbers in shuffled order, some missing and some stored as int32
+  std::string archive;
+  std::vector<size_t> offsets;
+  std::vector<int64_t> sequences;
+  bson_builder_t builder;
+  bson_builder_init(&builder, NULL, 0);
+  for (int i = 0; i < 300; ++i) {
+    bson_builder_reset(&builder);
+    sequences.push_back(i % 10 ? (i * 7) % 300 - 100 : INT64_MAX);
+    if (i % 10 == 1)
+      bson_builder_append_int32(&builder, "seq", (int32_t) sequences.back());
+    else if (i % 10)
+      bson_builder_append_int64(&builder, "seq", sequences.back());
+    bson_builder_begin_document(&builder, "meta");
+    std::string name = "name" + std::to_string(i % 50);
+    bson_builder_append_utf8(&builder, "name", name.data(), name.size());
+    bson_builder_end_document(&builder);
+
+    size_t size;
+    char const* doc = bson_builder_finish(&builder, &size);
+    ASSERT_TRUE(doc);
+    offsets.push_back(archive.size());
+    archive.append(doc, size);
+  }
+  bson_builder_destroy(&builder);
+
+  FILE* f = fopen(archive_path, "wb");
+  ASSERT_TRUE(f);
+  fwrite(archive.data(), 1, archive.size(), f);
+  fclose(f);
+
+  char const* keys[] = {"seq", "meta.name"};
+  ASSERT_EQ(bson_archive_index(archive_path, NULL, keys, 2), BSON_ARCHIVE_OK);
+
+  bson_archive_t index;
+  ASSERT_EQ(bson_archive_open(&index, archive_path, NULL), BSON_ARCHIVE_OK);
+  ASSERT_EQ(index.count, 300u);
+  for (size_t i = 0; i < offsets.size(); ++i) {
+    EXPECT_EQ(bson_archive_get(&index, i), index.data + offsets[i]);
+  }
+  EXPECT_EQ(bson_archive_get(&index, 300), nullptr);
+
+  // The smallest sequence not less than the one sought, the first document on a tie
+  for (int64_t value : {(int64_t) -500, (int64_t) -100, (int64_t) 0, (int64_t) 57, (int64_t) 199}) {
+    size_t expected = 300;
+    for (size_t i = 0; i < sequences.size(); ++i) {
+      if (sequences[i] == INT64_MAX || sequences[i] < value) continue;
+      if (expected == 300 || sequences[i] < sequences[expected]) expected = i;
+    }
+    EXPECT_EQ(bson_archive_seek_int64(&index, "seq", value), expected) << value;
+  }
+  EXPECT_EQ(bson_archive_seek_int64(&index, "seq", 200), 300u);
+  EXPECT_EQ(bson_archive_seek_int64(&index, "missing", 0), 300u);
+
+  EXPECT_EQ(bson_archive_find_utf8(&index, "meta.name", "name7", 5), 7u);
+  EXPECT_EQ(bson_archive_find_utf8(&index, "meta.name", "name49", 6), 49u);
+  EXPECT_EQ(bson_archive_find_utf8(&index, "meta.name", "name50", 6), 300u);
+  EXPECT_EQ(bson_archive_find_utf8(&index, "seq", "name7", 5), 300u);
+  bson_archive_close(&index);
+
+  // Replacing the archive by one of the same size makes the index stale
+  std::string const replaced_path = std::string(archive_path) + ".new";
+  f                               = fopen(replaced_path.c_str(), "wb");
+  ASSERT_TRUE(f);
+  fwrite(archive.data(), 1, archive.size(), f);
+  fclose(f);
+  ASSERT_EQ(rename(replaced_path.c_str(), archive_path), 0);
+  EXPECT_EQ(bson_archive_open(&index, archive_path, NULL), BSON_ARCHIVE_ERROR_STALE);
+  ASSERT_EQ(bson_archive_index(archive_path, NULL, keys, 2), BSON_ARCHIVE_OK);
+
+  // Appending to the archive makes the index stale
+  f = fopen(archive_path, "ab");
+  ASSERT_TRUE(f);
+  fwrite(BSON_EMPTY, 1, 5, f);
+  fclose(f);
+  EXPECT_EQ(bson_archive_open(&index, archive_path, NULL), BSON_ARCHIVE_ERROR_STALE);
+  ASSERT_EQ(bson_archive_index(archive_path, NULL, NULL, 0), BSON_ARCHIVE_OK);
+  ASSERT_EQ(bson_archive_open(&index, archive_path, NULL), BSON_ARCHIVE_OK);
+  EXPECT_EQ(index.count, 301u);
+  EXPECT_EQ(index.key_count, 0u);
+  EXPECT_EQ(bson_archive_seek_int64(&index, "seq", 0), 301u);
+  bson_archive_close(&index);
+
+  EXPECT_EQ(bson_archive_open(&index, archive_path, archive_path), BSON_ARCHIVE_ERROR_INDEX);
+  EXPECT_EQ(bson_archive_open(&index, "/nonexistent.bson", NULL), BSON_ARCHIVE_ERROR_READ);
+
+  char const* invalid[] = {"a..b"};
+  EXPECT_EQ(bson_archive_index(archive_path, NULL, invalid, 1), BSON_ARCHIVE_ERROR_KEY);
+
+  f = fopen(archive_path, "ab");
+  ASSERT_TRUE(f);
+  fwrite(BSON_EMPTY, 1, 3, f);
+  fclose(f);
+  EXPECT_EQ(bson_archive_index(archive_path, NULL, keys, 2), BSON_ARCHIVE_ERROR_INVALID);
+
+  // A size prefix that holds but a string length running past the document
+  memcpy(&archive[20], "\xff\xff\xff\x7f", 4);
+  f = fopen(archive_path, "wb");
+  ASSERT_TRUE(f);
+  fwrite(archive.data(), 1, archive.size(), f);
+  fclose(f);
+  EXPECT_EQ(bson_archive_index(archive_path, NULL, keys, 2), BSON_ARCHIVE_ERROR_INVALID);
+  EXPECT_EQ(bson_archive_index(archive_path, NULL, NULL, 0), BSON_ARCHIVE_OK);
+
+  remove(archive_path);
+  remove(index_path.c_str());
+}
+
 int
 main(int argc, char** argv) {
   ::testing::InitGoogleTest(&argc, argv);
@@ -18,9 +18,13 @@
 
 #include <cstdlib>
 
+#include <chrono>
+#include <functional>
 #include <iostream>
 #include <set>
+#include <stdexcept>
 #include <string>
+#include <thread>
 
 #include <gtest/gtest.h>
 
@@ -58,6 +62,20 @@ static char const* const message1 =
     "\x00" // }
     "\x00";
 
+// Concatenated encodings of make(0) to make(count - 1), offsets receiving where each one starts
+static std::vector<char>
+make_stream(
+    int32_t count,
+    std::function<bson::Object(int32_t)> const& make,
+    std::vector<size_t>* offsets = nullptr) {
+  std::vector<char> stream;
+  for (int32_t i = 0; i < count; ++i) {
+    if (offsets) offsets->push_back(stream.size());
+    bson::encode(make(i), stream);
+  }
+  return stream;
+}
+
 TEST(bson, decode) {
   uint32_t message_size = bson_get_size(message1, NULL);
 
@@ -90,12 +108,12 @@ TEST(bson, decode) {
         bson::Variant const& sub_var = sub_it->second;
         EXPECT_EQ(sub_var.getType(), BSON_ARRAY);
 
-        bson::Object const& sub_value = sub_var.asArray();
+        bson::Array const& sub_value = sub_var.asArray();
         {
           auto sub_sub_it = sub_value.find(0);
           ASSERT_NE(sub_sub_it, sub_value.end());
 
-          bson::Variant const& sub_sub_var = sub_sub_it->second;
+          bson::Variant const& sub_sub_var = *sub_sub_it;
           EXPECT_EQ(sub_sub_var.getType(), BSON_INT32);
           EXPECT_EQ(sub_sub_var.asInt32(), (int32_t) 0x0c);
         }
@@ -104,7 +122,7 @@ TEST(bson, decode) {
           auto sub_sub_it = sub_value.find(1);
           ASSERT_NE(sub_sub_it, sub_value.end());
 
-          bson::Variant const& sub_sub_var = sub_sub_it->second;
+          bson::Variant const& sub_sub_var = *sub_sub_it;
           EXPECT_EQ(sub_sub_var.getType(), BSON_INT32);
           EXPECT_EQ(sub_sub_var.asInt32(), (int32_t) 0x17);
         }
@@ -113,7 +131,7 @@ TEST(bson, decode) {
           auto sub_sub_it = sub_value.find(2);
           ASSERT_NE(sub_sub_it, sub_value.end());
 
-          bson::Variant const& sub_sub_var = sub_sub_it->second;
+          bson::Variant const& sub_sub_var = *sub_sub_it;
           EXPECT_EQ(sub_sub_var.getType(), BSON_INT64);
           EXPECT_EQ(sub_sub_var.asInt64(), (int64_t) 0xefcdab8967452301);
         }
@@ -139,6 +157,327 @@ TEST(bson, encode) {
   EXPECT_EQ(memcmp(encoded.data(), message, size), 0);
 }
 
+TEST(bson, encode_append) {
+  uint32_t size    = bson_get_size(message1, NULL);
+  bson::Object obj = bson::decode(message1);
+
+  std::vector<char> output;
+  for (int i = 0; i < 2; ++i) {
+    output.clear();
+    bson::encode(obj, output);
+    ASSERT_EQ(output.size(), size);
+    EXPECT_EQ(memcmp(output.data(), message1, size), 0);
+  }
+
+  std::string str = "prefix";
+  bson::encode(obj, str);
+  bson::encode(obj, str);
+  ASSERT_EQ(str.size(), 6 + 2 * size);
+  EXPECT_EQ(str.compare(6 + size, size, message1, size), 0);
+
+  char storage[16];
+  bson_buffer_t buffer;
+  bson_buffer_init(&buffer, storage, sizeof(storage));
+  bson::encode(obj, &buffer);
+  ASSERT_EQ(buffer.size, size);
+  EXPECT_EQ(memcmp(buffer.data, message1, size), 0);
+  bson_buffer_destroy(&buffer);
+}
+
+TEST(Object, wide) {
+  bson::Object obj;
+  for (int32_t i = 0; i < 500; ++i) obj["key" + std::to_string(i)] = i;
+  obj["key42"] = (int32_t) -42;
+
+  ASSERT_EQ(obj.size(), 500u);
+
+  int32_t expected = 0;
+  for (auto const& value : obj) {
+    EXPECT_EQ(value.first, "key" + std::to_string(expected));
+    ++expected;
+  }
+
+  bson::Object const cpy = bson::decode(bson::encode(obj).data());
+  ASSERT_EQ(cpy.size(), 500u);
+  for (int32_t i = 0; i < 500; ++i) {
+    std::string const key = "key" + std::to_string(i);
+    ASSERT_TRUE(cpy.has(key));
+    EXPECT_EQ(cpy[key].asInt32(), i == 42 ? -42 : i);
+    EXPECT_EQ(cpy.find(key)->first, key);
+  }
+
+  EXPECT_FALSE(cpy.has("key500"));
+  EXPECT_EQ(cpy.find("key500"), cpy.end());
+  EXPECT_EQ(cpy["key500"].getType(), BSON_END);
+}
+
+TEST(Array, wide) {
+  bson::Object obj;
+  bson::Array& array = obj["values"].setArray(bson::Array()).asArray();
+  for (int32_t i = 0; i < 2000; ++i) array.append() = i;
+  array[1500] = (int32_t) -1500;
+
+  ASSERT_EQ(array.size(), 2000u);
+  EXPECT_TRUE(array.has(1999));
+  EXPECT_FALSE(array.has(2000));
+  EXPECT_EQ(array.find(2000), array.end());
+
+  auto encoded = bson::encode(obj);
+  EXPECT_EQ(encoded.size(), bson::encode_len(obj));
+
+  bson::View const values = bson::View(encoded.data())["values"].asArray();
+  EXPECT_EQ(values[999].asInt32(), 999);
+  EXPECT_STREQ(values.find(1999)->getName(), "1999");
+
+  bson::Object const cpy     = bson::decode(encoded.data());
+  bson::Array const& decoded = cpy["values"].asArray();
+  ASSERT_EQ(decoded.size(), 2000u);
+  for (int32_t i = 0; i < 2000; ++i) EXPECT_EQ(decoded[i].asInt32(), i == 1500 ? -1500 : i);
+  EXPECT_EQ(cpy["values"][1500].asInt32(), -1500);
+  EXPECT_EQ(decoded[2000].getType(), BSON_END);
+}
+
+TEST(Array, out_of_range) {
+  bson::Object obj;
+  bson::Array& array = obj["values"].setArray(bson::Array()).asArray();
+  array.append()     = (int32_t) 1;
+  array[1]           = (int32_t) 2;
+  EXPECT_THROW(array[3], std::out_of_range);
+  EXPECT_THROW(array[UINT32_MAX], std::out_of_range);
+  EXPECT_THROW(obj["values"]["x"], std::out_of_range);
+  EXPECT_THROW(obj["values"]["01"], std::out_of_range);
+  EXPECT_THROW(obj["values"]["5"], std::out_of_range);
+  obj["values"]["2"] = (int32_t) 3;
+  ASSERT_EQ(array.size(), 3u);
+
+  std::vector<char> const encoded = bson::encode(obj);
+  ASSERT_EQ(encoded.size(), bson::encode_len(obj));
+  EXPECT_TRUE(bson_validate(encoded.data(), encoded.size(), BSON_VALIDATE_NONE, NULL));
+  EXPECT_EQ(bson::View(encoded.data())["values"][2].asInt32(), 3);
+}
+
+TEST(Object, encoded_size) {
+  bson::Object obj = bson::decode(message1);
+  uint32_t size    = bson_get_size(message1, NULL);
+  EXPECT_EQ(bson::encode_len(obj), size);
+  EXPECT_EQ(bson::encode_len(obj), size);
+
+  // Writing into a nested document drops the sizes on the way to it
+  obj["value"]["test"][0] = (int64_t) 12;
+  EXPECT_EQ(bson::encode_len(obj), size + 4);
+  obj["value"]["test"].asArray().append() = (int32_t) 1;
+  EXPECT_EQ(bson::encode_len(obj), size + 11);
+  EXPECT_EQ(bson::encode(obj).size(), size + 11);
+
+  bson::Object const copy = obj;
+  EXPECT_EQ(bson::encode_len(copy), size + 11);
+
+  bson::Object moved = std::move(obj);
+  EXPECT_EQ(bson::encode_len(moved), size + 11);
+  EXPECT_EQ(bson::encode_len(obj), 5u);
+}
+
+TEST(Object, encoded_size_held_reference) {
+  bson::Object obj;
+  bson::Variant& value = obj["a"];
+  value                = "x";
+  EXPECT_EQ(bson::encode_len(obj), 14u);
+
+  // Writes through references taken before sizing drop the cached size
+  value = std::string(100, 'y');
+  std::vector<char> buffer(bson::encode_len(obj));
+  ASSERT_EQ(buffer.size(), 113u);
+  bson::encode(obj, buffer.data());
+  EXPECT_EQ(bson_get_size(buffer.data(), NULL), 113u);
+
+  bson::Object& nested = obj["b"].setObject(bson::Object()).asObject();
+  bson::Array& array   = nested["c"].setArray(bson::Array()).asArray();
+  array.append()       = (int32_t) 1;
+  uint32_t size        = bson::encode_len(obj);
+  array[0]             = (int64_t) 1;
+  EXPECT_EQ(bson::encode_len(obj), size + 4);
+
+  // Binaries are resized through their buffer, asking for one drops the sizes
+  nested["d"] = bson::Binary();
+  size        = bson::encode_len(obj);
+  EXPECT_EQ(bson::encode_len(obj), size);
+  nested["d"].asBinary().get().resize(10);
+  EXPECT_EQ(bson::encode_len(obj), size + 10);
+}
+
+TEST(Object, encoded_size_embedded_nul) {
+  bson::Object obj;
+  obj["a"] = std::string("x\0y", 3);
+  ASSERT_EQ(bson::encode_len(obj), 16u);
+
+  std::vector<char> buffer(bson::encode_len(obj));
+  bson::encode(obj, buffer.data());
+  EXPECT_EQ(memcmp(buffer.data(), bson::encode(obj).data(), buffer.size()), 0);
+
+  uint32_t size;
+  char const* str = bson::View(buffer.data())["a"].asString(&size);
+  ASSERT_EQ(size, 3u);
+  EXPECT_EQ(memcmp(str, "x\0y", 3), 0);
+}
+
+TEST(View, find) {
+  bson::View view(message1);
+  EXPECT_EQ(view.size(), 0x45u);
+  EXPECT_EQ(view.count(), 2u);
+
+  bson::ElementRef dest = view["dest"];
+  ASSERT_TRUE(dest);
+  ASSERT_EQ(dest.getType(), BSON_STRING);
+  uint32_t dest_size;
+  EXPECT_STREQ(dest.asString(&dest_size), "cloud");
+  EXPECT_EQ(dest_size, 5u);
+
+  EXPECT_FALSE(view["missing"]);
+  EXPECT_EQ(view["missing"].getType(), BSON_END);
+  EXPECT_FALSE(view["missing"]["x"]);
+  EXPECT_FALSE(view["missing"][0]["x"]);
+  EXPECT_FALSE(view["dest"]["x"]);
+  EXPECT_EQ(view["dest"].asObject().size(), 5u);
+  EXPECT_EQ(view.find("missing"), view.end());
+  EXPECT_TRUE(view.has("value"));
+  EXPECT_FALSE(view.has(0));
+
+  bson::ElementRef test = view["value"]["test"];
+  ASSERT_EQ(test.getType(), BSON_ARRAY);
+  EXPECT_EQ(test[0].asInt32(), (int32_t) 0x0c);
+  EXPECT_EQ(test[1].asInt32(), (int32_t) 0x17);
+  EXPECT_EQ(test[2].asInt64(), (int64_t) 0xefcdab8967452301);
+  EXPECT_FALSE(test[3]);
+}
+
+TEST(View, iterate) {
+  bson::View array = bson::View(message1)["value"]["test"].asArray();
+
+  std::vector<std::string> names;
+  for (bson::ElementRef const& elem : array) names.push_back(elem.getName());
+
+  EXPECT_EQ(names, std::vector<std::string>({"0", "1", "2"}));
+  EXPECT_TRUE(bson::View().empty());
+  EXPECT_EQ(bson::View().begin(), bson::View().end());
+}
+
+TEST(View, path) {
+  bson::View view(message1);
+  bson::Path const path("value.test.1");
+  ASSERT_TRUE(path.valid());
+  EXPECT_EQ(view[path].asInt32(), (int32_t) 0x17);
+
+  bson::Path const copy = path;
+  EXPECT_EQ(view[copy].data(), view["value"]["test"][1].data());
+
+  EXPECT_TRUE(view.has(bson::Path("value.test")));
+  EXPECT_FALSE(view.has(bson::Path("value.test.9")));
+  EXPECT_FALSE(bson::Path("value..test").valid());
+  EXPECT_FALSE(view[bson::Path("")]);
+}
+
+TEST(View, projection) {
+  bson::View view(message1);
+  bson::Projection const projection({"value", "missing", "dest"});
+  ASSERT_TRUE(projection.valid());
+
+  std::vector<bson::ElementRef> fields;
+  EXPECT_EQ(projection.extract(view, fields), 2u);
+  ASSERT_EQ(fields.size(), 3u);
+  EXPECT_EQ(fields[0].asObject()["test"][0].asInt32(), (int32_t) 0x0c);
+  EXPECT_FALSE(fields[1]);
+  EXPECT_STREQ(fields[2].asString(), "cloud");
+  EXPECT_STREQ(fields[2].getName(), "dest");
+
+  bson::Projection const copy = projection;
+  EXPECT_EQ(copy.extract(bson::View(), fields), 0u);
+  EXPECT_FALSE(fields[2]);
+  EXPECT_FALSE(bson::Projection({"a", "a"}).valid());
+}
+
+TEST(ColumnExtractor, append) {
+  std::vector<char> const stream = make_stream(20, [](int32_t i) {
+    bson::Object obj;
+    obj["id"] = i;
+    if (i % 3) obj["value"] = i * 0.5;
+    if (i % 5 == 0) obj["value"] = (int64_t) i;
+    obj["ok"] = i % 2 == 0;
+
+    bson::Object& meta = obj["meta"].setObject(bson::Object()).asObject();
+    meta["name"]       = i % 4 ? "n" + std::to_string(i) : "";
+    if (i == 7) meta["name"] = i;
+    bson::Array& tags = meta["tags"].setArray(bson::Array()).asArray();
+    tags.append()     = "first";
+    tags.append()     = i;
+    return obj;
+  });
+
+  bson::ColumnExtractor extractor({
+      {"id", BSON_INT64},
+      {"value", BSON_DOUBLE},
+      {"ok", BSON_BOOLEAN},
+      {"meta.name", BSON_STRING},
+      {"meta.tags.1", BSON_INT32},
+      {"id.nested", BSON_INT32},
+      {"missing", BSON_INT32},
+  });
+  ASSERT_TRUE(extractor.valid());
+  EXPECT_EQ(extractor.append(stream.data(), stream.size()), BSON_READER_EOF);
+  ASSERT_EQ(extractor.size(), 20u);
+
+  bson::Column const& id    = extractor[0];
+  bson::Column const& value = extractor[1];
+  bson::Column const& name  = extractor[3];
+  for (int32_t i = 0; i < 20; ++i) {
+    EXPECT_EQ(id.int64s()[i], i);
+    EXPECT_FALSE(id.isNull(i));
+    EXPECT_EQ(value.isNull(i), i % 3 == 0 && i % 5 != 0) << i;
+    EXPECT_EQ(value.doubles()[i], i % 5 == 0 ? i : i % 3 ? i * 0.5 : 0) << i;
+    EXPECT_EQ(extractor[2].bools()[i], i % 2 == 0);
+    EXPECT_EQ(name.isNull(i), i == 7);
+    EXPECT_EQ(name.str(i), i % 4 && i != 7 ? "n" + std::to_string(i) : "");
+    EXPECT_EQ(extractor[4].int32s()[i], i);
+    EXPECT_TRUE(extractor[5].isNull(i));
+    EXPECT_TRUE(extractor[6].isNull(i));
+  }
+  EXPECT_EQ(value.nullCount(), 5u);
+  EXPECT_EQ(name.offsets()[20], name.offsets()[19] + 3);
+  EXPECT_EQ(extractor[6].nulls()[0], 0xff);
+  EXPECT_EQ(extractor[6].nulls()[2], 0x0f);
+
+  // Rows before a truncated document are kept
+  bson::ColumnExtractor copy = extractor;
+  copy.clear();
+  EXPECT_EQ(copy.append(stream.data(), stream.size() - 1), BSON_READER_ERROR_TRUNCATED);
+  EXPECT_EQ(copy.size(), 19u);
+  EXPECT_EQ(copy[3].str(18), "n18");
+  copy.append(bson::View(message1));
+  EXPECT_EQ(copy.size(), 20u);
+  EXPECT_TRUE(copy[0].isNull(19));
+
+  EXPECT_FALSE(bson::ColumnExtractor({{"a..b", BSON_INT32}}).valid());
+  EXPECT_FALSE(bson::ColumnExtractor({{"a", BSON_OBJECT}}).valid());
+}
+
+TEST(View, index) {
+  bson::View const test = bson::View(message1)["value"]["test"].asArray();
+
+  bson::Index const index(test);
+  ASSERT_TRUE(index.valid());
+  ASSERT_EQ(index.size(), 3u);
+  EXPECT_EQ(index[0].asInt32(), (int32_t) 0x0c);
+  EXPECT_EQ(index[2].asInt64(), (int64_t) 0xefcdab8967452301);
+  EXPECT_EQ(index["1"].data(), test[1].data());
+  EXPECT_FALSE(index[3]);
+  EXPECT_FALSE(index["3"]);
+
+  bson::Arena arena;
+  bson::Index moved = bson::Index(bson::View(message1), arena, BSON_INDEX_POSITIONS);
+  EXPECT_GT(arena.used(), 0u);
+  EXPECT_STREQ(moved[0].asString(), "cloud");
+  EXPECT_STREQ(moved["value"].getName(), "value");
+}
+
 TEST(Variant, can_copy_binary) {
   bson::Variant var;
   var = bson::Binary(BSON_BINARY_BINARY);
@@ -151,6 +490,199 @@ TEST(Variant, can_copy_binary) {
   EXPECT_EQ(cpy2.getType(), BSON_BINARY);
 }
 
+TEST(Variant, can_move) {
+  static_assert(std::is_nothrow_move_constructible<bson::Variant>::value, "");
+  static_assert(std::is_nothrow_move_assignable<bson::Variant>::value, "");
+  static_assert(std::is_nothrow_move_constructible<bson::Object>::value, "");
+  static_assert(std::is_nothrow_move_constructible<bson::Array>::value, "");
+  static_assert(std::is_nothrow_move_constructible<bson::Binary>::value, "");
+
+  bson::Object obj        = bson::decode(message1);
+  bson::Array const* test = &obj["value"]["test"].asArray();
+
+  bson::Variant var;
+  var.setObject(std::move(obj));
+  bson::Variant moved(std::move(var));
+  EXPECT_EQ(var.getType(), BSON_END);
+  ASSERT_EQ(moved.getType(), BSON_OBJECT);
+  EXPECT_EQ(&moved["value"]["test"].asArray(), test);
+
+  var = std::move(moved);
+  EXPECT_EQ(moved.getType(), BSON_END);
+  EXPECT_STREQ(var["dest"].asString(), "cloud");
+
+  std::string str(64, 'x');
+  char const* str_data = str.data();
+  var["dest"]          = std::move(str);
+  EXPECT_EQ(var["dest"].asString(), str_data);
+
+  bson::Variant const& self = var;
+  var                       = self;
+  EXPECT_EQ(std::string(var["dest"].asString()), std::string(64, 'x'));
+}
+
+TEST(Variant, array_keys) {
+  bson::Object obj = bson::decode(message1);
+
+  obj["value"]["test"]["1"] = (int32_t) 5;
+  obj["value"]["test"]["3"] = (int32_t) 6;
+
+  bson::Array const& test = obj["value"]["test"].asArray();
+  ASSERT_EQ(test.size(), 4u);
+  EXPECT_EQ(test[1].asInt32(), 5);
+  EXPECT_EQ(test[3].asInt32(), 6);
+
+  bson::Variant const& value = obj["value"];
+  EXPECT_EQ(value["test"]["3"].asInt32(), 6);
+  EXPECT_EQ(value["test"]["4"].getType(), BSON_END);
+  EXPECT_EQ(value["test"]["01"].getType(), BSON_END);
+  EXPECT_EQ(value["test"]["x"].getType(), BSON_END);
+  EXPECT_EQ(value["test"]["4294967295"].getType(), BSON_END);
+  EXPECT_EQ(value["dest"]["x"].getType(), BSON_END);
+  EXPECT_EQ(value["test"]["3"]["x"].getType(), BSON_END);
+}
+
+TEST(Arena, decode) {
+  bson::Arena arena(64);
+  bson::Object copy;
+  {
+    bson::Object obj = bson::decode(message1, arena);
+    EXPECT_GT(arena.used(), 0u);
+    EXPECT_STREQ(obj["dest"].asString(), "cloud");
+    EXPECT_EQ(obj["value"]["test"][2].asInt64(), (int64_t) 0xefcdab8967452301);
+
+    auto encoded = bson::encode(obj);
+    EXPECT_EQ(memcmp(encoded.data(), message1, encoded.size()), 0);
+
+    copy        = obj;
+    obj["dest"] = "moved to the heap";
+    EXPECT_STREQ(obj["dest"].asString(), "moved to the heap");
+  }
+
+  arena.reset();
+  EXPECT_EQ(arena.used(), 0u);
+
+  // The copy does not share anything with the arena
+  bson::Object other = bson::decode(BSON_EMPTY, arena);
+  EXPECT_EQ(other.size(), 0u);
+  EXPECT_STREQ(copy["dest"].asString(), "cloud");
+  EXPECT_EQ(copy["value"]["test"][0].asInt32(), 0x0c);
+}
+
+TEST(Arena, embedded_nul) {
+  bson::Object obj;
+  obj["a"]     = std::string("x\0y", 3);
+  auto encoded = bson::encode(obj);
+
+  bson::Arena arena;
+  bson::Object decoded = bson::decode(encoded.data(), arena);
+  uint32_t size;
+  char const* str = decoded["a"].asString(&size);
+  ASSERT_EQ(size, 3u);
+  EXPECT_EQ(memcmp(str, "x\0y", 3), 0);
+  EXPECT_EQ(bson::encode(decoded), encoded);
+
+  bson::Object const copy = decoded;
+  copy["a"].asString(&size);
+  EXPECT_EQ(size, 3u);
+}
+
+TEST(WorkerPool, run) {
+  bson::WorkerPool pool(4);
+  EXPECT_EQ(pool.size(), 4u);
+
+  // Uneven work so that idle workers steal from the busy ones
+  std::vector<std::atomic<int>> calls(10000);
+  for (std::atomic<int>& call : calls) call = 0;
+  pool.run(calls.size(), [&](size_t item, size_t worker) {
+    EXPECT_LT(worker, 4u);
+    if (worker == 0) std::this_thread::sleep_for(std::chrono::microseconds(10));
+    ++calls[item];
+  });
+  for (std::atomic<int> const& call : calls) EXPECT_EQ(call, 1);
+
+  EXPECT_THROW(
+      pool.run(100, [](size_t item, size_t) {
+        if (item == 42) throw std::runtime_error("item");
+      }),
+      std::runtime_error);
+
+  // Still usable after a failure
+  std::atomic<size_t> sum(0);
+  pool.run(100, [&](size_t item, size_t) { sum += item; });
+  EXPECT_EQ(sum, 4950u);
+}
+
+TEST(bson, decode_batch) {
+  std::vector<size_t> offsets;
+  std::vector<char> const stream = make_stream(
+      1000,
+      [](int32_t i) {
+        bson::Object obj;
+        obj["id"]   = i;
+        obj["name"] = "document" + std::to_string(i);
+        return obj;
+      },
+      &offsets);
+
+  std::vector<char const*> documents;
+  for (size_t offset : offsets) documents.push_back(stream.data() + offset);
+
+  bson::WorkerPool pool(3);
+  std::vector<bson::Object> results;
+  bson::decode_batch(documents.data(), documents.size(), pool, results);
+  ASSERT_EQ(results.size(), 1000u);
+  for (int32_t i = 0; i < 1000; ++i) {
+    EXPECT_EQ(results[i]["id"].asInt32(), i);
+    std::vector<char> const encoded = bson::encode(results[i]);
+    EXPECT_EQ(memcmp(encoded.data(), documents[i], encoded.size()), 0);
+  }
+
+  EXPECT_EQ(bson::decode_batch(stream.data(), stream.size(), pool, results), BSON_READER_EOF);
+  ASSERT_EQ(results.size(), 1000u);
+  EXPECT_STREQ(results[999]["name"].asString(), "document999");
+
+  EXPECT_EQ(
+      bson::decode_batch(stream.data(), stream.size() - 1, pool, results),
+      BSON_READER_ERROR_TRUNCATED);
+  EXPECT_TRUE(results.empty());
+}
+
+TEST(JsonWriter, write) {
+  std::string const expected =
+      "{\"dest\":\"cloud\",\"value\":{\"test\":[12,23,-1167088121787636991]}}";
+
+  bson::JsonWriter writer;
+  ASSERT_TRUE(writer.write(bson::View(message1)));
+  EXPECT_EQ(writer.str(), expected);
+  EXPECT_EQ(strlen(writer.data()), writer.size());
+
+  writer.clear();
+  ASSERT_TRUE(writer.write(bson::View(message1)["value"].asObject()));
+  EXPECT_EQ(writer.str(), "{\"test\":[12,23,-1167088121787636991]}");
+
+  EXPECT_EQ(bson::to_json(bson::decode(message1)), expected);
+  EXPECT_EQ(
+      bson::to_json(message1, BSON_JSON_CANONICAL),
+      "{\"dest\":\"cloud\",\"value\":{\"test\":[{\"$numberInt\":\"12\"},"
+      "{\"$numberInt\":\"23\"},{\"$numberLong\":\"-1167088121787636991\"}]}}");
+}
+
+TEST(JsonParser, parse) {
+  bson::JsonParser parser;
+  ASSERT_EQ(parser.parse(bson::to_json(message1)), BSON_JSON_OK);
+  ASSERT_EQ(parser.size(), (size_t) bson_get_size(message1, NULL));
+  EXPECT_EQ(memcmp(parser.data(), message1, parser.size()), 0);
+  EXPECT_EQ(parser.view()["value"]["test"][1].asInt32(), 23);
+
+  ASSERT_EQ(parser.parse("{\"id\": {\"$numberLong\": \"42\"}}"), BSON_JSON_OK);
+  EXPECT_EQ(parser.view()["id"].getType(), BSON_INT64);
+  EXPECT_EQ(parser.view()["id"].asInt64(), 42);
+
+  EXPECT_EQ(parser.parse("{\"id\": 42,"), BSON_JSON_ERROR_SYNTAX);
+  EXPECT_EQ(parser.error_offset(), 10u);
+}
+
 char const* test_filepath = NULL;
 
 TEST(bson, decode_large) {
@@ -193,6 +725,63 @@ TEST(bson, decode_large) {
   EXPECT_EQ(memcmp(encoded.data(), message.get(), size), 0);
 }
 
+TEST(bson, scan) {
+  std::vector<size_t> offsets;
+  std::vector<char> stream = make_stream(
+      500,
+      [](int32_t i) {
+        bson::Object obj;
+        obj["id"]   = i;
+        obj["name"] = std::string(i % 50, 'x');
+        return obj;
+      },
+      &offsets);
+
+  bson::WorkerPool pool(3);
+  std::vector<std::atomic<int>> calls(500);
+  auto check = [&](char const* doc, size_t index, size_t worker) {
+    EXPECT_LT(worker, 3u);
+    ASSERT_LT(index, 500u);
+    EXPECT_EQ(bson::View(doc)["id"].asInt32(), (int32_t) index);
+    ++calls[index];
+  };
+  auto expect_calls = [&](size_t count) {
+    for (size_t i = 0; i < calls.size(); ++i) EXPECT_EQ(calls[i].exchange(0), i < count ? 1 : 0);
+  };
+
+  // Small ranges so that they are spread over the workers
+  for (std::atomic<int>& call : calls) call = 0;
+  EXPECT_EQ(bson::scan(stream.data(), stream.size(), pool, check, 256), BSON_READER_EOF);
+  expect_calls(500);
+
+  // Documents before the truncated one are still scanned
+  EXPECT_EQ(
+      bson::scan(stream.data(), offsets[321] + 10, pool, check, 256),
+      BSON_READER_ERROR_TRUNCATED);
+  expect_calls(321);
+
+  // Streamed in chunks, positions go on from one chunk to the next
+  bson_reader_t reader;
+  bson_reader_init_buffer(&reader, stream.data(), stream.size());
+  EXPECT_EQ(bson::scan(&reader, pool, check, 1000), BSON_READER_EOF);
+  bson_reader_destroy(&reader);
+  expect_calls(500);
+
+  std::atomic<int> file_calls(0);
+  EXPECT_EQ(
+      bson::scan_file(
+          test_filepath,
+          pool,
+          [&](char const* doc, size_t index, size_t) {
+            EXPECT_EQ(index, 0u);
+            EXPECT_TRUE(bson::View(doc).has("payload"));
+            ++file_calls;
+          }),
+      BSON_READER_EOF);
+  EXPECT_EQ(file_calls, 1);
+  EXPECT_EQ(bson::scan_file("/nonexistent.bson", pool, check), BSON_READER_ERROR_READ);
+}
+
 int
 main(int argc, char** argv) {
   ::testing::InitGoogleTest(&argc, argv);